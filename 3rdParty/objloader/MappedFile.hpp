@@ -0,0 +1,100 @@
+#pragma once
+#include <string>
+#include <stdexcept>
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// <summary>
+/// A read only view of a whole file, memory mapped so it's only paged in as it's read.
+/// Throws std::runtime_error if the file can't be opened.
+/// </summary>
+class MappedFile
+{
+private:
+	const char* data_;
+	size_t size_;
+#ifdef _WIN32
+	HANDLE file_, mapping_;
+#else
+	int file_;
+#endif
+public:
+	explicit MappedFile(const std::string& filename)
+		:data_(nullptr), size_(0)
+	{
+#ifdef _WIN32
+		file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file_ == INVALID_HANDLE_VALUE) throw std::runtime_error("Unable to open file: " + filename);
+		LARGE_INTEGER size;
+		GetFileSizeEx(file_, &size);
+		size_ = static_cast<size_t>(size.QuadPart);
+		mapping_ = nullptr;
+		if (size_ > 0) {
+			mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping_) data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+			if (!data_) {
+				close();
+				throw std::runtime_error("Unable to map file: " + filename);
+			}
+		}
+#else
+		file_ = open(filename.c_str(), O_RDONLY);
+		if (file_ < 0) throw std::runtime_error("Unable to open file: " + filename);
+		struct stat st;
+		if (fstat(file_, &st) != 0) {
+			close();
+			throw std::runtime_error("Unable to read file: " + filename);
+		}
+		size_ = static_cast<size_t>(st.st_size);
+		if (size_ > 0) {
+			void* mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file_, 0);
+			if (mapped == MAP_FAILED) {
+				close();
+				throw std::runtime_error("Unable to map file: " + filename);
+			}
+			madvise(mapped, size_, MADV_SEQUENTIAL);
+			data_ = static_cast<const char*>(mapped);
+		}
+#endif
+	}
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char* data() const { return data_; }
+	size_t size() const { return size_; }
+
+private:
+	void close()
+	{
+#ifdef _WIN32
+		if (data_) UnmapViewOfFile(data_);
+		if (mapping_) CloseHandle(mapping_);
+		CloseHandle(file_);
+#else
+		if (data_) munmap(const_cast<char*>(data_), size_);
+		::close(file_);
+#endif
+		data_ = nullptr;
+	}
+};
@@ -0,0 +1,390 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "MappedFile.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/// <summary>
+/// The indices used by one corner of a face in an obj file. The indices are zero based
+/// and already resolved, so negative (relative) indices in the file have been turned
+/// into absolute ones. tex and norm are -1 if the corner doesn't have them.
+/// </summary>
+struct ObjCorner
+{
+	int vert, tex, norm;
+};
+
+/// <summary>
+/// The contents of an obj file, as flat arrays in the order they appear in the file.
+/// Faces are kept as polygons: face f uses corners[faceStarts[f]] to
+/// corners[faceStarts[f + 1] - 1], so faceStarts has one more entry than there are faces.
+/// </summary>
+struct ObjData
+{
+	std::vector<float> positions; // x, y, z for each v
+	std::vector<float> texCoords; // u, v, w for each vt, with w = 0 if it isn't given
+	std::vector<float> normals; // x, y, z for each vn
+	std::vector<ObjCorner> corners;
+	std::vector<int> faceStarts;
+
+	int npositions() const { return static_cast<int>(positions.size() / 3); }
+	int ntexCoords() const { return static_cast<int>(texCoords.size() / 3); }
+	int nnormals() const { return static_cast<int>(normals.size() / 3); }
+	int nfaces() const { return static_cast<int>(faceStarts.size()) - 1; }
+	int faceSize(int f) const { return faceStarts[f + 1] - faceStarts[f]; }
+	const ObjCorner& corner(int f, int i) const { return corners[faceStarts[f] + i]; }
+};
+
+/// <summary>
+/// Loads the geometry from wavefront obj files: the v, vt, vn and f statements, with face
+/// corners written as v, v/vt, v//vn or v/vt/vn and positive or negative indices.
+/// Everything else (comments, groups, materials...) is skipped.
+///
+/// The file is memory mapped and split into chunks at line boundaries. Each chunk is
+/// parsed on its own thread by a hand written number parser into its own arrays, and the
+/// chunks are then concatenated. A negative index refers back from the line it is on, so
+/// it's resolved against the chunk's own counts while parsing and then offset by the
+/// number of elements in earlier chunks while merging.
+/// </summary>
+class ObjLoader
+{
+public:
+	/// <summary>
+	/// Loads an obj file. Throws std::runtime_error if the file can't be read or a face
+	/// refers to an element that doesn't exist.
+	/// </summary>
+	static ObjData load(const std::string& filename)
+	{
+		MappedFile file(filename);
+		return parse(file.data(), file.size());
+	}
+
+	/// <summary>
+	/// Parses obj text that is already in memory.
+	/// </summary>
+	static ObjData parse(const char* text, size_t size)
+	{
+		// Small files aren't worth splitting up.
+		const size_t minChunkSize = 1 << 20;
+		int nChunks = 1;
+#ifdef _OPENMP
+		nChunks = std::max(1, std::min(omp_get_max_threads() * 4, static_cast<int>(size / minChunkSize)));
+#endif
+
+		// Chunk c is [bounds[c], bounds[c + 1]), and every chunk but the first starts on a new line.
+		std::vector<size_t> bounds(nChunks + 1);
+		bounds[0] = 0;
+		bounds[nChunks] = size;
+		for (int c = 1; c < nChunks; ++c) {
+			size_t b = std::max(size / nChunks * c, bounds[c - 1]);
+			while (b < size && text[b - 1] != '\n') ++b;
+			bounds[c] = b;
+		}
+
+		// Exceptions can't leave a parallel loop, so errors are passed out of it instead.
+		std::vector<Chunk> chunks(nChunks);
+		std::vector<std::string> errors(nChunks);
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (int c = 0; c < nChunks; ++c) {
+			try {
+				parseChunk(text + bounds[c], text + bounds[c + 1], chunks[c]);
+			}
+			catch (const std::exception& e) {
+				errors[c] = e.what();
+			}
+		}
+		for (const std::string& error : errors) {
+			if (!error.empty()) throw std::runtime_error(error);
+		}
+
+		return merge(chunks);
+	}
+
+private:
+	/// <summary>
+	/// The elements from one chunk of the file. Negative face indices are resolved to the
+	/// chunk's own numbering (and may be negative if they refer to an earlier chunk);
+	/// relative has a bit for each index of each corner that still needs offsetting.
+	/// </summary>
+	struct Chunk
+	{
+		std::vector<float> positions, texCoords, normals;
+		std::vector<ObjCorner> corners;
+		std::vector<unsigned char> relative;
+		std::vector<int> faceSizes;
+	};
+
+	enum RelativeBits { RelativeVert = 1, RelativeTex = 2, RelativeNorm = 4 };
+
+	static bool isSpace(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	static bool isDigit(char c)
+	{
+		return c >= '0' && c <= '9';
+	}
+
+	static const char* skipSpace(const char* p, const char* end)
+	{
+		while (p < end && isSpace(*p)) ++p;
+		return p;
+	}
+
+	/// <summary>
+	/// Parses a (possibly signed) integer at p, returning the character after it, or
+	/// nullptr if there isn't one.
+	/// </summary>
+	static const char* parseInt(const char* p, const char* end, int& value)
+	{
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+		if (p == end || !isDigit(*p)) return nullptr;
+		int n = 0;
+		while (p < end && isDigit(*p)) n = n * 10 + (*p++ - '0');
+		value = negative ? -n : n;
+		return p;
+	}
+
+	/// <summary>
+	/// Parses a decimal floating point number at p, returning the character after it, or
+	/// nullptr if there isn't one. Up to 19 significant digits and exponents where the
+	/// power of ten is exact in a double are converted with one correctly rounded double
+	/// operation; anything else falls back to strtod.
+	/// </summary>
+	static const char* parseFloat(const char* p, const char* end, float& value)
+	{
+		static const double powersOf10[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+		};
+
+		const char* start = p;
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+		uint64_t mantissa = 0;
+		int digits = 0, exponent = 0;
+		bool anyDigits = false;
+		while (p < end && isDigit(*p)) {
+			anyDigits = true;
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa != 0) ++digits;
+			}
+			else {
+				++exponent;
+			}
+			++p;
+		}
+		if (p < end && *p == '.') {
+			++p;
+			while (p < end && isDigit(*p)) {
+				anyDigits = true;
+				if (digits < 19) {
+					mantissa = mantissa * 10 + (*p - '0');
+					if (mantissa != 0) ++digits;
+					--exponent;
+				}
+				++p;
+			}
+		}
+		if (!anyDigits) return parseFloatSlow(start, end, value);
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			int e;
+			const char* q = parseInt(p + 1, end, e);
+			if (!q) return parseFloatSlow(start, end, value);
+			exponent += e;
+			p = q;
+		}
+
+		double d = static_cast<double>(mantissa);
+		if (mantissa >= (uint64_t(1) << 53) || exponent < -22 || exponent > 22)
+			return parseFloatSlow(start, end, value);
+		d = exponent < 0 ? d / powersOf10[-exponent] : d * powersOf10[exponent];
+		value = static_cast<float>(negative ? -d : d);
+		return p;
+	}
+
+	static const char* parseFloatSlow(const char* p, const char* end, float& value)
+	{
+		// strtod needs a terminated string, and the mapped file isn't one.
+		char buffer[128];
+		size_t n = 0;
+		while (p + n < end && n < sizeof(buffer) - 1 && !isSpace(p[n]) && p[n] != '\n') {
+			buffer[n] = p[n];
+			++n;
+		}
+		buffer[n] = '\0';
+		char* parsedEnd;
+		double d = std::strtod(buffer, &parsedEnd);
+		if (parsedEnd == buffer) return nullptr;
+		value = static_cast<float>(d);
+		return p + (parsedEnd - buffer);
+	}
+
+	/// <summary>
+	/// Reads up to maxCount floats into out, filling any that are missing with zero.
+	/// </summary>
+	static void parseFloats(const char* p, const char* end, int count, int maxCount, std::vector<float>& out)
+	{
+		for (int i = 0; i < maxCount; ++i) {
+			float value = 0.f;
+			const char* q = p ? parseFloat(skipSpace(p, end), end, value) : nullptr;
+			if (q) {
+				p = q;
+			}
+			else {
+				p = nullptr;
+				value = 0.f;
+			}
+			if (i < count) out.push_back(value);
+		}
+	}
+
+	/// <summary>
+	/// Turns a one based index from the file into a zero based one. Negative indices count
+	/// back from the number of elements read so far in this chunk, so are marked relative.
+	/// </summary>
+	static int resolveIndex(int index, int count, unsigned char bit, unsigned char& relative)
+	{
+		if (index > 0) return index - 1;
+		if (index < 0) {
+			relative |= bit;
+			return count + index;
+		}
+		throw std::runtime_error("Obj file has a face with an index of 0!");
+	}
+
+	static void parseChunk(const char* p, const char* end, Chunk& chunk)
+	{
+		while (p < end) {
+			const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', end - p));
+			if (!lineEnd) lineEnd = end;
+			parseLine(skipSpace(p, lineEnd), lineEnd, chunk);
+			p = lineEnd + 1;
+		}
+	}
+
+	static void parseLine(const char* p, const char* end, Chunk& chunk)
+	{
+		if (end - p < 2) return;
+
+		if (p[0] == 'v' && isSpace(p[1])) {
+			parseFloats(p + 2, end, 3, 3, chunk.positions);
+		}
+		else if (p[0] == 'v' && p[1] == 't' && end - p > 2 && isSpace(p[2])) {
+			parseFloats(p + 3, end, 3, 3, chunk.texCoords);
+		}
+		else if (p[0] == 'v' && p[1] == 'n' && end - p > 2 && isSpace(p[2])) {
+			parseFloats(p + 3, end, 3, 3, chunk.normals);
+		}
+		else if (p[0] == 'f' && isSpace(p[1])) {
+			const int nPositions = static_cast<int>(chunk.positions.size() / 3);
+			const int nTexCoords = static_cast<int>(chunk.texCoords.size() / 3);
+			const int nNormals = static_cast<int>(chunk.normals.size() / 3);
+			int size = 0;
+			p = skipSpace(p + 2, end);
+			while (p < end && *p != '#') {
+				ObjCorner corner = { 0, -1, -1 };
+				unsigned char relative = 0;
+				int index;
+				p = parseInt(p, end, index);
+				if (!p) throw std::runtime_error("Obj file has a face corner without a vertex index!");
+				corner.vert = resolveIndex(index, nPositions, RelativeVert, relative);
+				if (p < end && *p == '/') {
+					++p;
+					if (p < end && *p != '/') {
+						p = parseInt(p, end, index);
+						if (!p) throw std::runtime_error("Obj file has a badly formed face!");
+						corner.tex = resolveIndex(index, nTexCoords, RelativeTex, relative);
+					}
+					if (p < end && *p == '/') {
+						p = parseInt(p + 1, end, index);
+						if (!p) throw std::runtime_error("Obj file has a badly formed face!");
+						corner.norm = resolveIndex(index, nNormals, RelativeNorm, relative);
+					}
+				}
+				chunk.corners.push_back(corner);
+				chunk.relative.push_back(relative);
+				++size;
+				p = skipSpace(p, end);
+			}
+			chunk.faceSizes.push_back(size);
+		}
+	}
+
+	/// <summary>
+	/// Concatenates the chunks, offsetting each chunk's relative indices by the number of
+	/// elements before it, and checks every index refers to an element in the file.
+	/// </summary>
+	static ObjData merge(const std::vector<Chunk>& chunks)
+	{
+		const int nChunks = static_cast<int>(chunks.size());
+
+		// Where each chunk's elements start in the merged arrays.
+		std::vector<size_t> positionStart(nChunks + 1, 0), texCoordStart(nChunks + 1, 0),
+			normalStart(nChunks + 1, 0), cornerStart(nChunks + 1, 0), faceStart(nChunks + 1, 0);
+		for (int c = 0; c < nChunks; ++c) {
+			positionStart[c + 1] = positionStart[c] + chunks[c].positions.size();
+			texCoordStart[c + 1] = texCoordStart[c] + chunks[c].texCoords.size();
+			normalStart[c + 1] = normalStart[c] + chunks[c].normals.size();
+			cornerStart[c + 1] = cornerStart[c] + chunks[c].corners.size();
+			faceStart[c + 1] = faceStart[c] + chunks[c].faceSizes.size();
+		}
+
+		ObjData data;
+		data.positions.resize(positionStart[nChunks]);
+		data.texCoords.resize(texCoordStart[nChunks]);
+		data.normals.resize(normalStart[nChunks]);
+		data.corners.resize(cornerStart[nChunks]);
+		data.faceStarts.resize(faceStart[nChunks] + 1);
+		data.faceStarts[faceStart[nChunks]] = static_cast<int>(cornerStart[nChunks]);
+
+		const int nPositions = data.npositions();
+		const int nTexCoords = data.ntexCoords();
+		const int nNormals = data.nnormals();
+
+		bool badIndex = false;
+		#pragma omp parallel for schedule(dynamic, 1) reduction(||:badIndex)
+		for (int c = 0; c < nChunks; ++c) {
+			const Chunk& chunk = chunks[c];
+			std::copy(chunk.positions.begin(), chunk.positions.end(), data.positions.begin() + positionStart[c]);
+			std::copy(chunk.texCoords.begin(), chunk.texCoords.end(), data.texCoords.begin() + texCoordStart[c]);
+			std::copy(chunk.normals.begin(), chunk.normals.end(), data.normals.begin() + normalStart[c]);
+
+			const int vertOffset = static_cast<int>(positionStart[c] / 3);
+			const int texOffset = static_cast<int>(texCoordStart[c] / 3);
+			const int normOffset = static_cast<int>(normalStart[c] / 3);
+			for (size_t i = 0; i < chunk.corners.size(); ++i) {
+				ObjCorner corner = chunk.corners[i];
+				const unsigned char relative = chunk.relative[i];
+				if (relative & RelativeVert) corner.vert += vertOffset;
+				if (relative & RelativeTex) corner.tex += texOffset;
+				if (relative & RelativeNorm) corner.norm += normOffset;
+				badIndex = badIndex || corner.vert < 0 || corner.vert >= nPositions ||
+					corner.tex >= nTexCoords || corner.norm >= nNormals ||
+					((relative & RelativeTex) && corner.tex < 0) || ((relative & RelativeNorm) && corner.norm < 0);
+				data.corners[cornerStart[c] + i] = corner;
+			}
+
+			int start = static_cast<int>(cornerStart[c]);
+			for (size_t f = 0; f < chunk.faceSizes.size(); ++f) {
+				data.faceStarts[faceStart[c] + f] = start;
+				start += chunk.faceSizes[f];
+			}
+		}
+		if (badIndex) throw std::runtime_error("Obj file has a face that refers to an element that doesn't exist!");
+
+		return data;
+	}
+};
@@ -1,6 +1,7 @@
 #pragma once
 #include <Eigen/Dense>
 #include "Ray.hpp"
+#include <limits>
 
 struct AABB
 {
@@ -18,13 +19,49 @@ struct AABB
 		return (min + max) * 0.5f;
 	}
 
+	/// <summary>
+	/// Returns an "inside out" AABB that contains nothing. Extending it by any
+	/// point or box gives a box surrounding exactly that point or box.
+	/// </summary>
+	static AABB empty()
+	{
+		AABB aabb;
+		aabb.min = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+		aabb.max = Eigen::Vector3f::Constant(std::numeric_limits<float>::lowest());
+		return aabb;
+	}
+
+	void extend(const Eigen::Vector3f& point)
+	{
+		min = min.cwiseMin(point);
+		max = max.cwiseMax(point);
+	}
+
+	void extend(const AABB& other)
+	{
+		min = min.cwiseMin(other.min);
+		max = max.cwiseMax(other.max);
+	}
+
+	/// <summary>
+	/// Surface area of the box, used by the Surface Area Heuristic when building BVHs.
+	/// Empty boxes have zero area.
+	/// </summary>
+	float surfaceArea() const
+	{
+		Eigen::Vector3f extent = max - min;
+		if (extent.x() < 0.f || extent.y() < 0.f || extent.z() < 0.f) return 0.f;
+		return 2.f * (extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x());
+	}
+
 	bool intersect(const Ray& ray, float minT, float maxT) const
 	{
 		// Quick check for intersection with AABB.
 		// Code from https://raytracing.github.io/books/RayTracingTheNextWeek.html
+		// The ray carries 1 / direction, so there are no divisions here.
 		float minTtmp = minT, maxTtmp = maxT;
 		for (int a = 0; a < 3; a++) {
-			auto invD = 1 / ray.direction[a];
+			auto invD = ray.invDirection[a];
 			auto orig = ray.origin[a];
 
 			auto t0 = (min[a] - orig) * invD;
@@ -36,7 +73,8 @@ struct AABB
 			if (t0 > minTtmp) minTtmp = t0;
 			if (t1 < maxTtmp) maxTtmp = t1;
 
-			if (maxTtmp <= minTtmp)
+			// Boxes can be flat (e.g. around an axis aligned triangle), so touching slabs still count as a hit.
+			if (maxTtmp < minTtmp)
 				return false;
 		}
 		return true;
@@ -0,0 +1,213 @@
+#pragma once
+#include "Camera.hpp"
+#include "HitInfo.hpp"
+#include "Sampler.hpp"
+#include "TileScheduler.hpp"
+#include <Eigen/Dense>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+/// <summary>
+/// Settings for the AdaptiveRenderer.
+/// </summary>
+struct AdaptiveSettings
+{
+	int baseSamples = 1; // Jittered samples every pixel gets.
+	int maxSamples = 16; // No pixel gets more samples than this.
+	int refineSamples = 4; // Samples added to a pixel each time it's refined.
+	float varianceThreshold = 0.01f; // Refine while the standard error of the pixel's brightness is above this.
+	float contrastThreshold = 0.05f; // Pixels differing this much in brightness from a neighbour are on an edge.
+};
+
+/// <summary>
+/// The AdaptiveRenderer anti-aliases an image by spending extra samples only on the
+/// pixels that need them. Every pixel first gets a few jittered samples. A pixel is then
+/// refined if it is on an edge, i.e. it and one of its neighbours differ in what their
+/// first samples hit: one hits the scene and the other doesn't, they hit different
+/// shaders, the normals or depths are far apart, or their colours differ by more than
+/// the contrast threshold (e.g. shadow and texture edges). Refinement adds samples in
+/// rounds, and a pixel keeps getting more (up to maxSamples) while the standard error
+/// of its brightness is above the variance threshold. Flat areas keep their base samples.
+/// </summary>
+class AdaptiveRenderer
+{
+private:
+	/// <summary>
+	/// The running totals for a pixel, and what its first sample hit.
+	/// </summary>
+	struct PixelSamples
+	{
+		Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+		float luminanceSum = 0.f, luminanceSquaredSum = 0.f;
+		int count = 0;
+
+		bool hit = false;
+		const Shader* shader = nullptr;
+		Eigen::Vector3f normal = Eigen::Vector3f::Zero();
+		float depth = 0.f;
+	};
+
+	int width_, height_;
+	AdaptiveSettings settings_;
+	std::vector<PixelSamples> pixels_;
+
+public:
+	AdaptiveRenderer(int width, int height, const AdaptiveSettings& settings)
+		:width_(width), height_(height), settings_(settings), pixels_(width * height)
+	{
+		settings_.baseSamples = std::max(settings_.baseSamples, 1);
+		settings_.maxSamples = std::max(settings_.maxSamples, settings_.baseSamples);
+		settings_.refineSamples = std::max(settings_.refineSamples, 1);
+	}
+
+	/// <summary>
+	/// Renders the image. trace(ray, hit, hitInfo) returns the colour seen along a camera
+	/// ray, and sets hit and hitInfo to what the ray hit. Returns the total number of
+	/// samples taken.
+	/// </summary>
+	template <typename Trace>
+	long long render(const Camera& cam, const TileScheduler& scheduler, Trace trace)
+	{
+		// Every pixel gets the base samples.
+		scheduler.run([&](const Tile& tile) {
+			for (int y = tile.y0; y < tile.y1; ++y) {
+				for (int x = tile.x0; x < tile.x1; ++x) {
+					addSamples(x, y, settings_.baseSamples, cam, trace);
+				}
+			}
+		}, false);
+		long long totalSamples = static_cast<long long>(settings_.baseSamples) * width_ * height_;
+
+		// Find the edges and noisy pixels, a row at a time so the list stays in image order.
+		std::vector<std::vector<int>> rows(height_);
+		#pragma omp parallel for
+		for (int y = 0; y < height_; ++y) {
+			for (int x = 0; x < width_; ++x) {
+				const int pixel = x + y * width_;
+				if (pixels_[pixel].count < settings_.maxSamples && (noisy(pixels_[pixel]) || onEdge(x, y)))
+					rows[y].push_back(pixel);
+			}
+		}
+		std::vector<int> refine;
+		for (const std::vector<int>& row : rows) refine.insert(refine.end(), row.begin(), row.end());
+
+		// Refine them in rounds, until none are left that are still noisy. Only the pixels
+		// being refined are visited, however big the image is.
+		while (!refine.empty()) {
+			const int n = static_cast<int>(refine.size());
+			std::vector<char> keep(n);
+			long long roundSamples = 0;
+			#pragma omp parallel for schedule(dynamic, 64) reduction(+:roundSamples)
+			for (int i = 0; i < n; ++i) {
+				const int pixel = refine[i];
+				roundSamples += addSamples(pixel % width_, pixel / width_, settings_.refineSamples, cam, trace);
+				keep[i] = pixels_[pixel].count < settings_.maxSamples && noisy(pixels_[pixel]);
+			}
+			totalSamples += roundSamples;
+
+			int kept = 0;
+			for (int i = 0; i < n; ++i) {
+				if (keep[i]) refine[kept++] = refine[i];
+			}
+			refine.resize(kept);
+		}
+		return totalSamples;
+	}
+
+	/// <summary>
+	/// The average of the samples for a pixel.
+	/// </summary>
+	Eigen::Vector3f color(int x, int y) const
+	{
+		const PixelSamples& p = pixels_[x + y * width_];
+		return p.count > 0 ? Eigen::Vector3f(p.sum / static_cast<float>(p.count)) : Eigen::Vector3f::Zero();
+	}
+
+	int samples(int x, int y) const
+	{
+		return pixels_[x + y * width_].count;
+	}
+
+private:
+	static float luminance(const Eigen::Vector3f& color)
+	{
+		return .2126f * color.x() + .7152f * color.y() + .0722f * color.z();
+	}
+
+	/// <summary>
+	/// Adds up to count more jittered samples to a pixel, without going over maxSamples.
+	/// Returns the number of samples added.
+	/// </summary>
+	template <typename Trace>
+	int addSamples(int x, int y, int count, const Camera& cam, Trace& trace)
+	{
+		const int pixel = x + y * width_;
+		PixelSamples& p = pixels_[pixel];
+		const int end = std::min(p.count + count, settings_.maxSamples);
+		const int added = end - p.count;
+		for (int s = p.count; s < end; ++s) {
+			Sampler sampler(pixel, s);
+			addSample(p, trace, cam.getRay(x, y, sampler.next2D()));
+		}
+		return added;
+	}
+
+	template <typename Trace>
+	static void addSample(PixelSamples& p, Trace& trace, const Ray& ray)
+	{
+		bool hit = false;
+		HitInfo hitInfo;
+		// Colours are clamped as they will be in the output, so very bright samples don't
+		// make a pixel look noisier than it will appear.
+		Eigen::Vector3f color = trace(ray, hit, hitInfo).cwiseMin(1.f);
+		if (p.count == 0) {
+			p.hit = hit;
+			if (hit) {
+				p.shader = hitInfo.shader;
+				p.normal = hitInfo.normal;
+				p.depth = hitInfo.hitT;
+			}
+		}
+		float lum = luminance(color);
+		p.sum += color;
+		p.luminanceSum += lum;
+		p.luminanceSquaredSum += lum * lum;
+		++p.count;
+	}
+
+	/// <summary>
+	/// Whether the standard error of the pixel's mean brightness is above the threshold.
+	/// </summary>
+	bool noisy(const PixelSamples& p) const
+	{
+		if (p.count < 2) return false;
+		const float n = static_cast<float>(p.count);
+		float variance = (p.luminanceSquaredSum - p.luminanceSum * p.luminanceSum / n) / (n - 1.f);
+		return variance > 0.f && std::sqrt(variance / n) > settings_.varianceThreshold;
+	}
+
+	bool onEdge(int x, int y) const
+	{
+		const PixelSamples& p = pixels_[x + y * width_];
+		const int dx[4] = { -1, 1, 0, 0 }, dy[4] = { 0, 0, -1, 1 };
+		for (int i = 0; i < 4; ++i) {
+			int nx = x + dx[i], ny = y + dy[i];
+			if (nx < 0 || ny < 0 || nx >= width_ || ny >= height_) continue;
+			if (differ(p, pixels_[nx + ny * width_])) return true;
+		}
+		return false;
+	}
+
+	bool differ(const PixelSamples& a, const PixelSamples& b) const
+	{
+		if (a.hit != b.hit) return true;
+		if (a.hit) {
+			if (a.shader != b.shader) return true;
+			if (a.normal.dot(b.normal) < .9f) return true;
+			if (std::fabs(a.depth - b.depth) > .05f * std::min(a.depth, b.depth)) return true;
+		}
+		float contrast = std::fabs(luminance(a.sum / static_cast<float>(a.count)) - luminance(b.sum / static_cast<float>(b.count)));
+		return contrast > settings_.contrastThreshold;
+	}
+};
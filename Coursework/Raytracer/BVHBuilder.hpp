@@ -0,0 +1,634 @@
+#pragma once
+#include "AABB.hpp"
+#include <Eigen/Dense>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+
+// Parallel builds use OpenMP tasks, which need OpenMP 3.0 or later. If they aren't
+// available (e.g. MSVC's built in OpenMP 2.0) the build is serial.
+#if defined(_OPENMP) && _OPENMP >= 200805
+#define BVH_PARALLEL_BUILD
+#endif
+
+/// <summary>
+/// How the builder decides where to split each BVH node.
+/// Midpoint splits the longest axis of the node's AABB at its centre (the original
+/// BVHNode behaviour). SAH uses a binned Surface Area Heuristic across all three axes.
+/// LBVH sorts primitives by the Morton codes of their centroids and splits on the code
+/// bits, for very fast (re)builds at some cost in trace performance.
+/// </summary>
+enum class BVHSplitMethod
+{
+	Midpoint,
+	SAH,
+	LBVH
+};
+
+/// <summary>
+/// Parameters controlling BVH construction.
+/// </summary>
+struct BVHBuildOptions
+{
+	BVHSplitMethod splitMethod = BVHSplitMethod::SAH;
+	int maxDepth = 32; // Hard limit on tree depth, whichever split method is used.
+	// Nodes with more primitives than this are always split (until maxDepth is reached).
+	// With SAH, smaller nodes are split too when the cost estimate says it pays off.
+	int maxLeafSize = 4;
+	int sahBins = 16; // Number of bins per axis for the binned SAH.
+	float traversalCost = 1.f; // SAH cost of visiting an interior node...
+	float intersectionCost = 1.f; // ...relative to the cost of testing one primitive.
+	bool parallelBuild = true; // Build with OpenMP tasks (if supported by the compiler).
+	int parallelTaskThreshold = 4096; // Nodes with fewer primitives than this are built serially.
+};
+
+/// <summary>
+/// Parses a split method name as used in config.json ("midpoint", "sah" or "lbvh").
+/// </summary>
+inline BVHSplitMethod parseBVHSplitMethod(const std::string& name)
+{
+	if (name == "midpoint") return BVHSplitMethod::Midpoint;
+	if (name == "sah") return BVHSplitMethod::SAH;
+	if (name == "lbvh") return BVHSplitMethod::LBVH;
+	throw std::runtime_error("Unknown BVH builder: " + name);
+}
+
+/// <summary>
+/// A primitive as seen by the BVH builder: its bounds, centroid and an index
+/// identifying it to whoever requested the build (e.g. a face index in a Model).
+/// </summary>
+struct BVHPrimitive
+{
+	AABB bounds;
+	Eigen::Vector3f centroid;
+	int index;
+};
+
+/// <summary>
+/// A node of the tree produced by BVHBuilder.
+/// Interior nodes have two children, leaves reference a range of primIndices.
+/// </summary>
+struct BVHBuildNode
+{
+	AABB bounds;
+	int children[2] = { -1, -1 }; // Indices into BVHBuildTree::nodes.
+	int splitAxis = 0;
+	int firstPrim = 0, primCount = 0;
+
+	bool isLeaf() const
+	{
+		return primCount > 0;
+	}
+};
+
+/// <summary>
+/// Output of BVHBuilder. Nodes are stored in depth-first order with the root at index 0,
+/// and each node's first child directly after it.
+/// primIndices holds the BVHPrimitive::index values reordered so that each leaf's
+/// primitives are contiguous.
+/// </summary>
+struct BVHBuildTree
+{
+	std::vector<BVHBuildNode> nodes;
+	std::vector<int> primIndices;
+};
+
+/// <summary>
+/// Builds binary BVHs over a list of primitives. The builder knows nothing about what
+/// the primitives are, so the same tree can be turned into BVHNode instances or other
+/// representations of the hierarchy.
+/// Large builds run in parallel: subtrees become OpenMP tasks, and the bounds and SAH
+/// bins of big nodes near the root are computed over chunks of primitives in parallel.
+/// The parallel build gives exactly the same tree as the serial build.
+/// </summary>
+class BVHBuilder
+{
+private:
+	BVHBuildOptions options_;
+
+	static const int maxChunks = 64; // Most chunks a node's primitives are split into for parallel binning.
+
+	struct SplitChoice
+	{
+		int axis = -1;
+		int bin = -1; // SAH only: the last bin on the left hand side of the split.
+		float location = 0.f; // Midpoint only: the splitting plane.
+		float cost = std::numeric_limits<float>::max();
+	};
+
+public:
+	BVHBuilder(const BVHBuildOptions& options)
+		:options_(options)
+	{
+		if (options_.sahBins < 2) options_.sahBins = 2;
+		if (options_.maxLeafSize < 1) options_.maxLeafSize = 1;
+	}
+
+	const BVHBuildOptions& options() const
+	{
+		return options_;
+	}
+
+	/// <summary>
+	/// The deepest tree (with the root at depth 0) that the fixed size traversal stacks of
+	/// LinearBVH, TopLevelBVH and WideBVH can hold. The same limit as BVHNode's.
+	/// </summary>
+	static const int maxTraversalDepth = 62;
+
+	/// <summary>
+	/// Throws if a tree is deeper than maxTraversalDepth, or if its children aren't stored
+	/// after their parents as build() stores them. name is the kind of tree, for the error.
+	/// </summary>
+	static void checkDepth(const BVHBuildTree& tree, const std::string& name)
+	{
+		std::vector<int> depths(tree.nodes.size(), 0);
+		for (size_t n = 0; n < tree.nodes.size(); ++n) {
+			const BVHBuildNode& node = tree.nodes[n];
+			if (node.isLeaf()) continue;
+			for (int child : node.children) {
+				if (child <= static_cast<int>(n) || child >= static_cast<int>(tree.nodes.size()))
+					throw std::runtime_error("Malformed BVH: a child isn't stored after its parent.");
+				depths[child] = depths[n] + 1;
+				if (depths[child] > maxTraversalDepth)
+					throw std::runtime_error(name + " trees can be at most " + std::to_string(maxTraversalDepth) + " deep.");
+			}
+		}
+	}
+
+	BVHBuildTree build(std::vector<BVHPrimitive> primitives) const
+	{
+		BVHBuildTree tree;
+		if (primitives.empty()) return tree;
+
+		if (options_.splitMethod == BVHSplitMethod::LBVH) {
+			tree = buildLBVH(primitives);
+		}
+		else {
+			buildTopDown(tree, primitives);
+		}
+
+		tree.primIndices.resize(primitives.size());
+		for (size_t i = 0; i < primitives.size(); ++i) {
+			tree.primIndices[i] = primitives[i].index;
+		}
+		return tree;
+	}
+
+	/// <summary>
+	/// Spreads the lower 10 bits of x out so there are two zero bits between each.
+	/// </summary>
+	static uint32_t spreadBits(uint32_t x)
+	{
+		x &= 0x3ff;
+		x = (x | (x << 16)) & 0x030000ff;
+		x = (x | (x << 8)) & 0x0300f00f;
+		x = (x | (x << 4)) & 0x030c30c3;
+		x = (x | (x << 2)) & 0x09249249;
+		return x;
+	}
+
+	/// <summary>
+	/// 30 bit Morton code of a point inside the given bounds. Bit b of the code comes from
+	/// axis b % 3.
+	/// </summary>
+	static uint32_t mortonCode(const Eigen::Vector3f& p, const AABB& bounds)
+	{
+		uint32_t code = 0;
+		for (int axis = 0; axis < 3; ++axis) {
+			float extent = bounds.max[axis] - bounds.min[axis];
+			float scaled = extent > 0.f ? (p[axis] - bounds.min[axis]) / extent * 1024.f : 0.f;
+			uint32_t cell = static_cast<uint32_t>(std::min(std::max(scaled, 0.f), 1023.f));
+			code |= spreadBits(cell) << axis;
+		}
+		return code;
+	}
+
+private:
+	/// <summary>
+	/// Builds the tree top down with the midpoint or SAH split method.
+	/// </summary>
+	void buildTopDown(BVHBuildTree& tree, std::vector<BVHPrimitive>& primitives) const
+	{
+		tree.nodes.reserve(2 * primitives.size() / options_.maxLeafSize + 1);
+#ifdef BVH_PARALLEL_BUILD
+		if (options_.parallelBuild) {
+			// One thread starts the build, the rest of the team picks up the tasks it creates.
+			#pragma omp parallel
+			#pragma omp single
+			buildRecursive(tree.nodes, primitives, 0, static_cast<int>(primitives.size()), 0);
+		}
+		else
+#endif
+		buildRecursive(tree.nodes, primitives, 0, static_cast<int>(primitives.size()), 0);
+	}
+
+	/// <summary>
+	/// Builds the subtree for prims[begin, end), appending its nodes to the nodes list in
+	/// depth-first order. Returns the index of the subtree's root in the list.
+	/// </summary>
+	int buildRecursive(std::vector<BVHBuildNode>& nodes, std::vector<BVHPrimitive>& prims, int begin, int end, int depth) const
+	{
+		int nodeIdx = static_cast<int>(nodes.size());
+		nodes.emplace_back();
+
+		AABB bounds, centroidBounds;
+		computeBounds(prims, begin, end, bounds, centroidBounds);
+		nodes[nodeIdx].bounds = bounds;
+
+		int count = end - begin;
+		int mid = begin;
+		bool split = false;
+		SplitChoice choice;
+		if (count > 1 && depth < options_.maxDepth) {
+			if (options_.splitMethod == BVHSplitMethod::SAH) {
+				choice = findSAHSplit(prims, begin, end, bounds, centroidBounds);
+				// Only split if it's cheaper than intersecting every primitive here,
+				// unless the node is too big to be a leaf.
+				float leafCost = options_.intersectionCost * count;
+				if (choice.axis >= 0 && (count > options_.maxLeafSize || choice.cost < leafCost)) {
+					mid = partitionSAH(prims, begin, end, centroidBounds, choice);
+				}
+			}
+			else if (count > options_.maxLeafSize) {
+				choice = findMidpointSplit(bounds);
+				mid = static_cast<int>(std::partition(prims.begin() + begin, prims.begin() + end,
+					[&](const BVHPrimitive& p) { return p.centroid[choice.axis] < choice.location; }) - prims.begin());
+			}
+			split = mid > begin && mid < end;
+		}
+
+		if (!split) {
+			nodes[nodeIdx].firstPrim = begin;
+			nodes[nodeIdx].primCount = count;
+			return nodeIdx;
+		}
+
+		nodes[nodeIdx].splitAxis = choice.axis;
+
+		if (useTasks(count)) {
+			// Build the two subtrees concurrently into their own lists, then append them in
+			// the same order the serial build would have, so the tree is identical.
+			std::vector<BVHBuildNode> nodes0, nodes1;
+			#pragma omp task shared(nodes0, prims)
+			buildRecursive(nodes0, prims, begin, mid, depth + 1);
+			#pragma omp task shared(nodes1, prims)
+			buildRecursive(nodes1, prims, mid, end, depth + 1);
+			#pragma omp taskwait
+			nodes[nodeIdx].children[0] = appendSubtree(nodes, nodes0);
+			nodes[nodeIdx].children[1] = appendSubtree(nodes, nodes1);
+		}
+		else {
+			int child0 = buildRecursive(nodes, prims, begin, mid, depth + 1);
+			int child1 = buildRecursive(nodes, prims, mid, end, depth + 1);
+			nodes[nodeIdx].children[0] = child0;
+			nodes[nodeIdx].children[1] = child1;
+		}
+		return nodeIdx;
+	}
+
+	bool useTasks(int count) const
+	{
+#ifdef BVH_PARALLEL_BUILD
+		return options_.parallelBuild && count >= options_.parallelTaskThreshold;
+#else
+		return false;
+#endif
+	}
+
+	/// <summary>
+	/// Appends a subtree built into its own list, offsetting its child indices.
+	/// Returns the index of the subtree's root.
+	/// </summary>
+	static int appendSubtree(std::vector<BVHBuildNode>& nodes, const std::vector<BVHBuildNode>& subtree)
+	{
+		int offset = static_cast<int>(nodes.size());
+		for (BVHBuildNode node : subtree) {
+			if (!node.isLeaf()) {
+				node.children[0] += offset;
+				node.children[1] += offset;
+			}
+			nodes.push_back(node);
+		}
+		return offset;
+	}
+
+	/// <summary>
+	/// Runs func(chunk, chunkBegin, chunkEnd) over [begin, end). Large ranges near the top
+	/// of the tree are split into chunks processed as parallel tasks, so each call should
+	/// write its results into a per-chunk slot that's combined afterwards in chunk order.
+	/// Returns the number of chunks used.
+	/// </summary>
+	template <typename Func>
+	int forChunks(int begin, int end, Func func) const
+	{
+		int count = end - begin;
+		if (!useTasks(count)) {
+			func(0, begin, end);
+			return 1;
+		}
+
+		int nChunks = count / options_.parallelTaskThreshold + 1;
+		if (nChunks > maxChunks) nChunks = maxChunks;
+		int chunkSize = (count + nChunks - 1) / nChunks;
+		for (int c = 0; c < nChunks; ++c) {
+			int chunkBegin = begin + c * chunkSize, chunkEnd = std::min(end, chunkBegin + chunkSize);
+			#pragma omp task firstprivate(c, chunkBegin, chunkEnd) shared(func)
+			func(c, chunkBegin, chunkEnd);
+		}
+		#pragma omp taskwait
+		return nChunks;
+	}
+
+	void computeBounds(const std::vector<BVHPrimitive>& prims, int begin, int end,
+		AABB& bounds, AABB& centroidBounds) const
+	{
+		AABB chunkBounds[maxChunks], chunkCentroidBounds[maxChunks];
+		int nChunks = forChunks(begin, end, [&](int c, int chunkBegin, int chunkEnd) {
+			chunkBounds[c] = AABB::empty();
+			chunkCentroidBounds[c] = AABB::empty();
+			for (int i = chunkBegin; i < chunkEnd; ++i) {
+				chunkBounds[c].extend(prims[i].bounds);
+				chunkCentroidBounds[c].extend(prims[i].centroid);
+			}
+		});
+
+		bounds = AABB::empty();
+		centroidBounds = AABB::empty();
+		for (int c = 0; c < nChunks; ++c) {
+			bounds.extend(chunkBounds[c]);
+			centroidBounds.extend(chunkCentroidBounds[c]);
+		}
+	}
+
+	/// <summary>
+	/// Splits the longest axis of the node's AABB at its centre.
+	/// </summary>
+	SplitChoice findMidpointSplit(const AABB& bounds) const
+	{
+		SplitChoice choice;
+		Eigen::Vector3f extent = bounds.max - bounds.min;
+		choice.axis = 0;
+		for (int axis = 1; axis < 3; ++axis) {
+			if (extent[axis] > extent[choice.axis]) choice.axis = axis;
+		}
+		choice.location = bounds.centre()[choice.axis];
+		return choice;
+	}
+
+	int binIndex(const BVHPrimitive& prim, const AABB& centroidBounds, int axis) const
+	{
+		float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		int bin = static_cast<int>(options_.sahBins * (prim.centroid[axis] - centroidBounds.min[axis]) / extent);
+		return std::min(std::max(bin, 0), options_.sahBins - 1);
+	}
+
+	/// <summary>
+	/// Bins primitive centroids along each axis and evaluates the SAH at every bin boundary.
+	/// Returns a choice with axis -1 if the centroids can't be separated.
+	/// </summary>
+	SplitChoice findSAHSplit(const std::vector<BVHPrimitive>& prims, int begin, int end,
+		const AABB& bounds, const AABB& centroidBounds) const
+	{
+		struct Bin
+		{
+			AABB bounds = AABB::empty();
+			int count = 0;
+		};
+
+		const int nBins = options_.sahBins;
+		bool splittable[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			splittable[axis] = centroidBounds.max[axis] > centroidBounds.min[axis];
+		}
+
+		// Each chunk fills its own set of bins for all three axes...
+		std::vector<Bin> chunkBins[maxChunks];
+		int nChunks = forChunks(begin, end, [&](int c, int chunkBegin, int chunkEnd) {
+			chunkBins[c].assign(3 * nBins, Bin());
+			for (int i = chunkBegin; i < chunkEnd; ++i) {
+				for (int axis = 0; axis < 3; ++axis) {
+					if (!splittable[axis]) continue;
+					Bin& bin = chunkBins[c][axis * nBins + binIndex(prims[i], centroidBounds, axis)];
+					bin.bounds.extend(prims[i].bounds);
+					bin.count++;
+				}
+			}
+		});
+
+		// ...which are then merged in order.
+		std::vector<Bin>& bins = chunkBins[0];
+		for (int c = 1; c < nChunks; ++c) {
+			for (int b = 0; b < 3 * nBins; ++b) {
+				bins[b].bounds.extend(chunkBins[c][b].bounds);
+				bins[b].count += chunkBins[c][b].count;
+			}
+		}
+
+		std::vector<float> rightArea(nBins);
+		std::vector<int> rightCount(nBins);
+		float invArea = 1.f / std::max(bounds.surfaceArea(), std::numeric_limits<float>::min());
+
+		SplitChoice best;
+		for (int axis = 0; axis < 3; ++axis) {
+			if (!splittable[axis]) continue;
+			const Bin* axisBins = &bins[axis * nBins];
+
+			// Sweep from the right to get the area and count to the right of each boundary...
+			AABB rightBounds = AABB::empty();
+			int count = 0;
+			for (int b = nBins - 1; b > 0; --b) {
+				rightBounds.extend(axisBins[b].bounds);
+				count += axisBins[b].count;
+				rightArea[b] = rightBounds.surfaceArea();
+				rightCount[b] = count;
+			}
+
+			// ...then from the left to evaluate the cost of splitting after bin b.
+			AABB leftBounds = AABB::empty();
+			count = 0;
+			for (int b = 0; b < nBins - 1; ++b) {
+				leftBounds.extend(axisBins[b].bounds);
+				count += axisBins[b].count;
+				if (count == 0 || rightCount[b + 1] == 0) continue;
+
+				float cost = options_.traversalCost + options_.intersectionCost * invArea *
+					(count * leftBounds.surfaceArea() + rightCount[b + 1] * rightArea[b + 1]);
+				if (cost < best.cost) {
+					best.cost = cost;
+					best.axis = axis;
+					best.bin = b;
+				}
+			}
+		}
+
+		return best;
+	}
+
+	int partitionSAH(std::vector<BVHPrimitive>& prims, int begin, int end,
+		const AABB& centroidBounds, const SplitChoice& choice) const
+	{
+		auto midIt = std::partition(prims.begin() + begin, prims.begin() + end,
+			[&](const BVHPrimitive& p) { return binIndex(p, centroidBounds, choice.axis) <= choice.bin; });
+		return static_cast<int>(midIt - prims.begin());
+	}
+
+	// *** Linear BVH (LBVH) construction ***
+
+	struct MortonPrimitive
+	{
+		uint32_t code;
+		int prim;
+	};
+
+	/// <summary>
+	/// Least significant digit radix sort on the Morton codes, 8 bits per pass.
+	/// Each pass counts digits over fixed chunks in parallel, then scatters each chunk
+	/// to its own precomputed offsets, so the sort is stable and the same on any number
+	/// of threads.
+	/// </summary>
+	void radixSort(std::vector<MortonPrimitive>& values) const
+	{
+		const int bitsPerPass = 8, nBuckets = 1 << bitsPerPass, nPasses = 30 / bitsPerPass + 1;
+		const int n = static_cast<int>(values.size());
+		int nChunks = options_.parallelBuild ? n / options_.parallelTaskThreshold + 1 : 1;
+		if (nChunks > maxChunks) nChunks = maxChunks;
+		const int chunkSize = (n + nChunks - 1) / nChunks;
+
+		std::vector<MortonPrimitive> temp(values.size());
+		std::vector<int> offsets(nChunks * nBuckets);
+
+		for (int pass = 0; pass < nPasses; ++pass) {
+			int shift = pass * bitsPerPass;
+			std::fill(offsets.begin(), offsets.end(), 0);
+
+			#pragma omp parallel for if(nChunks > 1)
+			for (int c = 0; c < nChunks; ++c) {
+				int chunkEnd = std::min(n, (c + 1) * chunkSize);
+				for (int i = c * chunkSize; i < chunkEnd; ++i) {
+					offsets[c * nBuckets + ((values[i].code >> shift) & (nBuckets - 1))]++;
+				}
+			}
+
+			// Exclusive prefix sum, ordered by bucket then chunk.
+			int sum = 0;
+			for (int b = 0; b < nBuckets; ++b) {
+				for (int c = 0; c < nChunks; ++c) {
+					int count = offsets[c * nBuckets + b];
+					offsets[c * nBuckets + b] = sum;
+					sum += count;
+				}
+			}
+
+			#pragma omp parallel for if(nChunks > 1)
+			for (int c = 0; c < nChunks; ++c) {
+				int chunkEnd = std::min(n, (c + 1) * chunkSize);
+				for (int i = c * chunkSize; i < chunkEnd; ++i) {
+					temp[offsets[c * nBuckets + ((values[i].code >> shift) & (nBuckets - 1))]++] = values[i];
+				}
+			}
+			values.swap(temp);
+		}
+	}
+
+	/// <summary>
+	/// Builds a BVH by sorting the primitives along a Morton curve through their centroids,
+	/// then splitting each node where the highest differing bit of the codes changes.
+	/// This is much faster than the SAH build, but gives a lower quality tree.
+	/// </summary>
+	BVHBuildTree buildLBVH(std::vector<BVHPrimitive>& primitives) const
+	{
+		BVHBuildTree tree;
+		if (primitives.empty()) return tree;
+
+		AABB bounds, centroidBounds;
+		computeBounds(primitives, 0, static_cast<int>(primitives.size()), bounds, centroidBounds);
+
+		const int n = static_cast<int>(primitives.size());
+		std::vector<MortonPrimitive> morton(n);
+		#pragma omp parallel for if(options_.parallelBuild)
+		for (int i = 0; i < n; ++i) {
+			morton[i].code = mortonCode(primitives[i].centroid, centroidBounds);
+			morton[i].prim = i;
+		}
+
+		radixSort(morton);
+
+		std::vector<BVHPrimitive> sorted(n);
+		std::vector<uint32_t> codes(n);
+		#pragma omp parallel for if(options_.parallelBuild)
+		for (int i = 0; i < n; ++i) {
+			sorted[i] = primitives[morton[i].prim];
+			codes[i] = morton[i].code;
+		}
+		primitives.swap(sorted);
+
+		tree.nodes.reserve(2 * primitives.size() / options_.maxLeafSize + 1);
+#ifdef BVH_PARALLEL_BUILD
+		if (options_.parallelBuild) {
+			#pragma omp parallel
+			#pragma omp single
+			emitLBVH(tree.nodes, primitives, codes, 0, n, 29, 0);
+		}
+		else
+#endif
+		emitLBVH(tree.nodes, primitives, codes, 0, n, 29, 0);
+		return tree;
+	}
+
+	/// <summary>
+	/// Emits the LBVH subtree for the sorted primitives [begin, end), which all share the
+	/// Morton code bits above bit. Nodes are appended in depth-first order as with
+	/// buildRecursive, and node bounds are filled in from the children on the way back up.
+	/// </summary>
+	int emitLBVH(std::vector<BVHBuildNode>& nodes, const std::vector<BVHPrimitive>& prims,
+		const std::vector<uint32_t>& codes, int begin, int end, int bit, int depth) const
+	{
+		int nodeIdx = static_cast<int>(nodes.size());
+		nodes.emplace_back();
+
+		// Skip bits where all the codes are the same, then split where the bit changes.
+		int mid = begin;
+		for (; bit >= 0 && end - begin > options_.maxLeafSize && depth < options_.maxDepth; --bit) {
+			uint32_t mask = 1u << bit;
+			if ((codes[begin] & mask) == (codes[end - 1] & mask)) continue;
+			mid = static_cast<int>(std::partition_point(codes.begin() + begin, codes.begin() + end,
+				[mask](uint32_t code) { return !(code & mask); }) - codes.begin());
+			break;
+		}
+
+		if (mid == begin) {
+			AABB bounds = AABB::empty();
+			for (int i = begin; i < end; ++i) bounds.extend(prims[i].bounds);
+			nodes[nodeIdx].bounds = bounds;
+			nodes[nodeIdx].firstPrim = begin;
+			nodes[nodeIdx].primCount = end - begin;
+			return nodeIdx;
+		}
+
+		nodes[nodeIdx].splitAxis = bit % 3;
+
+		if (useTasks(end - begin)) {
+			std::vector<BVHBuildNode> nodes0, nodes1;
+			#pragma omp task shared(nodes0, prims, codes)
+			emitLBVH(nodes0, prims, codes, begin, mid, bit - 1, depth + 1);
+			#pragma omp task shared(nodes1, prims, codes)
+			emitLBVH(nodes1, prims, codes, mid, end, bit - 1, depth + 1);
+			#pragma omp taskwait
+			nodes[nodeIdx].children[0] = appendSubtree(nodes, nodes0);
+			nodes[nodeIdx].children[1] = appendSubtree(nodes, nodes1);
+		}
+		else {
+			int child0 = emitLBVH(nodes, prims, codes, begin, mid, bit - 1, depth + 1);
+			int child1 = emitLBVH(nodes, prims, codes, mid, end, bit - 1, depth + 1);
+			nodes[nodeIdx].children[0] = child0;
+			nodes[nodeIdx].children[1] = child1;
+		}
+
+		AABB bounds = nodes[nodes[nodeIdx].children[0]].bounds;
+		bounds.extend(nodes[nodes[nodeIdx].children[1]].bounds);
+		nodes[nodeIdx].bounds = bounds;
+		return nodeIdx;
+	}
+};
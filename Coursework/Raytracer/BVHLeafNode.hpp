@@ -23,30 +23,32 @@ public:
 
 	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
 	{
-		Ray tRay;
-		tRay.origin = transformPosition(worldToModel(), ray.origin);
-		tRay.direction = transformDirection(worldToModel(), ray.direction);
+		Ray tRay = rayToModel(ray);
 
-		// If we don't hit the AABB associated with this node at all, exit early!
-		if (!aabb_.intersect(tRay, minT, maxT)) return false;
+		PrimitiveHit hit;
+		if (!intersectChildren(tRay, minT, maxT, hit, mask)) return false;
+		hit.renderable->fillHitInfo(tRay, hit, info);
+		return true;
+	}
+
+	virtual bool intersectPrimitive(const Ray& ray, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const override
+	{
+		// Hits on the renderables are filled out with the ray in this node's space, so only
+		// pass them on when that's the same as the ray given here.
+		if (!hasIdentityTransform()) return Renderable::intersectPrimitive(ray, minT, maxT, hit, mask);
+		return intersectChildren(ray, minT, maxT, hit, mask);
+	}
 
-		// We did hit the AABB, so now we test the children.
-		bool hitSomething = false; // Keep track of whether a hit occurred.
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		Ray tRay = rayToModel(ray);
+
+		if (!aabb_.intersect(tRay, minT, maxT)) return false;
 
-		// Try intersecting all renderables.
-		float t = std::numeric_limits<float>::max();
 		for (const auto& object : renderables_) {
-			HitInfo currInfo;
-			if (object->intersect(tRay, minT, maxT, currInfo, mask)) {
-				if (currInfo.hitT < t) {
-					info = currInfo;
-					t = currInfo.hitT;
-					hitSomething = true;
-				}
-			}
+			if (object->occluded(tRay, minT, maxT, mask)) return true;
 		}
-
-		return hitSomething;
+		return false;
 	}
 
 	virtual std::string print() const override
@@ -57,5 +59,20 @@ public:
 		}
 		return ss.str();
 	}
+
+private:
+	bool intersectChildren(const Ray& tRay, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const
+	{
+		// If we don't hit the AABB associated with this node at all, exit early!
+		if (!aabb_.intersect(tRay, minT, maxT)) return false;
+
+		// Try intersecting all renderables. Each hit shrinks maxT, so later renderables
+		// only report hits closer than the best so far.
+		bool hitSomething = false;
+		for (const auto& object : renderables_) {
+			hitSomething |= object->intersectPrimitive(tRay, minT, maxT, hit, mask);
+		}
+		return hitSomething;
+	}
 };
 
@@ -3,6 +3,8 @@
 #include "GeomUtil.hpp"
 #include "Mesh.hpp"
 #include "BVHLeafNode.hpp"
+#include "BVHBuilder.hpp"
+#include "TraversalStats.hpp"
 #include <vector>
 
 
@@ -11,38 +13,48 @@
 /// In this library BVHs are binary trees (each can have at most 2 children.
 /// They can be constructed from either a list of renderables or a mesh
 /// (provided as a Model instance).
-/// Each node splits along a single axis (x, y or z).
+/// Each node splits along a single axis (x, y or z), with child0 on the low side.
+/// Rays are traced through the tree with a loop over an explicit stack, visiting the
+/// nearer child first and shrinking maxT at each hit, so subtrees behind the closest
+/// hit so far are culled by their AABB tests.
 /// </summary>
 class BVHNode : public Renderable
 {
 private:
+	// Upper bound on entries in the traversal stack. It grows by at most one per level of
+	// the tree, so this limits the tree depth.
+	static const int maxStackSize = 64;
+
 	AABB aabb_;
 	int nodeDepth_;
+	int splitAxis_ = 0;
 	std::shared_ptr<Renderable> child0_, child1_;
+	// The children again if they're BVHNodes, or nullptr for leaves, so traversal can
+	// step into them without a virtual call.
+	const BVHNode* childNode0_ = nullptr;
+	const BVHNode* childNode1_ = nullptr;
 public:
 
 	/// <summary>
-	/// Constructs a BVH from a list of Renderable instances.
+	/// Constructs a BVH from a list of Renderable instances, using their world space
+	/// AABBs. Leaves are BVHLeafNodes holding up to two renderables.
 	/// </summary>
 	/// <param name="renderables">The instances to add to the BVH.</param>
 	/// <param name="maxDepth">The maximum depth of the binary tree.</param>
 	BVHNode(const std::vector<std::shared_ptr<Renderable>>& renderables, int maxDepth)
-		:Renderable(nullptr), nodeDepth_(maxDepth)
-	{
-		// *** YOUR CODE HERE ***
+		:BVHNode(renderables, renderablesOptions(maxDepth))
+	{}
 
-		// 1. Find an AABB surrounding all the renderables, and update the aabb_ member.
-		//    Implement this in the getRenderablesAABB() function, at the end of GeomUtil.hpp.
-		// 2. Choose an axis to split your AABB along (x, y or z).
-		// 3. Make lists of the renderables that fall on either side of the split.
-		// 4. For child0_ and child1_, check if we should terminate:
-		//     a. If we reach the max depth (i.e. maxDepth == 0)
-		//     b. If there are two or fewer Renderables left in the list for this child.
-		// 5. If we should terminate, make a new BVHLeafNode and supply the renderables
-		//    in this list.
-		// 6. If we should not terminate, make a new BVHNode and call this constructor again
-		//    recursively. Don't forget to subtract one from maxDepth!
-	}
+	/// <summary>
+	/// Constructs a BVH from a list of Renderable instances with BVHBuilder, so the split
+	/// method, leaf size and maximum depth are controlled by the build options.
+	/// </summary>
+	/// <param name="renderables">The instances to add to the BVH.</param>
+	/// <param name="options">Parameters for the BVH build.</param>
+	BVHNode(const std::vector<std::shared_ptr<Renderable>>& renderables, const BVHBuildOptions& options)
+		:BVHNode(BVHBuilder(checkMaxDepth(options)).build(renderablePrimitives(renderables)), 0, renderables,
+			options.maxDepth)
+	{}
 
 	/// <summary>
 	/// This constructor forms a BVH tree from a provided triangle mesh.
@@ -61,40 +73,39 @@ public:
 	/// set to nullptr), all faces in the model instance will be used.</param>
 	/// <param name="culling">Turn on/off backface culling (same parameter as in the Mesh class).</param>
 	BVHNode(const Model& model, const Shader* shader, int maxDepth, const Eigen::Matrix4f &modelToWorld,
-		const std::vector<std::vector<VertexIndices>>* faceIndices = nullptr, bool culling=true)
-		:Renderable(nullptr)
+		const std::vector<int>* faceIndices = nullptr, bool culling=true)
+		:Renderable(nullptr), nodeDepth_(maxDepth)
 	{
-		std::vector<std::vector<VertexIndices>> myFaceIndices;
-		if(faceIndices) 
-			getModelAABB(model, *faceIndices, modelToWorld);
-		else {
+		checkMaxDepth(maxDepth);
+
+		std::vector<int> myFaceIndices;
+		if (!faceIndices) {
+			myFaceIndices.resize(model.nfaces());
 			for (int f = 0; f < model.nfaces(); ++f) {
-				std::vector<VertexIndices> face;
-				for (int v = 0; v < 3; ++v) {
-					face.push_back(model.face(f)[v]);
-				}
-				myFaceIndices.push_back(face);
+				myFaceIndices[f] = f;
 			}
-			getModelAABB(model, myFaceIndices, modelToWorld);
 			faceIndices = &myFaceIndices;
 		}
+		getModelAABB(model, *faceIndices, modelToWorld);
 
 		int splittingAxis = findBestSplittingAxis();
+		splitAxis_ = splittingAxis;
 		float splittingLoc = aabb_.centre()[splittingAxis];
 
-		std::vector<std::vector<VertexIndices>> faces0, faces1;
+		std::vector<int> faces0, faces1;
 
-		for (int f = 0; f < faceIndices->size(); ++f) {
+		for (int f : *faceIndices) {
+			const TriangleIndices& face = model.face(f);
 			Eigen::Vector3f
-				v0 = model.vert((*faceIndices)[f][0].vert),
-				v1 = model.vert((*faceIndices)[f][1].vert),
-				v2 = model.vert((*faceIndices)[f][2].vert);
+				v0 = model.vert(face[0]),
+				v1 = model.vert(face[1]),
+				v2 = model.vert(face[2]);
 			Eigen::Vector3f pos = transformPosition(modelToWorld, (v0 + v1 + v2) / 3.f);
 			if (pos[splittingAxis] < splittingLoc) {
-				faces0.push_back((*faceIndices)[f]);
+				faces0.push_back(f);
 			}
 			else {
-				faces1.push_back((*faceIndices)[f]);
+				faces1.push_back(f);
 			}
 		}
 
@@ -116,8 +127,198 @@ public:
 		else {
 			child1_ = std::make_shared<BVHNode>(model, shader, maxDepth-1, modelToWorld, &faces1, culling);
 		}
+		findChildNodes();
+	}
+
+
+	/// <summary>
+	/// This constructor forms a BVH tree from a provided triangle mesh using BVHBuilder,
+	/// so the split method (midpoint or binned SAH), leaf size and maximum depth are
+	/// all controlled by the build options.
+	/// As with the constructor above, the BVH is built in world space so the modelToWorld
+	/// transform must be supplied here. Leaves are Mesh instances holding their faces.
+	/// </summary>
+	/// <param name="model">The loaded model instance to construct the mesh BVH from.</param>
+	/// <param name="shader">The shader to use when intersecting the mesh.</param>
+	/// <param name="options">Parameters for the BVH build.</param>
+	/// <param name="modelToWorld">Transform taking the mesh to world space.</param>
+	/// <param name="culling">Turn on/off backface culling (same parameter as in the Mesh class).</param>
+	BVHNode(const Model& model, const Shader* shader, const BVHBuildOptions& options,
+		const Eigen::Matrix4f& modelToWorld, bool culling = true)
+		:BVHNode(BVHBuilder(checkMaxDepth(options)).build(modelPrimitives(model, modelToWorld)), 0,
+			model, shader, modelToWorld, culling, options.maxDepth)
+	{}
+
+	/// <summary>
+	/// Makes a BVH from a tree that has already been built over the model's faces with the
+	/// given options and modelToWorld transform (e.g. one loaded by MeshCache).
+	/// </summary>
+	BVHNode(const Model& model, const Shader* shader, const BVHBuildTree& tree, const BVHBuildOptions& options,
+		const Eigen::Matrix4f& modelToWorld, bool culling = true)
+		:BVHNode(tree, 0, model, shader, modelToWorld, culling, checkMaxDepth(options).maxDepth)
+	{}
+
+	/// <summary>
+	/// Finds the world space bounds and centroid of every face in the model, ready
+	/// to pass to BVHBuilder. Each primitive's index is its face index in the model.
+	/// </summary>
+	static std::vector<BVHPrimitive> modelPrimitives(const Model& model, const Eigen::Matrix4f& modelToWorld)
+	{
+		std::vector<BVHPrimitive> prims(model.nfaces());
+		#pragma omp parallel for
+		for (int f = 0; f < model.nfaces(); ++f) {
+			const TriangleIndices& face = model.face(f);
+			BVHPrimitive& prim = prims[f];
+			prim.bounds = AABB::empty();
+			Eigen::Vector3f centroid = Eigen::Vector3f::Zero();
+			for (int v = 0; v < 3; ++v) {
+				Eigen::Vector3f vWorld = transformPosition(modelToWorld, model.vert(face[v]));
+				prim.bounds.extend(vWorld);
+				centroid += vWorld;
+			}
+			prim.centroid = centroid / 3.f;
+			prim.index = f;
+		}
+		return prims;
+	}
+
+	/// <summary>
+	/// Finds the bounds and centroid of each renderable, ready to pass to BVHBuilder.
+	/// Each primitive's index is its position in the list.
+	/// </summary>
+	static std::vector<BVHPrimitive> renderablePrimitives(const std::vector<std::shared_ptr<Renderable>>& renderables)
+	{
+		std::vector<BVHPrimitive> prims(renderables.size());
+		for (size_t i = 0; i < renderables.size(); ++i) {
+			BVHPrimitive& prim = prims[i];
+			prim.bounds = renderables[i]->getAABB();
+			prim.centroid = prim.bounds.centre();
+			// Renderables without finite bounds still need to go somewhere in the tree.
+			if (!prim.centroid.allFinite()) prim.centroid = Eigen::Vector3f::Zero();
+			prim.index = static_cast<int>(i);
+		}
+		return prims;
+	}
+
+private:
+	static BVHBuildOptions renderablesOptions(int maxDepth)
+	{
+		BVHBuildOptions options;
+		options.maxDepth = maxDepth;
+		options.maxLeafSize = 2;
+		return options;
+	}
+
+	static void checkMaxDepth(int maxDepth)
+	{
+		if (maxDepth > maxStackSize - 2)
+			throw std::runtime_error("BVHNode trees can be at most " + std::to_string(maxStackSize - 2) + " deep.");
+	}
+
+	static const BVHBuildOptions& checkMaxDepth(const BVHBuildOptions& options)
+	{
+		checkMaxDepth(options.maxDepth);
+		return options;
+	}
+
+	void findChildNodes()
+	{
+		childNode0_ = dynamic_cast<const BVHNode*>(child0_.get());
+		childNode1_ = dynamic_cast<const BVHNode*>(child1_.get());
+	}
+
+	/// <summary>
+	/// Makes this node (and recursively its children) from node nodeIdx of a tree built
+	/// over a list of renderables.
+	/// </summary>
+	BVHNode(const BVHBuildTree& tree, int nodeIdx, const std::vector<std::shared_ptr<Renderable>>& renderables,
+		int nodeDepth)
+		:Renderable(nullptr), nodeDepth_(nodeDepth)
+	{
+		if (tree.nodes.empty()) {
+			aabb_ = AABB::empty();
+			return;
+		}
+
+		const BVHBuildNode& node = tree.nodes[nodeIdx];
+		aabb_ = node.bounds;
+		splitAxis_ = node.splitAxis;
+
+		if (node.isLeaf()) {
+			child0_ = makeLeaf(tree, node, renderables);
+			return;
+		}
+
+		std::shared_ptr<Renderable>* children[2] = { &child0_, &child1_ };
+		for (int c = 0; c < 2; ++c) {
+			const BVHBuildNode& child = tree.nodes[node.children[c]];
+			if (child.isLeaf())
+				*children[c] = makeLeaf(tree, child, renderables);
+			else
+				*children[c] = std::shared_ptr<BVHNode>(
+					new BVHNode(tree, node.children[c], renderables, nodeDepth - 1));
+		}
+		findChildNodes();
+	}
+
+	static std::shared_ptr<Renderable> makeLeaf(const BVHBuildTree& tree, const BVHBuildNode& leaf,
+		const std::vector<std::shared_ptr<Renderable>>& renderables)
+	{
+		std::vector<std::shared_ptr<Renderable>> leafRenderables;
+		leafRenderables.reserve(leaf.primCount);
+		for (int i = leaf.firstPrim; i < leaf.firstPrim + leaf.primCount; ++i) {
+			leafRenderables.push_back(renderables[tree.primIndices[i]]);
+		}
+		return std::make_shared<BVHLeafNode>(leafRenderables);
+	}
+
+	/// <summary>
+	/// Makes this node (and recursively its children) from node nodeIdx of a tree built
+	/// over the faces of a model.
+	/// </summary>
+	BVHNode(const BVHBuildTree& tree, int nodeIdx, const Model& model, const Shader* shader,
+		const Eigen::Matrix4f& modelToWorld, bool culling, int nodeDepth)
+		:Renderable(nullptr), nodeDepth_(nodeDepth)
+	{
+		if (tree.nodes.empty()) {
+			aabb_ = AABB::empty();
+			return;
+		}
+
+		const BVHBuildNode& node = tree.nodes[nodeIdx];
+		aabb_ = node.bounds;
+		splitAxis_ = node.splitAxis;
+
+		if (node.isLeaf()) {
+			// Only happens at the root, when the whole mesh fits in one leaf.
+			child0_ = makeLeafMesh(tree, node, model, shader, modelToWorld, culling);
+			return;
+		}
+
+		std::shared_ptr<Renderable>* children[2] = { &child0_, &child1_ };
+		for (int c = 0; c < 2; ++c) {
+			const BVHBuildNode& child = tree.nodes[node.children[c]];
+			if (child.isLeaf())
+				*children[c] = makeLeafMesh(tree, child, model, shader, modelToWorld, culling);
+			else
+				*children[c] = std::shared_ptr<BVHNode>(
+					new BVHNode(tree, node.children[c], model, shader, modelToWorld, culling, nodeDepth - 1));
+		}
+		findChildNodes();
+	}
+
+	static std::shared_ptr<Renderable> makeLeafMesh(const BVHBuildTree& tree, const BVHBuildNode& leaf,
+		const Model& model, const Shader* shader, const Eigen::Matrix4f& modelToWorld, bool culling)
+	{
+		// Primitive indices are face indices in the model.
+		std::vector<int> faces(tree.primIndices.begin() + leaf.firstPrim,
+			tree.primIndices.begin() + leaf.firstPrim + leaf.primCount);
+		auto mesh = std::make_shared<Mesh>(shader, &model, &faces, culling);
+		mesh->modelToWorld(modelToWorld);
+		return mesh;
 	}
 
+public:
 
 	/// <summary>
 	/// Finds the best axis to split the BVH along.
@@ -143,16 +344,16 @@ public:
 	/// That is, the AABB will be in world space.
 	/// </summary>
 	void getModelAABB(
-		const Model& model, const std::vector<std::vector<VertexIndices>>& faceIndices, 
+		const Model& model, const std::vector<int>& faceIndices, 
 		const Eigen::Matrix4f& modelToWorld)
 	{
 		for (int i = 0; i < 3; ++i) {
 			aabb_.min[i] = std::numeric_limits<float>::max();
 			aabb_.max[i] = std::numeric_limits<float>::min();
 		}
-		for (int f = 0; f < faceIndices.size(); ++f) {
+		for (int f : faceIndices) {
 			for (int v = 0; v < 3; ++v) {
-				Eigen::Vector3f v0 = model.vert(faceIndices[f][v].vert);
+				Eigen::Vector3f v0 = model.vert(model.face(f)[v]);
 				v0 = transformPosition(modelToWorld, v0);
 				for (int i = 0; i < 3; ++i) {
 					if (v0[i] < aabb_.min[i]) aabb_.min[i] = v0[i];
@@ -169,36 +370,35 @@ public:
 
 	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
 	{
-		Ray tRay;
-		tRay.origin = transformPosition(worldToModel(), ray.origin);
-		tRay.direction = transformDirection(worldToModel(), ray.direction);
-
-		// If we don't hit the AABB associated with this node at all, exit early!
-		if (!aabb_.intersect(tRay, minT, maxT)) return false;
-
-		// We did hit the AABB, so now we test the children.
-		bool hitSomething = false; // Keep track of whether a hit occurred.
-
-		float t = std::numeric_limits<float>::max();
-		HitInfo currInfo;
-		if (child0_ && child0_->intersect(tRay, minT, maxT, currInfo, mask)) {
-			if (currInfo.hitT < t) {
-				info = currInfo;
-				t = currInfo.hitT;
-				hitSomething = true;
-			}
-		}
-		if (child1_ && child1_->intersect(tRay, minT, maxT, currInfo, mask)) {
-			if (currInfo.hitT < t) {
-				info = currInfo;
-				t = currInfo.hitT;
-				hitSomething = true;
-			}
-		}
+		return intersectDeferred(ray, minT, maxT, info, mask);
+	}
 
+	/// <summary>
+	/// Finds the closest hit in the tree. The hit records the leaf renderable, which
+	/// fills out the shading attributes once traversal has finished.
+	/// </summary>
+	virtual bool intersectPrimitive(const Ray& ray, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const override
+	{
+		bool hitSomething = false;
+		traverse(ray, minT, maxT, [&](const Renderable& leaf, float& closestT) {
+			// Leaves only report hits closer than closestT, and shrink it.
+			hitSomething |= leaf.intersectPrimitive(ray, minT, closestT, hit, mask);
+			return false;
+		});
 		return hitSomething;
 	}
 
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		// Any hit will do, so stop at the first leaf that's hit.
+		bool hit = false;
+		traverse(ray, minT, maxT, [&](const Renderable& leaf, float& closestT) {
+			hit = leaf.occluded(ray, minT, closestT, mask);
+			return hit;
+		});
+		return hit;
+	}
+
 	/// <summary>
 	/// Prints a summary of the entries in this BVH and its children.
 	/// The list is indented to reflect the depth of each node in the tree.
@@ -213,9 +413,9 @@ public:
 		std::stringstream ss;
 		ss << indent << "BVH Node depth " << nodeDepth_ << " from\n" << aabb_.min << "to\n" << aabb_.max << "\n"
 			<< indent << "Children0:\n";
-		ss << indent << child0_->print() << "\n";
+		if (child0_) ss << indent << child0_->print() << "\n";
 		ss << indent << "Children1:\n";
-		ss << indent << child1_->print() << "\n";
+		if (child1_) ss << indent << child1_->print() << "\n";
 		return ss.str();
 	}
 
@@ -223,5 +423,51 @@ public:
 	{
 		throw(std::runtime_error("Can't transform a BVH node."));
 	}
+
+private:
+	/// <summary>
+	/// Walks the tree from this node, calling visitLeaf(leaf, maxT) for each leaf (Mesh,
+	/// BVHLeafNode etc.) whose parent's box the ray reaches. Children are visited on the near
+	/// side of their parent's split first. visitLeaf should reduce maxT when it finds a
+	/// closer hit, and can return true to stop traversal straight away.
+	/// BVHNodes can't be transformed, so the ray is in the same space throughout, and
+	/// hits on the leaves can be filled out with the ray given to the root.
+	/// </summary>
+	template <typename VisitLeaf>
+	void traverse(const Ray& ray, float minT, float& maxT, VisitLeaf visitLeaf) const
+	{
+		// node is set for interior nodes, and nullptr for leaves.
+		struct StackEntry
+		{
+			const BVHNode* node;
+			const Renderable* renderable;
+		};
+		TraversalCounter counter;
+		StackEntry stack[maxStackSize];
+		int stackSize = 0;
+		stack[stackSize++] = { this, nullptr };
+
+		while (stackSize > 0) {
+			const StackEntry entry = stack[--stackSize];
+			if (!entry.node) {
+				++counter.primitives;
+				if (visitLeaf(*entry.renderable, maxT)) return;
+				continue;
+			}
+
+			const BVHNode& node = *entry.node;
+			++counter.nodes;
+			if (!node.aabb_.intersect(ray, minT, maxT)) continue;
+
+			// Push the far child first, so the near child is popped next.
+			const StackEntry child0 = { node.childNode0_, node.child0_.get() };
+			const StackEntry child1 = { node.childNode1_, node.child1_.get() };
+			bool child1First = ray.invDirection[node.splitAxis_] < 0.f;
+			const StackEntry& nearChild = child1First ? child1 : child0;
+			const StackEntry& farChild = child1First ? child0 : child1;
+			if (farChild.renderable) stack[stackSize++] = farChild;
+			if (nearChild.renderable) stack[stackSize++] = nearChild;
+		}
+	}
 };
 
@@ -35,16 +35,26 @@ public:
 		up1pix_ = upVec * halfHeight * 2.f / static_cast<float>(pixHeight);
 	}
 
-	Ray getRay(int pixX, int pixY)
+	Ray getRay(int pixX, int pixY) const
 	{
-		Ray ray;
-		ray.origin = location_;
 		Eigen::Vector3f pixelPos = bottomLeftPix_ +
 			static_cast<float>(pixX) * right1pix_ +
 			static_cast<float>(pixY) * up1pix_;
 
-		ray.direction = (pixelPos - location_).normalized();
-		return ray;
+		return Ray(location_, (pixelPos - location_).normalized());
+	}
+
+	/// <summary>
+	/// Makes a ray through a point inside a pixel rather than its corner, e.g. for
+	/// jittered samples. offset is the position within the pixel, from (0, 0) to (1, 1).
+	/// </summary>
+	Ray getRay(int pixX, int pixY, const Eigen::Vector2f& offset) const
+	{
+		Eigen::Vector3f pixelPos = bottomLeftPix_ +
+			(static_cast<float>(pixX) + offset.x()) * right1pix_ +
+			(static_cast<float>(pixY) + offset.y()) * up1pix_;
+
+		return Ray(location_, (pixelPos - location_).normalized());
 	}
 };
 
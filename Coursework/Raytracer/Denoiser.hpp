@@ -0,0 +1,236 @@
+#pragma once
+#include "Framebuffer.hpp"
+#include "SIMD.hpp"
+#include "TileScheduler.hpp"
+#include <Eigen/Dense>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+/// <summary>
+/// Settings for the Denoiser.
+/// </summary>
+struct DenoiserSettings
+{
+	int iterations = 5; // Number of passes. Each one reaches twice as far as the last.
+	float colorSigma = .5f; // Colour difference at which weights fall off. Halved every pass.
+	float normalSigma = 64.f; // How quickly weights fall off as normals turn away from each other.
+	float depthSigma = .02f; // Relative depth difference per pixel at which weights fall off.
+};
+
+/// <summary>
+/// The Denoiser smooths the noise out of images rendered with few samples per pixel,
+/// using the edge-avoiding A-Trous wavelet filter (Dammertz et al. 2010).
+/// Each pass blurs every pixel with a 5x5 B-spline kernel whose taps are spread out by
+/// a step that doubles every pass, so a few cheap passes cover a wide area. Each tap is
+/// weighted by how alike it and the centre pixel are in colour and in the normal and
+/// depth AOVs of a Framebuffer, and taps on a different shader are skipped, so edges
+/// stay sharp.
+/// The lighting is filtered on its own by dividing the colour by the albedo first and
+/// multiplying it back afterwards, which keeps texture detail out of the blur.
+/// The image is held as separate padded planes for each channel, so rows of pixels can be
+/// loaded straight into SIMD vectors and the filter runs across SimdFloat::width pixels
+/// at a time, with no bounds checks as taps off the image land in the padding.
+/// Passes are run over tiles in parallel.
+/// </summary>
+class Denoiser
+{
+private:
+	int width_, height_, pad_, stride_;
+	DenoiserSettings settings_;
+
+	// Channel planes with pad_ pixels of padding on every side, stride_ floats per row.
+	std::vector<float> color_[3], filtered_[3], normal_[3], depth_, id_;
+
+public:
+	Denoiser(int width, int height, const DenoiserSettings& settings)
+		:width_(width), height_(height), settings_(settings)
+	{
+		settings_.iterations = std::max(settings_.iterations, 1);
+		// The furthest tap of the last pass is two of its steps away.
+		pad_ = 2 << (settings_.iterations - 1);
+		int simdWidth = 1;
+#ifdef RAYTRACER_SIMD_FLOAT
+		simdWidth = SimdFloat::width;
+#endif
+		// Room for a vector starting at the last pixel of a row to be loaded too.
+		stride_ = width_ + 2 * pad_ + simdWidth;
+		const size_t planeSize = static_cast<size_t>(stride_) * (height_ + 2 * pad_);
+		for (int c = 0; c < 3; ++c) {
+			color_[c].assign(planeSize, 0.f);
+			filtered_[c].assign(planeSize, 0.f);
+			normal_[c].assign(planeSize, 0.f);
+		}
+		depth_.assign(planeSize, 0.f);
+		// The padding gets an ID no pixel has, so it's never blended in.
+		id_.assign(planeSize, -2.f);
+	}
+
+	/// <summary>
+	/// The AOVs the Framebuffer given to denoise needs to have enabled and filled in.
+	/// </summary>
+	static std::vector<AOV> guideAOVs()
+	{
+		return { AOV::Albedo, AOV::Normal, AOV::Depth, AOV::ShaderID };
+	}
+
+	/// <summary>
+	/// Denoises colors (width x height, indexed x + y * width) in place, guided by the
+	/// guideAOVs of a Framebuffer.
+	/// </summary>
+	void denoise(std::vector<Eigen::Vector3f>& colors, const Framebuffer& guides, const TileScheduler& scheduler)
+	{
+		const std::vector<float> ids = guides.shaderIDs();
+
+		#pragma omp parallel for
+		for (int y = 0; y < height_; ++y) {
+			for (int x = 0; x < width_; ++x) {
+				const int pixel = x + y * width_, i = index(x, y);
+				const float* albedo = guides.pixel(AOV::Albedo, x, y);
+				const float* normal = guides.pixel(AOV::Normal, x, y);
+				for (int c = 0; c < 3; ++c) {
+					color_[c][i] = colors[pixel][c] / std::max(albedo[c], 1e-2f);
+					normal_[c][i] = normal[c];
+				}
+				depth_[i] = *guides.pixel(AOV::Depth, x, y);
+				id_[i] = ids[pixel];
+			}
+		}
+
+		for (int iteration = 0; iteration < settings_.iterations; ++iteration) {
+			const int step = 1 << iteration;
+			const float colorSigma = settings_.colorSigma / static_cast<float>(step);
+			scheduler.run([&](const Tile& tile) {
+				for (int y = tile.y0; y < tile.y1; ++y) {
+					filterRow(y, tile.x0, tile.x1, step, colorSigma);
+				}
+			}, false);
+			for (int c = 0; c < 3; ++c) color_[c].swap(filtered_[c]);
+		}
+
+		#pragma omp parallel for
+		for (int y = 0; y < height_; ++y) {
+			for (int x = 0; x < width_; ++x) {
+				const int pixel = x + y * width_, i = index(x, y);
+				const float* albedo = guides.pixel(AOV::Albedo, x, y);
+				for (int c = 0; c < 3; ++c) colors[pixel][c] = color_[c][i] * std::max(albedo[c], 1e-2f);
+			}
+		}
+	}
+
+private:
+	int index(int x, int y) const
+	{
+		return (x + pad_) + (y + pad_) * stride_;
+	}
+
+	/// <summary>
+	/// One pass of the filter over the pixels [x0, x1) of row y, from color_ into filtered_.
+	/// </summary>
+	void filterRow(int y, int x0, int x1, int step, float colorSigma)
+	{
+		static const float kernel[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+		const float invColorSigma2 = 1.f / (colorSigma * colorSigma);
+		const float invDepthSigma = 1.f / (settings_.depthSigma * static_cast<float>(step));
+
+#ifdef RAYTRACER_SIMD_FLOAT
+		typedef SimdFloat F;
+		typedef F::Type V;
+		for (int x = x0; x < x1; x += F::width) {
+			const int centre = index(x, y);
+			V colour[3], normal[3];
+			for (int c = 0; c < 3; ++c) {
+				colour[c] = F::load(&color_[c][centre]);
+				normal[c] = F::load(&normal_[c][centre]);
+			}
+			const V depth = F::load(&depth_[centre]);
+			const V id = F::load(&id_[centre]);
+			const V depthScale = F::div(F::set(invDepthSigma), F::max(depth, F::set(1e-3f)));
+
+			V sum[3] = { F::set(0.f), F::set(0.f), F::set(0.f) };
+			V weightSum = F::set(0.f);
+			for (int j = -2; j <= 2; ++j) {
+				for (int i = -2; i <= 2; ++i) {
+					const int tap = centre + (i + j * stride_) * step;
+					V tapColour[3], distance = F::set(0.f), normalDistance = F::set(0.f);
+					for (int c = 0; c < 3; ++c) {
+						tapColour[c] = F::load(&color_[c][tap]);
+						V diff = F::sub(tapColour[c], colour[c]);
+						distance = F::add(distance, F::mul(diff, diff));
+						V normalDiff = F::sub(F::load(&normal_[c][tap]), normal[c]);
+						normalDistance = F::add(normalDistance, F::mul(normalDiff, normalDiff));
+					}
+					// Half the squared distance between unit normals is 1 - cos of the angle
+					// between them, and it's zero between the zero normals of pixels that missed.
+					distance = F::mul(distance, F::set(invColorSigma2));
+					distance = F::add(distance, F::mul(F::set(.5f * settings_.normalSigma), normalDistance));
+					distance = F::add(distance, F::mul(F::abs(F::sub(F::load(&depth_[tap]), depth)), depthScale));
+
+					V weight = approxExp(distance);
+					weight = F::mul(weight, F::set(kernel[i + 2] * kernel[j + 2]));
+					weight = F::select(F::cmpeq(F::load(&id_[tap]), id), weight, F::set(0.f));
+					for (int c = 0; c < 3; ++c) sum[c] = F::add(sum[c], F::mul(weight, tapColour[c]));
+					weightSum = F::add(weightSum, weight);
+				}
+			}
+
+			// The last vector of a tile can run past its end, into pixels another thread
+			// may be writing, so only the lanes inside the tile are stored.
+			const int lanes = x1 - x < F::width ? x1 - x : F::width;
+			for (int c = 0; c < 3; ++c) {
+				float result[F::width];
+				F::store(result, F::div(sum[c], weightSum));
+				std::copy(result, result + lanes, &filtered_[c][centre]);
+			}
+		}
+#else
+		for (int x = x0; x < x1; ++x) {
+			const int centre = index(x, y);
+			const float depthScale = invDepthSigma / std::max(depth_[centre], 1e-3f);
+			float sum[3] = { 0.f, 0.f, 0.f }, weightSum = 0.f;
+			for (int j = -2; j <= 2; ++j) {
+				for (int i = -2; i <= 2; ++i) {
+					const int tap = centre + (i + j * stride_) * step;
+					if (id_[tap] != id_[centre]) continue;
+					float distance = 0.f, normalDistance = 0.f;
+					for (int c = 0; c < 3; ++c) {
+						float diff = color_[c][tap] - color_[c][centre];
+						distance += diff * diff;
+						float normalDiff = normal_[c][tap] - normal_[c][centre];
+						normalDistance += normalDiff * normalDiff;
+					}
+					distance = distance * invColorSigma2 + .5f * settings_.normalSigma * normalDistance
+						+ std::fabs(depth_[tap] - depth_[centre]) * depthScale;
+					float weight = approxExp(distance) * kernel[i + 2] * kernel[j + 2];
+					for (int c = 0; c < 3; ++c) sum[c] += weight * color_[c][tap];
+					weightSum += weight;
+				}
+			}
+			for (int c = 0; c < 3; ++c) filtered_[c][centre] = sum[c] / weightSum;
+		}
+#endif
+	}
+
+	/// <summary>
+	/// exp(-d) for d >= 0, approximated as (1 - d / 8)^8 (and zero past d = 8), which
+	/// needs only multiplies and so vectorises without a SIMD exp.
+	/// </summary>
+	static float approxExp(float d)
+	{
+		float w = std::max(1.f - d * .125f, 0.f);
+		w *= w;
+		w *= w;
+		return w * w;
+	}
+
+#ifdef RAYTRACER_SIMD_FLOAT
+	static SimdFloat::Type approxExp(SimdFloat::Type d)
+	{
+		typedef SimdFloat F;
+		F::Type w = F::max(F::sub(F::set(1.f), F::mul(d, F::set(.125f))), F::set(0.f));
+		w = F::mul(w, w);
+		w = F::mul(w, w);
+		return F::mul(w, w);
+	}
+#endif
+};
@@ -13,11 +13,8 @@ public:
 
 	virtual bool visibilityCheck(const Eigen::Vector3f& location, const Renderable* renderable) const override
 	{
-		Ray shadowRay;
-		shadowRay.origin = location;
-		shadowRay.direction = -direction_;
-		HitInfo info;
-		return !renderable->intersect(shadowRay, 1e-4f, 1e4f, info, SHADOW_BITMASK);
+		Ray shadowRay(location, -direction_);
+		return !renderable->occluded(shadowRay, 1e-4f, 1e4f, SHADOW_BITMASK);
 	}
 
 	virtual Eigen::Vector3f getIntensity(const Eigen::Vector3f& location) const override
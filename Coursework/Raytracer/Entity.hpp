@@ -1,18 +1,33 @@
 #pragma once
 #include <Eigen/Dense>
+#include <stdexcept>
+#include "Ray.hpp"
+
+/// <summary>
+/// A compact affine transform: the top three rows of a 4x4 matrix whose bottom row
+/// is (0, 0, 0, 1).
+/// </summary>
+typedef Eigen::Matrix<float, 3, 4> AffineMatrix;
 
 /// <summary>
 /// An Entity is any object in the world with a 6DoF transform
 /// encoded as a 4x4 modelToWorld matrix.
+/// The inverse transform and the matrix for transforming normals are worked out
+/// when modelToWorld is set, rather than every time they're needed, and entities
+/// with an identity transform skip transforming rays altogether.
 /// </summary>
 class Entity
 {
 private:
 	Eigen::Matrix4f modelToWorld_;
+	AffineMatrix worldToModel_;
+	Eigen::Matrix3f normalMatrix_; // Inverse transpose of the upper 3x3 of modelToWorld.
+	bool identity_;
 
 public:
 	Entity()
-		:modelToWorld_(Eigen::Matrix4f::Identity())
+		:modelToWorld_(Eigen::Matrix4f::Identity()), worldToModel_(AffineMatrix::Identity()),
+		normalMatrix_(Eigen::Matrix3f::Identity()), identity_(true)
 	{}
 
 	virtual ~Entity() noexcept
@@ -25,12 +40,51 @@ public:
 
 	Eigen::Matrix4f worldToModel() const
 	{
-		return modelToWorld_.inverse();
+		Eigen::Matrix4f m = Eigen::Matrix4f::Identity();
+		m.block<3, 4>(0, 0) = worldToModel_;
+		return m;
+	}
+
+	const AffineMatrix& worldToModelAffine() const
+	{
+		return worldToModel_;
+	}
+
+	/// <summary>
+	/// The matrix taking model space normals to world space (before renormalising).
+	/// </summary>
+	const Eigen::Matrix3f& normalMatrix() const
+	{
+		return normalMatrix_;
+	}
+
+	bool hasIdentityTransform() const
+	{
+		return identity_;
+	}
+
+	/// <summary>
+	/// Transforms a world space ray into model space. The direction isn't renormalised,
+	/// so distances along the ray are the same in both spaces.
+	/// </summary>
+	Ray rayToModel(const Ray& ray) const
+	{
+		if (identity_) return ray;
+		return Ray(worldToModel_.leftCols<3>() * ray.origin + worldToModel_.col(3),
+			worldToModel_.leftCols<3>() * ray.direction);
 	}
 
 	virtual void modelToWorld(const Eigen::Matrix4f& m)
 	{
+		if (m.row(3) != Eigen::RowVector4f(0.f, 0.f, 0.f, 1.f))
+			throw(std::runtime_error("Entity transforms must be affine."));
+
 		modelToWorld_ = m;
+		identity_ = m.isIdentity(0.f);
+
+		Eigen::Matrix3f linearInverse = m.block<3, 3>(0, 0).inverse();
+		worldToModel_.leftCols<3>() = linearInverse;
+		worldToModel_.col(3) = -linearInverse * m.block<3, 1>(0, 3);
+		normalMatrix_ = linearInverse.transpose();
 	}
 };
-
@@ -0,0 +1,59 @@
+#pragma once
+#include "Light.hpp"
+#include "GeomUtil.hpp"
+
+/// <summary>
+/// A uniform sky that lights the scene equally from every direction, like the ambient
+/// light but with shadows and interreflections. Only the PathTracer uses it, by sampling
+/// directions towards it and by picking up its radiance on rays that leave the scene.
+/// The Whitted shaders model this with their ambient term instead, so for them it adds
+/// no light.
+/// </summary>
+class EnvironmentLight : public Light
+{
+private:
+	Eigen::Vector3f radiance_;
+public:
+	EnvironmentLight(const Eigen::Vector3f& radiance)
+		:radiance_(radiance)
+	{}
+
+	virtual bool visibilityCheck(const Eigen::Vector3f& location, const Renderable* renderable) const override
+	{
+		return true;
+	}
+
+	virtual Eigen::Vector3f getIntensity(const Eigen::Vector3f& location) const override
+	{
+		return Eigen::Vector3f::Zero();
+	}
+
+	virtual Eigen::Vector3f getVecToLight(const Eigen::Vector3f& location) const override
+	{
+		return Eigen::Vector3f::Zero();
+	}
+
+	virtual bool isDelta() const override
+	{
+		return false;
+	}
+
+	virtual Eigen::Vector3f sampleDirection(const Eigen::Vector3f& location, const Eigen::Vector2f& u,
+		Eigen::Vector3f& direction, float& pdf, float& distance) const override
+	{
+		direction = sampleUniformSphere(u);
+		pdf = directionPdf(location, direction);
+		distance = 1e4f;
+		return radiance_;
+	}
+
+	virtual float directionPdf(const Eigen::Vector3f& location, const Eigen::Vector3f& direction) const override
+	{
+		return 1.f / (4.f * static_cast<float>(M_PI));
+	}
+
+	virtual Eigen::Vector3f escapedRadiance(const Eigen::Vector3f& direction) const override
+	{
+		return radiance_;
+	}
+};
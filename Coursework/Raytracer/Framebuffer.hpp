@@ -0,0 +1,225 @@
+#pragma once
+#include "HitInfo.hpp"
+#include "Shader.hpp"
+#include "TraversalStats.hpp"
+#include <Eigen/Dense>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+/// <summary>
+/// The arbitrary output variables (AOVs) a Framebuffer can hold as well as the image.
+/// </summary>
+enum class AOV
+{
+	Beauty, // The final colour of the pixel, before it's clamped for the output image.
+	Depth, // Distance along the camera ray to the hit (hitT), or zero on a miss.
+	Normal, // World space normal at the hit.
+	Albedo, // Shader::getAlbedo at the hit, or white on a miss.
+	TexCoords, // Texture coordinates at the hit.
+	ShaderID, // Which shader was hit, numbered from 0 in order of first appearance, or -1 on a miss.
+	TraversalCost, // BVH nodes visited and primitives tested tracing the pixel (see TraversalStats).
+	Count
+};
+
+/// <summary>
+/// Gets an AOV from its name in the config file.
+/// </summary>
+inline AOV parseAOV(const std::string& name)
+{
+	if (name == "beauty") return AOV::Beauty;
+	if (name == "depth") return AOV::Depth;
+	if (name == "normal") return AOV::Normal;
+	if (name == "albedo") return AOV::Albedo;
+	if (name == "texcoords") return AOV::TexCoords;
+	if (name == "shaderId") return AOV::ShaderID;
+	if (name == "traversalCost") return AOV::TraversalCost;
+	throw std::runtime_error("Unknown AOV: " + name);
+}
+
+inline const char* aovName(AOV aov)
+{
+	static const char* names[] = { "beauty", "depth", "normal", "albedo", "texcoords", "shaderId", "traversalCost" };
+	return names[static_cast<int>(aov)];
+}
+
+/// <summary>
+/// The Framebuffer holds float channels for each pixel of the image: the beauty (colour)
+/// and any other AOVs that are enabled, so one render can produce every pass needed for
+/// compositing or debugging. Each enabled AOV is a single array allocated up front, with
+/// its channels interleaved per pixel, so writing a pixel never allocates. Integrators
+/// write pixels with setBeauty, recordHit and recordCost, which skip the AOVs that aren't
+/// enabled. Pixels are indexed like the camera, with y = 0 at the bottom of the image.
+/// Different threads can write different pixels at the same time.
+/// </summary>
+class Framebuffer
+{
+private:
+	int width_, height_;
+	std::vector<float> channels_[static_cast<int>(AOV::Count)];
+	// Shader IDs are kept as pointers while rendering, and numbered when they're read.
+	std::vector<const Shader*> shaders_;
+
+public:
+	Framebuffer(int width, int height, const std::vector<AOV>& aovs)
+		:width_(width), height_(height)
+	{
+		for (AOV aov : aovs) {
+			if (enabled(aov)) continue;
+			if (aov == AOV::ShaderID) shaders_.assign(width * height, nullptr);
+			else channels_[static_cast<int>(aov)].assign(static_cast<size_t>(width) * height * channelCount(aov), 0.f);
+		}
+		if (enabled(AOV::Albedo)) {
+			for (float& a : channels_[static_cast<int>(AOV::Albedo)]) a = 1.f;
+		}
+	}
+
+	int width() const
+	{
+		return width_;
+	}
+
+	int height() const
+	{
+		return height_;
+	}
+
+	bool enabled(AOV aov) const
+	{
+		return aov == AOV::ShaderID ? !shaders_.empty() : !channels_[static_cast<int>(aov)].empty();
+	}
+
+	/// <summary>
+	/// The number of floats per pixel for an AOV.
+	/// </summary>
+	static int channelCount(AOV aov)
+	{
+		switch (aov) {
+		case AOV::Depth:
+		case AOV::ShaderID:
+			return 1;
+		case AOV::TexCoords:
+		case AOV::TraversalCost:
+			return 2;
+		default:
+			return 3;
+		}
+	}
+
+	/// <summary>
+	/// The channels of an enabled AOV (other than ShaderID) for a pixel.
+	/// </summary>
+	const float* pixel(AOV aov, int x, int y) const
+	{
+		return &channels_[static_cast<int>(aov)][static_cast<size_t>(x + y * width_) * channelCount(aov)];
+	}
+
+	/// <summary>
+	/// The shader hit at a pixel, if the ShaderID AOV is enabled.
+	/// </summary>
+	const Shader* shader(int x, int y) const
+	{
+		return shaders_[x + y * width_];
+	}
+
+	void setBeauty(int x, int y, const Eigen::Vector3f& color)
+	{
+		if (enabled(AOV::Beauty)) set(AOV::Beauty, x, y, color.data());
+	}
+
+	/// <summary>
+	/// Writes the AOVs that describe what a camera ray through the pixel hit.
+	/// </summary>
+	void recordHit(int x, int y, bool hit, const HitInfo& hitInfo)
+	{
+		if (!hit) return;
+		if (enabled(AOV::Depth)) set(AOV::Depth, x, y, &hitInfo.hitT);
+		if (enabled(AOV::Normal)) {
+			const Eigen::Vector3f normal = hitInfo.normal.normalized();
+			set(AOV::Normal, x, y, normal.data());
+		}
+		if (enabled(AOV::Albedo)) {
+			const Eigen::Vector3f albedo = hitInfo.shader->getAlbedo(hitInfo);
+			set(AOV::Albedo, x, y, albedo.data());
+		}
+		if (enabled(AOV::TexCoords)) set(AOV::TexCoords, x, y, hitInfo.texCoords.data());
+		if (enabled(AOV::ShaderID)) shaders_[x + y * width_] = hitInfo.shader;
+	}
+
+	/// <summary>
+	/// Writes the traversal cost of a pixel, e.g. the difference in TraversalStats::local()
+	/// from before to after tracing it.
+	/// </summary>
+	void recordCost(int x, int y, const TraversalStats& cost)
+	{
+		if (!enabled(AOV::TraversalCost)) return;
+		const float values[2] = { static_cast<float>(cost.nodes), static_cast<float>(cost.primitives) };
+		set(AOV::TraversalCost, x, y, values);
+	}
+
+	/// <summary>
+	/// The shader IDs, numbered in order of first appearance from the bottom row up, so
+	/// they're the same from run to run. Misses are -1.
+	/// </summary>
+	std::vector<float> shaderIDs() const
+	{
+		std::vector<float> ids(shaders_.size(), -1.f);
+		std::vector<const Shader*> seen;
+		for (size_t i = 0; i < shaders_.size(); ++i) {
+			if (!shaders_[i]) continue;
+			size_t id = std::find(seen.begin(), seen.end(), shaders_[i]) - seen.begin();
+			if (id == seen.size()) seen.push_back(shaders_[i]);
+			ids[i] = static_cast<float>(id);
+		}
+		return ids;
+	}
+
+	/// <summary>
+	/// Saves each of the given AOVs (which must be enabled) as a PFM (portable float map)
+	/// file named after the output image, e.g. output.depth.pfm for output.png. AOVs with
+	/// two channels are saved with a third channel of zeros, as PFM only has one or three.
+	/// </summary>
+	void write(const std::string& outputFilename, const std::vector<AOV>& aovs) const
+	{
+		const std::string base = outputFilename.substr(0, outputFilename.find_last_of('.'));
+		for (AOV aov : aovs) {
+			if (!enabled(aov)) throw std::runtime_error(std::string("AOV not enabled: ") + aovName(aov));
+			const std::string filename = base + "." + aovName(aov) + ".pfm";
+			std::ofstream file(filename, std::ios::binary);
+			if (!file) throw std::runtime_error("Can't write " + filename);
+
+			// A negative scale marks the floats as little endian.
+			const uint16_t one = 1;
+			uint8_t firstByte;
+			std::memcpy(&firstByte, &one, 1);
+			const int channels = channelCount(aov);
+			file << (channels == 1 ? "Pf" : "PF") << "\n" << width_ << " " << height_ << "\n"
+				<< (firstByte == 1 ? "-1.0" : "1.0") << "\n";
+
+			// PFM rows go from the bottom of the image to the top, like ours.
+			const std::vector<float> ids = aov == AOV::ShaderID ? shaderIDs() : std::vector<float>();
+			const float* data = aov == AOV::ShaderID ? ids.data() : channels_[static_cast<int>(aov)].data();
+			const int fileChannels = channels == 1 ? 1 : 3;
+			std::vector<float> row(static_cast<size_t>(width_) * fileChannels, 0.f);
+			for (int y = 0; y < height_; ++y) {
+				for (int x = 0; x < width_; ++x) {
+					for (int c = 0; c < channels; ++c) {
+						row[x * fileChannels + c] = data[static_cast<size_t>(x + y * width_) * channels + c];
+					}
+				}
+				file.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+			}
+		}
+	}
+
+private:
+	void set(AOV aov, int x, int y, const float* values)
+	{
+		const int n = channelCount(aov);
+		std::copy(values, values + n, &channels_[static_cast<int>(aov)][static_cast<size_t>(x + y * width_) * n]);
+	}
+};
@@ -1,6 +1,8 @@
 #pragma once
 # define M_PI           3.14159265358979323846
 #include <Eigen/Dense>
+#include <cmath>
+#include <algorithm>
 #include "AABB.hpp"
 #include "Ray.hpp"
 #include "Renderable.hpp"
@@ -97,10 +99,12 @@ Eigen::Vector3f transformDirection(const Eigen::Matrix4f& transform, const Eigen
 /// <summary>
 /// Apply a transform to a normal vector. This multiplies by the inverse transpose of the 
 /// 3x3 upper left corner of the matrix.
+/// This inverts a matrix on every call, so when transforming many normals by the same
+/// matrix use Entity::normalMatrix() (or cache the matrix) instead.
 /// </summary>
 Eigen::Vector3f transformNormal(const Eigen::Matrix4f& transform, const Eigen::Vector3f& normal)
 {
-	Eigen::Matrix3f normMat = transform.block<3, 3>(0, 0).inverse();
+	Eigen::Matrix3f normMat = transform.block<3, 3>(0, 0).inverse().transpose();
 	return normMat * normal;
 }
 
@@ -139,6 +143,57 @@ Eigen::Vector3f refract(const Eigen::Vector3f& inDir, const Eigen::Vector3f& nor
 		return iorRatio * inDir - (iorRatio * normalDotInDir + sqrt(k)) * corrNorm;
 }
 
+/// <summary>
+/// Make two unit vectors that form an orthonormal basis with the unit vector n.
+/// From Duff et al., "Building an Orthonormal Basis, Revisited" (2017).
+/// </summary>
+void makeOrthonormalBasis(const Eigen::Vector3f& n, Eigen::Vector3f& tangent, Eigen::Vector3f& bitangent)
+{
+	float sign = std::copysign(1.f, n.z());
+	float a = -1.f / (sign + n.z());
+	float b = n.x() * n.y() * a;
+	tangent = Eigen::Vector3f(1.f + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+	bitangent = Eigen::Vector3f(b, sign + n.y() * n.y() * a, -n.y());
+}
+
+/// <summary>
+/// Map a uniform random point u in [0, 1) x [0, 1) to a direction in the hemisphere
+/// around the unit vector axis, picked with probability proportional to cos^exponent of
+/// its angle to the axis. The solid angle pdf is (exponent + 1) / (2 pi) * cos^exponent.
+/// An exponent of 1 gives cosine-weighted (diffuse) directions, and higher exponents
+/// give the tighter lobes of Phong highlights.
+/// </summary>
+Eigen::Vector3f samplePowerCosine(const Eigen::Vector3f& axis, float exponent, const Eigen::Vector2f& u)
+{
+	float cosTheta = exponent == 1.f ? sqrtf(u.x()) : powf(u.x(), 1.f / (exponent + 1.f));
+	float sinTheta = sqrtf(std::max(0.f, 1.f - cosTheta * cosTheta));
+	float phi = 2.f * static_cast<float>(M_PI) * u.y();
+	Eigen::Vector3f tangent, bitangent;
+	makeOrthonormalBasis(axis, tangent, bitangent);
+	return sinTheta * cosf(phi) * tangent + sinTheta * sinf(phi) * bitangent + cosTheta * axis;
+}
+
+/// <summary>
+/// The solid angle pdf of samplePowerCosine picking a direction at cosTheta to the axis.
+/// </summary>
+float powerCosinePdf(float cosTheta, float exponent)
+{
+	if (cosTheta <= 0.f) return 0.f;
+	return (exponent + 1.f) / (2.f * static_cast<float>(M_PI)) * powf(cosTheta, exponent);
+}
+
+/// <summary>
+/// Map a uniform random point u in [0, 1) x [0, 1) to a uniformly distributed direction
+/// on the unit sphere. The solid angle pdf is 1 / (4 pi).
+/// </summary>
+Eigen::Vector3f sampleUniformSphere(const Eigen::Vector2f& u)
+{
+	float z = 1.f - 2.f * u.x();
+	float r = sqrtf(std::max(0.f, 1.f - z * z));
+	float phi = 2.f * static_cast<float>(M_PI) * u.y();
+	return Eigen::Vector3f(r * cosf(phi), r * sinf(phi), z);
+}
+
 /// <summary>
 /// Multiply two 3D vectors coefficient-wise, producing a 3D vector as output.
 /// Note this is NOT the cross or dot product of the vectors.
@@ -148,15 +203,67 @@ Eigen::Vector3f coefftWiseMul(const Eigen::Vector3f& left, const Eigen::Vector3f
 	return (left.array() * right.array()).matrix();
 }
 
+/// <summary>
+/// Moller-Trumbore ray-triangle intersection, for a triangle given by its first vertex
+/// and the two edges from it (v1 - v0 and v2 - v0), which can be precomputed.
+/// Everything must be in the same space as the ray.
+/// On a hit, returns true and sets the distance t along the ray and the barycentric
+/// coordinates (u, v) of the hit point. Does not check t against any range.
+/// </summary>
+bool intersectTriangleEdges(const Ray& ray,
+	const Eigen::Vector3f& v0, const Eigen::Vector3f& v0v1, const Eigen::Vector3f& v0v2,
+	bool culling, float& t, float& u, float& v)
+{
+	// Intersection code from
+	// https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection.html
+	Eigen::Vector3f pvec = ray.direction.cross(v0v2);
+	float det = v0v1.dot(pvec);
+
+	if (culling) {
+		// if the determinant is negative, the triangle is 'back facing'
+		// if the determinant is close to 0, the ray misses the triangle
+		if (det < 1e-6) return false;
+	}
+	else {
+		// ray and triangle are parallel if det is close to 0
+		if (fabs(det) < 1e-6) return false;
+	}
+
+	float invDet = 1 / det;
+
+	Eigen::Vector3f tvec = ray.origin - v0;
+	u = tvec.dot(pvec) * invDet;
+	if (u < 0 || u > 1) return false;
+
+	Eigen::Vector3f qvec = tvec.cross(v0v1);
+	v = ray.direction.dot(qvec) * invDet;
+	if (v < 0 || u + v > 1) return false;
+
+	t = v0v2.dot(qvec) * invDet;
+	return true;
+}
+
+/// <summary>
+/// Moller-Trumbore ray-triangle intersection. Vertices must be in the same space as the ray.
+/// On a hit, returns true and sets the distance t along the ray and the barycentric
+/// coordinates (u, v) of the hit point. Does not check t against any range.
+/// </summary>
+bool intersectTriangle(const Ray& ray,
+	const Eigen::Vector3f& v0, const Eigen::Vector3f& v1, const Eigen::Vector3f& v2,
+	bool culling, float& t, float& u, float& v)
+{
+	return intersectTriangleEdges(ray, v0, v1 - v0, v2 - v0, culling, t, u, v);
+}
+
 /// <summary>
 /// Given a list of renderables, finds an AABB surrounding them all.
 /// </summary>
 AABB getRenderablesAABB(const std::vector<std::shared_ptr<Renderable>>& renderables)
 {
-	AABB aabb;
-	// **** YOUR CODE HERE ****
-	// Iterate through the list of renderables, and find an AABB that surrounds all of them.
-	// Make use of the getAABB() method that all Renderable instances have.
+	AABB aabb = AABB::empty();
+	for (const auto& renderable : renderables) {
+		aabb.extend(renderable->getAABB());
+	}
 	return aabb;
 }
 
@@ -2,6 +2,7 @@
 #include <Eigen/Dense>
 
 class Shader;
+class Renderable;
 
 /// <summary>
 /// Structure encoding information from an intersection test.
@@ -16,3 +17,16 @@ struct HitInfo
 	Eigen::Vector2f texCoords; // Texture coordinates at the hit location.
 	const Shader* shader; // Shader associated with the hit object.
 };
+
+/// <summary>
+/// The minimum needed to identify a hit while a ray is being traced: the distance,
+/// what was hit and where on it. The full HitInfo is only worked out once, for the
+/// closest hit, by passing this to renderable->fillHitInfo.
+/// </summary>
+struct PrimitiveHit
+{
+	float t; // Distance along the ray.
+	const Renderable* renderable; // The Renderable that can fill out the HitInfo (e.g. a Mesh).
+	int prim; // Which primitive of the renderable was hit, e.g. a triangle index.
+	float u, v; // Barycentric coordinates of the hit on the primitive.
+};
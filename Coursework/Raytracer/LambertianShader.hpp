@@ -1,5 +1,6 @@
 #pragma once
 #include "Shader.hpp"
+#include "GeomUtil.hpp"
 
 /// <summary>
 /// Shader for diffuse, Lambertian surfaces of a single colour.
@@ -35,5 +36,31 @@ public:
 
 		return color;
 	}
-};
 
+	virtual Eigen::Vector3f getAlbedo(const HitInfo& hitInfo) const override
+	{
+		return albedo_;
+	}
+
+	virtual bool hasBSDF() const override
+	{
+		return true;
+	}
+
+	virtual Eigen::Vector3f evalBSDF(const HitInfo& hitInfo, const Eigen::Vector3f& direction, float& pdf) const override
+	{
+		float cosTheta = std::max(direction.dot(hitInfo.normal), 0.f);
+		pdf = powerCosinePdf(cosTheta, 1.f);
+		return albedo_ * (cosTheta / static_cast<float>(M_PI));
+	}
+
+	virtual bool sampleBSDF(const HitInfo& hitInfo, Sampler& sampler, BSDFSample& sample) const override
+	{
+		// Cosine-weighted directions cancel the cosine and 1 / pi in the BSDF, leaving the albedo.
+		sample.direction = samplePowerCosine(hitInfo.normal, 1.f, sampler.next2D());
+		sample.pdf = powerCosinePdf(sample.direction.dot(hitInfo.normal), 1.f);
+		sample.weight = albedo_;
+		sample.specular = false;
+		return sample.pdf > 0.f;
+	}
+};
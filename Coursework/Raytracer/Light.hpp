@@ -11,5 +11,45 @@ public:
 	virtual bool visibilityCheck(const Eigen::Vector3f& location, const Renderable* renderable) const = 0;
 	virtual Eigen::Vector3f getIntensity(const Eigen::Vector3f& location) const = 0;
 	virtual Eigen::Vector3f getVecToLight(const Eigen::Vector3f& location) const = 0;
-};
 
+	/// <summary>
+	/// Whether the light comes from a single point or direction (e.g. point and directional
+	/// lights). Rays can't hit these by chance, so the PathTracer only ever reaches them
+	/// through visibilityCheck, getVecToLight and getIntensity. Lights that cover an area of
+	/// directions return false, and implement sampleDirection, directionPdf and
+	/// escapedRadiance instead.
+	/// </summary>
+	virtual bool isDelta() const
+	{
+		return true;
+	}
+
+	/// <summary>
+	/// Picks a direction towards the light from location, using the random point u, for
+	/// next event estimation. Returns the radiance arriving from that direction if nothing
+	/// is in the way, and sets the direction, its solid angle pdf and the distance to the
+	/// light along it.
+	/// </summary>
+	virtual Eigen::Vector3f sampleDirection(const Eigen::Vector3f& location, const Eigen::Vector2f& u,
+		Eigen::Vector3f& direction, float& pdf, float& distance) const
+	{
+		pdf = 0.f;
+		return Eigen::Vector3f::Zero();
+	}
+
+	/// <summary>
+	/// The solid angle pdf of sampleDirection picking direction from location.
+	/// </summary>
+	virtual float directionPdf(const Eigen::Vector3f& location, const Eigen::Vector3f& direction) const
+	{
+		return 0.f;
+	}
+
+	/// <summary>
+	/// The radiance the light adds to a ray that leaves the scene in direction.
+	/// </summary>
+	virtual Eigen::Vector3f escapedRadiance(const Eigen::Vector3f& direction) const
+	{
+		return Eigen::Vector3f::Zero();
+	}
+};
@@ -0,0 +1,404 @@
+#pragma once
+#include "Renderable.hpp"
+#include "GeomUtil.hpp"
+#include "Model.hpp"
+#include "BVHNode.hpp"
+#include "BVHBuilder.hpp"
+#include "MeshTriangles.hpp"
+#include "TraversalStats.hpp"
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <cmath>
+
+/// <summary>
+/// A single node of a LinearBVH, packed into 32 bytes so two fit in a cache line.
+/// For interior nodes offset is the index of the second child (the first child always
+/// directly follows its parent). For leaves it is the index of the first primitive.
+/// </summary>
+struct LinearBVHNode
+{
+	float boundsMin[3];
+	int32_t offset;
+	float boundsMax[3];
+	uint16_t primCount; // 0 for interior nodes.
+	uint8_t splitAxis;
+	uint8_t pad;
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes.");
+
+/// <summary>
+/// A LinearBVH is a "compiled" version of the BVH built by BVHBuilder. Rather than a tree
+/// of Renderables, the nodes are stored in one contiguous array in depth-first order,
+/// and each leaf refers to a range of triangles in a single array. Traversal is a single
+/// loop with an explicit stack, so there are no virtual calls, shared_ptr dereferences or
+/// ray transforms while walking the tree.
+/// As with BVHNode, the structure is built in world space, so the modelToWorld transform
+/// must be given to the constructor. Built with an identity transform, a LinearBVH can
+/// also be shared between many MeshInstances as a bottom level acceleration structure.
+/// </summary>
+class LinearBVH : public Renderable
+{
+private:
+	std::vector<LinearBVHNode> nodes_;
+	MeshTriangles triangles_; // Triangles in leaf order.
+	bool culling_;
+
+public:
+	LinearBVH(const Model& model, const Shader* shader, const BVHBuildOptions& options,
+		const Eigen::Matrix4f& modelToWorld, bool culling = true, IntersectMask mask = DEFAULT_BITMASK)
+		:LinearBVH(model, shader, BVHBuilder(options).build(BVHNode::modelPrimitives(model, modelToWorld)),
+			modelToWorld, culling, mask)
+	{}
+
+	/// <summary>
+	/// Makes a LinearBVH from a tree that has already been built over the model's faces with
+	/// the same modelToWorld transform (e.g. one loaded by MeshCache).
+	/// </summary>
+	LinearBVH(const Model& model, const Shader* shader, const BVHBuildTree& tree,
+		const Eigen::Matrix4f& modelToWorld, bool culling = true, IntersectMask mask = DEFAULT_BITMASK)
+		:Renderable(shader, mask), culling_(culling)
+	{
+		nodes_ = flatten(tree);
+		triangles_ = MeshTriangles(&model, tree.primIndices, modelToWorld);
+	}
+
+	int nnodes() const
+	{
+		return static_cast<int>(nodes_.size());
+	}
+
+	const MeshTriangles& triangles() const
+	{
+		return triangles_;
+	}
+
+	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	{
+		return intersectDeferred(ray, minT, maxT, info, mask);
+	}
+
+	virtual bool intersectPrimitive(const Ray& ray, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		int tri;
+		float u, v;
+		if (!intersectTriangles(ray, minT, maxT, tri, u, v)) return false;
+		hit.t = maxT;
+		hit.renderable = this;
+		hit.prim = tri;
+		hit.u = u;
+		hit.v = v;
+		return true;
+	}
+
+	virtual void fillHitInfo(const Ray& ray, const PrimitiveHit& hit, HitInfo& info) const override
+	{
+		triangles_.fillHitInfo(ray, hit.t, hit.prim, hit.u, hit.v, shader(), info);
+	}
+
+	/// <summary>
+	/// Finds the closest triangle hit along the ray between minT and maxT, without computing
+	/// any shading attributes. On a hit, maxT is set to the hit distance, and tri is the
+	/// index of the triangle in triangles() with (u, v) the barycentric coordinates.
+	/// </summary>
+	bool intersectTriangles(const Ray& ray, float minT, float& maxT, int& tri, float& u, float& v) const
+	{
+		tri = -1;
+		return culling_ ? intersectLeaves<true>(ray, minT, maxT, tri, u, v) : intersectLeaves<false>(ray, minT, maxT, tri, u, v);
+	}
+
+	/// <summary>
+	/// Traces a packet of rays through the BVH together. Each node's box is tested against
+	/// every ray in the packet at once, and the node is visited if any of them hit it.
+	/// Leaves test each triangle against every ray, so the triangle data is loaded once
+	/// per packet rather than once per ray. Incoherent packets are traced ray by ray.
+	/// </summary>
+	virtual void intersectPacket(const RayPacket& packet, float minT, float maxT, HitInfo info[], bool hit[],
+		IntersectMask mask) const override
+	{
+		if (!packet.coherent()) {
+			Renderable::intersectPacket(packet, minT, maxT, info, hit, mask);
+			return;
+		}
+
+		for (int lane = 0; lane < packet.size; ++lane) hit[lane] = false;
+		int first = packet.firstActive();
+		if (!checkMask(mask) || nodes_.empty() || first < 0) return;
+
+		// Inactive lanes start with an empty range, so they never hit anything.
+		float closestT[RayPacket::maxSize], hitU[RayPacket::maxSize], hitV[RayPacket::maxSize];
+		int hitTri[RayPacket::maxSize];
+		for (int lane = 0; lane < RayPacket::maxSize; ++lane) {
+			closestT[lane] = lane < packet.size && packet.active[lane] ? maxT : -std::numeric_limits<float>::max();
+			hitTri[lane] = -1;
+		}
+
+		// All the rays share an octant, so any one of them gives the near side of a split.
+		bool dirIsNeg[3];
+		for (int a = 0; a < 3; ++a) dirIsNeg[a] = packet.direction[a][first] < 0.f;
+
+		TraversalCounter counter;
+		int stack[64];
+		int stackSize = 0;
+		int nodeIdx = 0;
+		while (true) {
+			const LinearBVHNode& node = nodes_[nodeIdx];
+			++counter.nodes;
+			if (intersectNodePacket(node, packet, minT, closestT)) {
+				if (node.primCount > 0) {
+					counter.primitives += node.primCount;
+					for (int prim = node.offset; prim < node.offset + node.primCount; ++prim) {
+						intersectTrianglePacket(packet, prim, minT, closestT, hitTri, hitU, hitV);
+					}
+					if (stackSize == 0) break;
+					nodeIdx = stack[--stackSize];
+				}
+				else if (dirIsNeg[node.splitAxis]) {
+					stack[stackSize++] = nodeIdx + 1;
+					nodeIdx = node.offset;
+				}
+				else {
+					stack[stackSize++] = node.offset;
+					nodeIdx = nodeIdx + 1;
+				}
+			}
+			else {
+				if (stackSize == 0) break;
+				nodeIdx = stack[--stackSize];
+			}
+		}
+
+		for (int lane = 0; lane < packet.size; ++lane) {
+			if (hitTri[lane] < 0) continue;
+			triangles_.fillHitInfo(packet.ray(lane), closestT[lane], hitTri[lane], hitU[lane], hitV[lane], shader(), info[lane]);
+			hit[lane] = true;
+		}
+	}
+
+	/// <summary>
+	/// Checks whether the ray hits any triangle between minT and maxT, stopping as soon
+	/// as one is found.
+	/// </summary>
+	bool occludedTriangles(const Ray& ray, float minT, float maxT) const
+	{
+		return culling_ ? occludedLeaves<true>(ray, minT, maxT) : occludedLeaves<false>(ray, minT, maxT);
+	}
+
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		return checkMask(mask) && occludedTriangles(ray, minT, maxT);
+	}
+
+	virtual AABB getAABB() const override
+	{
+		return rootBounds(nodes_);
+	}
+
+	virtual std::string print() const override
+	{
+		std::stringstream ss;
+		ss << "LinearBVH with " << nodes_.size() << " nodes and " << triangles_.size() << " triangles";
+		return ss.str();
+	}
+
+	virtual void modelToWorld(const Eigen::Matrix4f& m) override
+	{
+		throw(std::runtime_error("Can't transform a LinearBVH."));
+	}
+
+	/// <summary>
+	/// Converts a tree from BVHBuilder into an array of LinearBVHNodes. Leaf offsets index
+	/// into the tree's primIndices.
+	/// </summary>
+	static std::vector<LinearBVHNode> flatten(const BVHBuildTree& tree)
+	{
+		// Traversal keeps the nodes still to visit on a fixed size stack.
+		BVHBuilder::checkDepth(tree, "LinearBVH");
+		std::vector<LinearBVHNode> nodes(tree.nodes.size());
+		for (size_t n = 0; n < tree.nodes.size(); ++n) {
+			const BVHBuildNode& buildNode = tree.nodes[n];
+			LinearBVHNode& node = nodes[n];
+			for (int i = 0; i < 3; ++i) {
+				node.boundsMin[i] = buildNode.bounds.min[i];
+				node.boundsMax[i] = buildNode.bounds.max[i];
+			}
+			node.splitAxis = static_cast<uint8_t>(buildNode.splitAxis);
+			node.pad = 0;
+			if (buildNode.isLeaf()) {
+				if (buildNode.primCount > UINT16_MAX)
+					throw std::runtime_error("Too many primitives in a LinearBVH leaf.");
+				node.offset = buildNode.firstPrim;
+				node.primCount = static_cast<uint16_t>(buildNode.primCount);
+			}
+			else {
+				// BVHBuilder stores each node's first child directly after it.
+				node.offset = buildNode.children[1];
+				node.primCount = 0;
+			}
+		}
+		return nodes;
+	}
+
+	static AABB rootBounds(const std::vector<LinearBVHNode>& nodes)
+	{
+		if (nodes.empty()) return AABB::empty();
+		AABB aabb;
+		aabb.min = Eigen::Vector3f(nodes[0].boundsMin[0], nodes[0].boundsMin[1], nodes[0].boundsMin[2]);
+		aabb.max = Eigen::Vector3f(nodes[0].boundsMax[0], nodes[0].boundsMax[1], nodes[0].boundsMax[2]);
+		return aabb;
+	}
+
+	/// <summary>
+	/// Walks an array of LinearBVHNodes front to back, calling intersectLeaf(first, count, maxT)
+	/// for each leaf the ray reaches, with the range of primitives in the leaf. intersectLeaf
+	/// should reduce maxT when it finds a closer hit, so that nodes behind it are culled by
+	/// their AABB tests. If intersectLeaf returns true, traversal stops straight away (e.g.
+	/// for shadow rays, where any hit will do).
+	/// </summary>
+	template <typename IntersectLeaf>
+	static void traverse(const std::vector<LinearBVHNode>& nodes, const Ray& ray, float minT, float& maxT,
+		IntersectLeaf intersectLeaf)
+	{
+		if (nodes.empty()) return;
+
+		const Eigen::Vector3f& invDir = ray.invDirection;
+		bool dirIsNeg[3] = { invDir.x() < 0.f, invDir.y() < 0.f, invDir.z() < 0.f };
+
+		TraversalCounter counter;
+		int stack[64];
+		int stackSize = 0;
+		int nodeIdx = 0;
+		while (true) {
+			const LinearBVHNode& node = nodes[nodeIdx];
+			++counter.nodes;
+			if (intersectNode(node, ray.origin, invDir, minT, maxT)) {
+				if (node.primCount > 0) {
+					counter.primitives += node.primCount;
+					if (intersectLeaf(node.offset, static_cast<int>(node.primCount), maxT)) return;
+					if (stackSize == 0) break;
+					nodeIdx = stack[--stackSize];
+				}
+				else {
+					// Visit the child on the near side of the split first.
+					if (dirIsNeg[node.splitAxis]) {
+						stack[stackSize++] = nodeIdx + 1;
+						nodeIdx = node.offset;
+					}
+					else {
+						stack[stackSize++] = node.offset;
+						nodeIdx = nodeIdx + 1;
+					}
+				}
+			}
+			else {
+				if (stackSize == 0) break;
+				nodeIdx = stack[--stackSize];
+			}
+		}
+	}
+
+private:
+	/// <summary>
+	/// intersectTriangles with back face culling chosen at compile time, so the leaf
+	/// kernel has no culling branch.
+	/// </summary>
+	template <bool Culling>
+	bool intersectLeaves(const Ray& ray, float minT, float& maxT, int& tri, float& u, float& v) const
+	{
+		const PackedTriangles& packed = triangles_.packed();
+		traverse(nodes_, ray, minT, maxT, [&](int first, int count, float& closestT) {
+			packed.intersectClosest<Culling>(ray, first, count, minT, closestT, tri, u, v);
+			return false;
+		});
+		return tri >= 0;
+	}
+
+	template <bool Culling>
+	bool occludedLeaves(const Ray& ray, float minT, float maxT) const
+	{
+		const PackedTriangles& packed = triangles_.packed();
+		bool hit = false;
+		traverse(nodes_, ray, minT, maxT, [&](int first, int count, float& closestT) {
+			hit = packed.intersectAny<Culling>(ray, first, count, minT, closestT);
+			return hit;
+		});
+		return hit;
+	}
+
+	/// <summary>
+	/// Slab test of a node's box against every lane of a packet. Returns true if any ray
+	/// hits the box within its current range. Written without branches in the lane loop
+	/// so it can be vectorised.
+	/// </summary>
+	static bool intersectNodePacket(const LinearBVHNode& node, const RayPacket& packet, float minT,
+		const float closestT[RayPacket::maxSize])
+	{
+		int anyHit = 0;
+		for (int lane = 0; lane < RayPacket::maxSize; ++lane) {
+			float tMin = minT, tMax = closestT[lane];
+			for (int a = 0; a < 3; ++a) {
+				float t0 = (node.boundsMin[a] - packet.origin[a][lane]) * packet.invDirection[a][lane];
+				float t1 = (node.boundsMax[a] - packet.origin[a][lane]) * packet.invDirection[a][lane];
+				tMin = std::max(tMin, std::min(t0, t1));
+				tMax = std::min(tMax, std::max(t0, t1));
+			}
+			anyHit |= tMin <= tMax;
+		}
+		return anyHit != 0;
+	}
+
+	/// <summary>
+	/// Moller-Trumbore test of one triangle against every lane of a packet, keeping the
+	/// closest hit for each lane. Misses are masked out rather than branched on, so the
+	/// lane loop can be vectorised.
+	/// </summary>
+	void intersectTrianglePacket(const RayPacket& packet, int tri, float minT, float closestT[RayPacket::maxSize],
+		int hitTri[RayPacket::maxSize], float hitU[RayPacket::maxSize], float hitV[RayPacket::maxSize]) const
+	{
+		const PackedTriangles& packed = triangles_.packed();
+		const Eigen::Vector3f v0 = packed.vertex0(tri), e1 = packed.edge1(tri), e2 = packed.edge2(tri);
+		for (int lane = 0; lane < RayPacket::maxSize; ++lane) {
+			float dx = packet.direction[0][lane], dy = packet.direction[1][lane], dz = packet.direction[2][lane];
+			float px = dy * e2.z() - dz * e2.y();
+			float py = dz * e2.x() - dx * e2.z();
+			float pz = dx * e2.y() - dy * e2.x();
+			float det = e1.x() * px + e1.y() * py + e1.z() * pz;
+			bool valid = culling_ ? det >= 1e-6f : std::fabs(det) >= 1e-6f;
+			float invDet = 1.f / det;
+
+			float tx = packet.origin[0][lane] - v0.x();
+			float ty = packet.origin[1][lane] - v0.y();
+			float tz = packet.origin[2][lane] - v0.z();
+			float u = (tx * px + ty * py + tz * pz) * invDet;
+
+			float qx = ty * e1.z() - tz * e1.y();
+			float qy = tz * e1.x() - tx * e1.z();
+			float qz = tx * e1.y() - ty * e1.x();
+			float v = (dx * qx + dy * qy + dz * qz) * invDet;
+			float t = (e2.x() * qx + e2.y() * qy + e2.z() * qz) * invDet;
+
+			valid = valid && u >= 0.f && u <= 1.f && v >= 0.f && u + v <= 1.f && t >= minT && t <= closestT[lane];
+			closestT[lane] = valid ? t : closestT[lane];
+			hitTri[lane] = valid ? tri : hitTri[lane];
+			hitU[lane] = valid ? u : hitU[lane];
+			hitV[lane] = valid ? v : hitV[lane];
+		}
+	}
+
+	static bool intersectNode(const LinearBVHNode& node, const Eigen::Vector3f& origin,
+		const Eigen::Vector3f& invDir, float minT, float maxT)
+	{
+		for (int a = 0; a < 3; ++a) {
+			float t0 = (node.boundsMin[a] - origin[a]) * invDir[a];
+			float t1 = (node.boundsMax[a] - origin[a]) * invDir[a];
+			if (invDir[a] < 0.f) std::swap(t0, t1);
+			minT = t0 > minT ? t0 : minT;
+			maxT = t1 < maxT ? t1 : maxT;
+			if (maxT < minT) return false;
+		}
+		return true;
+	}
+};
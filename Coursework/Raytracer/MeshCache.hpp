@@ -0,0 +1,389 @@
+#pragma once
+#include "Model.hpp"
+#include "BVHBuilder.hpp"
+#include "BVHNode.hpp"
+#include "MappedFile.hpp"
+#include <Eigen/Dense>
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+/// <summary>
+/// MeshCache loads a Model from an obj file together with a BVH over its faces, and keeps
+/// both in a binary cache file next to the obj (spot.obj gets spot.obj.rtcache).
+/// The cache holds the welded vertex arrays and triangle indices of the Model, and the
+/// nodes and primitive order of one BVHBuildTree, as flat arrays. It is keyed by a hash of
+/// the obj file's contents, and the tree also by the build options and modelToWorld
+/// transform it was built with, so a stale cache is never used. Loading from the cache
+/// maps the file and copies each array out in one go, without parsing or building anything.
+/// If the obj changes the whole cache is rewritten; if only the BVH parameters change the
+/// model is still loaded from the cache and just the BVH is rebuilt and saved.
+/// </summary>
+class MeshCache
+{
+private:
+	static const uint32_t version = 1;
+
+	/// <summary>
+	/// Everything that decides the shape of a BVH over a given model. Two keys match if
+	/// their bytes do, so every field is four bytes and there is no padding.
+	/// </summary>
+	struct BVHKey
+	{
+		int32_t splitMethod, maxDepth, maxLeafSize, sahBins;
+		float traversalCost, intersectionCost;
+		float modelToWorld[16];
+
+		bool operator==(const BVHKey& other) const
+		{
+			return std::memcmp(this, &other, sizeof(BVHKey)) == 0;
+		}
+	};
+
+	/// <summary>
+	/// The start of a cache file. It is followed by the vertex positions, normals, texture
+	/// coordinates, triangles, BVH nodes and BVH primitive indices, in that order.
+	/// </summary>
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder; // Cache files aren't portable between machines of different endianness.
+		uint64_t contentHash;
+		uint32_t nverts, nfaces;
+		uint32_t hasNormals;
+		uint32_t hasBVH;
+		BVHKey bvhKey;
+		uint32_t nnodes, nprims;
+	};
+
+	struct CachedBVHNode
+	{
+		float boundsMin[3], boundsMax[3];
+		int32_t children[2];
+		int32_t splitAxis, firstPrim, primCount;
+	};
+
+	static_assert(sizeof(Eigen::Vector3f) == 12 && sizeof(Eigen::Vector2f) == 8 && sizeof(TriangleIndices) == 12,
+		"The Model arrays are written to the cache as they are in memory.");
+
+	std::string objFilename_, cacheFilename_;
+	bool enabled_;
+	uint64_t contentHash_;
+	std::unique_ptr<Model> model_;
+	bool modelFromCache_ = false;
+	bool hasBVH_ = false;
+	bool bvhFromCache_ = false;
+	BVHKey bvhKey_;
+	BVHBuildTree bvh_;
+
+public:
+	/// <summary>
+	/// Loads the model, from the cache if it is up to date or from the obj file otherwise
+	/// (writing a new cache). With enabled false the cache is neither read nor written.
+	/// </summary>
+	MeshCache(const std::string& objFilename, bool enabled = true)
+		:objFilename_(objFilename), cacheFilename_(objFilename + ".rtcache"), enabled_(enabled), contentHash_(0)
+	{
+		std::memset(&bvhKey_, 0, sizeof(BVHKey));
+		if (!enabled_) {
+			model_.reset(new Model(objFilename_.c_str()));
+			return;
+		}
+
+		contentHash_ = hashFile(objFilename_);
+		modelFromCache_ = read();
+		if (!modelFromCache_) {
+			model_.reset(new Model(objFilename_.c_str()));
+			write();
+		}
+	}
+
+	const Model& model() const
+	{
+		return *model_;
+	}
+
+	/// <summary>
+	/// Whether the model was loaded from the cache file rather than the obj.
+	/// </summary>
+	bool modelFromCache() const
+	{
+		return modelFromCache_;
+	}
+
+	/// <summary>
+	/// Whether the last tree returned by bvh() came from the cache file.
+	/// </summary>
+	bool bvhFromCache() const
+	{
+		return bvhFromCache_;
+	}
+
+	/// <summary>
+	/// Returns a BVH over the model's faces, as BVHBuilder(options) would build it over
+	/// BVHNode::modelPrimitives(model(), modelToWorld). The cached tree is used if it was
+	/// built the same way; otherwise the tree is built and the cache file updated.
+	/// </summary>
+	const BVHBuildTree& bvh(const BVHBuildOptions& options, const Eigen::Matrix4f& modelToWorld)
+	{
+		BVHKey key = makeKey(options, modelToWorld);
+		if (hasBVH_ && key == bvhKey_) return bvh_;
+
+		bvh_ = BVHBuilder(options).build(BVHNode::modelPrimitives(*model_, modelToWorld));
+		bvhKey_ = key;
+		hasBVH_ = true;
+		bvhFromCache_ = false;
+		if (enabled_) write();
+		return bvh_;
+	}
+
+private:
+	static BVHKey makeKey(const BVHBuildOptions& options, const Eigen::Matrix4f& modelToWorld)
+	{
+		BVHKey key;
+		std::memset(&key, 0, sizeof(BVHKey));
+		key.splitMethod = static_cast<int32_t>(options.splitMethod);
+		key.maxDepth = options.maxDepth;
+		key.maxLeafSize = options.maxLeafSize;
+		key.sahBins = options.sahBins;
+		key.traversalCost = options.traversalCost;
+		key.intersectionCost = options.intersectionCost;
+		for (int i = 0; i < 16; ++i) key.modelToWorld[i] = modelToWorld(i % 4, i / 4);
+		return key;
+	}
+
+	static void setMagic(Header& header)
+	{
+		std::memcpy(header.magic, "RTCACHE", 8);
+		header.version = version;
+		header.byteOrder = 0x01020304;
+	}
+
+	/// <summary>
+	/// A 64-bit hash of a file's contents. The file is hashed in blocks in parallel, a word at
+	/// a time, and the block hashes are then combined in order.
+	/// </summary>
+	static uint64_t hashFile(const std::string& filename)
+	{
+		MappedFile file(filename);
+		const size_t blockSize = 1 << 20;
+		const int nBlocks = static_cast<int>((file.size() + blockSize - 1) / blockSize);
+		std::vector<uint64_t> blockHashes(nBlocks);
+		#pragma omp parallel for
+		for (int b = 0; b < nBlocks; ++b) {
+			const char* data = file.data() + b * blockSize;
+			size_t size = std::min(blockSize, file.size() - b * blockSize);
+			uint64_t h = 0x9e3779b97f4a7c15ull;
+			size_t i = 0;
+			for (; i + 8 <= size; i += 8) {
+				uint64_t word;
+				std::memcpy(&word, data + i, 8);
+				h = mix(h, word);
+			}
+			uint64_t tail = 0;
+			std::memcpy(&tail, data + i, size - i);
+			blockHashes[b] = mix(h, tail);
+		}
+
+		uint64_t h = mix(0, file.size());
+		for (uint64_t blockHash : blockHashes) h = mix(h, blockHash);
+		return h;
+	}
+
+	static uint64_t mix(uint64_t h, uint64_t word)
+	{
+		word *= 0x87c37b91114253d5ull;
+		word = (word << 31) | (word >> 33);
+		h ^= word * 0x4cf5ad432745937full;
+		h = (h << 27) | (h >> 37);
+		return h * 5 + 0x52dce729;
+	}
+
+	/// <summary>
+	/// Loads the model (and the tree, if there is one) from the cache file. Returns false
+	/// if there's no cache file or it doesn't match the obj.
+	/// </summary>
+	bool read()
+	{
+		std::unique_ptr<MappedFile> file;
+		try {
+			file.reset(new MappedFile(cacheFilename_));
+		}
+		catch (const std::runtime_error&) {
+			return false;
+		}
+
+		Header header, expected;
+		setMagic(expected);
+		if (file->size() < sizeof(Header)) return false;
+		std::memcpy(&header, file->data(), sizeof(Header));
+		if (std::memcmp(header.magic, expected.magic, 8) != 0 || header.version != expected.version ||
+			header.byteOrder != expected.byteOrder || header.contentHash != contentHash_)
+			return false;
+
+		uint64_t size = sizeof(Header) + uint64_t(header.nverts) * (2 * sizeof(Eigen::Vector3f) + sizeof(Eigen::Vector2f)) +
+			uint64_t(header.nfaces) * sizeof(TriangleIndices) +
+			uint64_t(header.nnodes) * sizeof(CachedBVHNode) + uint64_t(header.nprims) * sizeof(int32_t);
+		if (file->size() != size) return false;
+
+		const char* data = file->data() + sizeof(Header);
+		std::vector<Eigen::Vector3f> verts, normals;
+		std::vector<Eigen::Vector2f> texCoords;
+		std::vector<TriangleIndices> faces;
+		readArray(data, header.nverts, verts);
+		readArray(data, header.nverts, normals);
+		readArray(data, header.nverts, texCoords);
+		readArray(data, header.nfaces, faces);
+		for (const TriangleIndices& face : faces) {
+			for (int corner = 0; corner < 3; ++corner) {
+				if (face[corner] < 0 || face[corner] >= static_cast<int64_t>(header.nverts)) return false;
+			}
+		}
+
+		// A cache of the right size can still be corrupt, so the tree is checked before it's
+		// used, as traversal trusts every index in it.
+		BVHBuildTree tree;
+		if (header.hasBVH) {
+			std::vector<CachedBVHNode> nodes;
+			readArray(data, header.nnodes, nodes);
+			readArray(data, header.nprims, tree.primIndices);
+			tree.nodes.resize(nodes.size());
+			for (size_t n = 0; n < nodes.size(); ++n) {
+				BVHBuildNode& node = tree.nodes[n];
+				node.bounds.min = Eigen::Vector3f(nodes[n].boundsMin[0], nodes[n].boundsMin[1], nodes[n].boundsMin[2]);
+				node.bounds.max = Eigen::Vector3f(nodes[n].boundsMax[0], nodes[n].boundsMax[1], nodes[n].boundsMax[2]);
+				node.children[0] = nodes[n].children[0];
+				node.children[1] = nodes[n].children[1];
+				node.splitAxis = nodes[n].splitAxis;
+				node.firstPrim = nodes[n].firstPrim;
+				node.primCount = nodes[n].primCount;
+			}
+			if (!validTree(tree, header.nfaces)) return false;
+		}
+
+		model_.reset(new Model(std::move(verts), std::move(normals), std::move(texCoords), std::move(faces),
+			header.hasNormals != 0));
+		if (header.hasBVH) {
+			bvh_ = std::move(tree);
+			bvhKey_ = header.bvhKey;
+			hasBVH_ = true;
+			bvhFromCache_ = true;
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// Whether every index in a tree read from the cache is in range: children come after
+	/// their parents (as BVHBuilder stores them), leaves are within primIndices, and those
+	/// are faces of the model.
+	/// </summary>
+	static bool validTree(const BVHBuildTree& tree, uint32_t nfaces)
+	{
+		const int64_t nnodes = static_cast<int64_t>(tree.nodes.size());
+		const int64_t nprims = static_cast<int64_t>(tree.primIndices.size());
+		for (int64_t n = 0; n < nnodes; ++n) {
+			const BVHBuildNode& node = tree.nodes[n];
+			if (node.splitAxis < 0 || node.splitAxis > 2 || node.primCount < 0) return false;
+			if (node.isLeaf()) {
+				if (node.firstPrim < 0 || node.firstPrim + int64_t(node.primCount) > nprims) return false;
+			}
+			else {
+				for (int child : node.children) {
+					if (child <= n || child >= nnodes) return false;
+				}
+			}
+		}
+		for (int index : tree.primIndices) {
+			if (index < 0 || index >= static_cast<int64_t>(nfaces)) return false;
+		}
+		return true;
+	}
+
+	template <typename T>
+	static void readArray(const char*& data, uint32_t count, std::vector<T>& out)
+	{
+		out.resize(count);
+		// The arrays hold plain data (e.g. Eigen vectors), so copying bytes into them is fine.
+		if (count > 0) std::memcpy(static_cast<void*>(out.data()), data, count * sizeof(T));
+		data += count * sizeof(T);
+	}
+
+	/// <summary>
+	/// Writes the model and the current tree to the cache file. The file is written under
+	/// a temporary name and then renamed, so other processes never see a partial cache.
+	/// Failing to write the cache isn't an error, as everything has already been loaded.
+	/// </summary>
+	void write() const
+	{
+		const Model& model = *model_;
+		Header header;
+		std::memset(&header, 0, sizeof(Header));
+		setMagic(header);
+		header.contentHash = contentHash_;
+		header.nverts = model.nverts();
+		header.nfaces = model.nfaces();
+		header.hasNormals = model.hasNormals();
+		header.hasBVH = hasBVH_;
+		header.bvhKey = bvhKey_;
+
+		std::vector<CachedBVHNode> nodes;
+		if (hasBVH_) {
+			nodes.resize(bvh_.nodes.size());
+			for (size_t n = 0; n < nodes.size(); ++n) {
+				const BVHBuildNode& node = bvh_.nodes[n];
+				for (int a = 0; a < 3; ++a) {
+					nodes[n].boundsMin[a] = node.bounds.min[a];
+					nodes[n].boundsMax[a] = node.bounds.max[a];
+				}
+				nodes[n].children[0] = node.children[0];
+				nodes[n].children[1] = node.children[1];
+				nodes[n].splitAxis = node.splitAxis;
+				nodes[n].firstPrim = node.firstPrim;
+				nodes[n].primCount = node.primCount;
+			}
+			header.nnodes = static_cast<uint32_t>(nodes.size());
+			header.nprims = static_cast<uint32_t>(bvh_.primIndices.size());
+		}
+
+		std::string tempFilename = cacheFilename_ + "." + std::to_string(std::random_device()()) + ".tmp";
+		{
+			std::ofstream out(tempFilename, std::ios::binary);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+			// The Model's arrays are contiguous, so each is written straight from its first element.
+			if (model.nverts() > 0) {
+				out.write(reinterpret_cast<const char*>(&model.vert(0)), model.nverts() * sizeof(Eigen::Vector3f));
+				out.write(reinterpret_cast<const char*>(&model.normal(0)), model.nverts() * sizeof(Eigen::Vector3f));
+				out.write(reinterpret_cast<const char*>(&model.texCoord(0)), model.nverts() * sizeof(Eigen::Vector2f));
+			}
+			if (model.nfaces() > 0)
+				out.write(reinterpret_cast<const char*>(&model.face(0)), model.nfaces() * sizeof(TriangleIndices));
+			if (!nodes.empty()) {
+				out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(CachedBVHNode));
+				out.write(reinterpret_cast<const char*>(bvh_.primIndices.data()), bvh_.primIndices.size() * sizeof(int32_t));
+			}
+			if (!out) {
+				std::cerr << "Unable to write mesh cache " << tempFilename << std::endl;
+				out.close();
+				std::remove(tempFilename.c_str());
+				return;
+			}
+		}
+
+		// rename won't replace an existing file on Windows.
+		if (std::rename(tempFilename.c_str(), cacheFilename_.c_str()) != 0) {
+			std::remove(cacheFilename_.c_str());
+			if (std::rename(tempFilename.c_str(), cacheFilename_.c_str()) != 0) {
+				std::cerr << "Unable to write mesh cache " << cacheFilename_ << std::endl;
+				std::remove(tempFilename.c_str());
+			}
+		}
+	}
+};
@@ -0,0 +1,125 @@
+#pragma once
+#include "Renderable.hpp"
+#include "GeomUtil.hpp"
+#include "LinearBVH.hpp"
+#include <vector>
+
+/// <summary>
+/// A MeshInstance places a shared, object space LinearBVH (the bottom level acceleration
+/// structure, or BLAS) into the world with its own transform and shader. Many instances
+/// can share one BLAS, so memory and build time depend on the number of unique meshes
+/// rather than the number of copies in the scene.
+/// Rays are transformed into object space on entry, and hits back into world space.
+/// Use makeBLAS to build the BLAS for a Model, and TopLevelBVH to trace many instances.
+/// </summary>
+class MeshInstance : public Renderable
+{
+private:
+	std::shared_ptr<const LinearBVH> blas_;
+	AABB worldAABB_;
+
+public:
+	MeshInstance(std::shared_ptr<const LinearBVH> blas, const Shader* shader,
+		const Eigen::Matrix4f& modelToWorld = Eigen::Matrix4f::Identity(), IntersectMask mask = DEFAULT_BITMASK)
+		:Renderable(shader, mask), blas_(blas)
+	{
+		MeshInstance::modelToWorld(modelToWorld);
+	}
+
+	/// <summary>
+	/// Builds the object space BLAS for a model, which can then be shared by any number
+	/// of MeshInstances. The BLAS has no shader of its own, as the instances supply one.
+	/// </summary>
+	static std::shared_ptr<const LinearBVH> makeBLAS(const Model& model, const BVHBuildOptions& options, bool culling = true)
+	{
+		return std::make_shared<LinearBVH>(model, nullptr, options, Eigen::Matrix4f::Identity(), culling);
+	}
+
+	/// <summary>
+	/// Makes the BLAS from a tree already built over the model's faces in object space.
+	/// </summary>
+	static std::shared_ptr<const LinearBVH> makeBLAS(const Model& model, const BVHBuildTree& tree, bool culling = true)
+	{
+		return std::make_shared<LinearBVH>(model, nullptr, tree, Eigen::Matrix4f::Identity(), culling);
+	}
+
+	const LinearBVH& blas() const
+	{
+		return *blas_;
+	}
+
+	using Entity::modelToWorld;
+
+	/// <summary>
+	/// Sets the instance transform, and updates the world space bounds to match.
+	/// </summary>
+	virtual void modelToWorld(const Eigen::Matrix4f& m) override
+	{
+		Entity::modelToWorld(m);
+
+		// Transform the corners of the object space bounds to find the world space bounds.
+		AABB local = blas_->getAABB();
+		worldAABB_ = AABB::empty();
+		for (int corner = 0; corner < 8; ++corner) {
+			Eigen::Vector3f p(
+				corner & 1 ? local.max.x() : local.min.x(),
+				corner & 2 ? local.max.y() : local.min.y(),
+				corner & 4 ? local.max.z() : local.min.z());
+			worldAABB_.extend(transformPosition(m, p));
+		}
+	}
+
+	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	{
+		return intersectDeferred(ray, minT, maxT, info, mask);
+	}
+
+	virtual bool intersectPrimitive(const Ray& ray, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const override
+	{
+		int tri;
+		float u, v;
+		if (!checkMask(mask) || !intersectBLAS(ray, minT, maxT, tri, u, v)) return false;
+		hit.t = maxT;
+		hit.renderable = this;
+		hit.prim = tri;
+		hit.u = u;
+		hit.v = v;
+		return true;
+	}
+
+	virtual void fillHitInfo(const Ray& ray, const PrimitiveHit& hit, HitInfo& info) const override
+	{
+		blas_->triangles().fillHitInfo(rayToModel(ray), hit.t, hit.prim, hit.u, hit.v, shader(), info);
+
+		info.inDirection = ray.direction;
+		info.location = ray.origin + hit.t * ray.direction;
+		info.normal = (normalMatrix() * info.normal).normalized();
+	}
+
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		return checkMask(mask) && blas_->occludedTriangles(rayToModel(ray), minT, maxT);
+	}
+
+	/// <summary>
+	/// Finds the closest hit on the instance for a world space ray, without computing any
+	/// shading attributes. The ray direction isn't renormalised in object space, so hit
+	/// distances are the same in both spaces and maxT can be shared between instances.
+	/// </summary>
+	bool intersectBLAS(const Ray& ray, float minT, float& maxT, int& tri, float& u, float& v) const
+	{
+		return blas_->intersectTriangles(rayToModel(ray), minT, maxT, tri, u, v);
+	}
+
+	virtual AABB getAABB() const override
+	{
+		return worldAABB_;
+	}
+
+	virtual std::string print() const override
+	{
+		std::stringstream ss;
+		ss << "MeshInstance of " << blas_->print();
+		return ss.str();
+	}
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include "GeomUtil.hpp"
+#include "HitInfo.hpp"
+#include "Model.hpp"
+#include "PackedTriangles.hpp"
+#include <vector>
+
+/// <summary>
+/// MeshTriangles stores a list of triangles from a Model, already transformed into
+/// world space and packed by PackedTriangles, in the order the triangles are referenced by an
+/// acceleration structure (e.g. the leaf order of a LinearBVH).
+/// It also computes the shading attributes (normal, texture coordinates etc.) for a hit,
+/// so the structures using it only need to track which triangle was hit.
+/// </summary>
+class MeshTriangles
+{
+private:
+	const Model* model_;
+	Eigen::Matrix4f modelToWorld_;
+	Eigen::Matrix3f normalMatrix_; // Inverse transpose of the upper 3x3 of modelToWorld.
+	std::vector<int> faces_; // Face index in the model for each triangle.
+	PackedTriangles triangles_; // World space triangles.
+
+public:
+	MeshTriangles()
+		:model_(nullptr), modelToWorld_(Eigen::Matrix4f::Identity()), normalMatrix_(Eigen::Matrix3f::Identity())
+	{}
+
+	MeshTriangles(const Model* model, const std::vector<int>& faces, const Eigen::Matrix4f& modelToWorld)
+		:model_(model), modelToWorld_(modelToWorld), faces_(faces)
+	{
+		normalMatrix_ = modelToWorld_.block<3, 3>(0, 0).inverse().transpose();
+		triangles_.reserve(static_cast<int>(faces_.size()));
+		for (size_t tri = 0; tri < faces_.size(); ++tri) {
+			const TriangleIndices& face = model_->face(faces_[tri]);
+			triangles_.add(modelToWorld_, model_->vert(face[0]), model_->vert(face[1]), model_->vert(face[2]));
+		}
+	}
+
+	int size() const
+	{
+		return static_cast<int>(faces_.size());
+	}
+
+	/// <summary>
+	/// The world space triangle data, for intersection code that works on it directly.
+	/// </summary>
+	const PackedTriangles& packed() const
+	{
+		return triangles_;
+	}
+
+	/// <summary>
+	/// Intersects a ray with a single triangle. Returns the distance t and barycentric
+	/// coordinates (u, v) of the hit, without checking t against any range.
+	/// </summary>
+	bool intersect(const Ray& ray, int tri, bool culling, float& t, float& u, float& v) const
+	{
+		return triangles_.intersect(ray, tri, culling, t, u, v);
+	}
+
+	/// <summary>
+	/// Fills out the HitInfo for a hit on triangle tri at distance t along the ray,
+	/// with barycentric coordinates (u, v).
+	/// </summary>
+	void fillHitInfo(const Ray& ray, float t, int tri, float u, float v, const Shader* shader, HitInfo& info) const
+	{
+		const TriangleIndices& face = model_->face(faces_[tri]);
+
+		info.hitT = t;
+		info.inDirection = ray.direction;
+		info.location = ray.origin + t * ray.direction;
+		info.shader = shader;
+
+		if (model_->hasNormals()) {
+			Eigen::Vector3f vn0 = normalMatrix_ * model_->normal(face[0]);
+			Eigen::Vector3f vn1 = normalMatrix_ * model_->normal(face[1]);
+			Eigen::Vector3f vn2 = normalMatrix_ * model_->normal(face[2]);
+			info.normal = ((1 - (u + v)) * vn0 + u * vn1 + v * vn2).normalized();
+		}
+		else {
+			info.normal = triangles_.faceNormal(tri).normalized();
+		}
+
+		Eigen::Vector2f vt0 = model_->texCoord(face[0]);
+		Eigen::Vector2f vt1 = model_->texCoord(face[1]);
+		Eigen::Vector2f vt2 = model_->texCoord(face[2]);
+		info.texCoords = (1 - (u + v)) * vt0 + u * vt1 + v * vt2;
+	}
+};
@@ -19,8 +19,8 @@ public:
 		if (currBounceCount >= maxBounces) return Eigen::Vector3f::Zero();
 
 		Ray reflectionRay;
-		reflectionRay.direction = reflect(hitInfo.inDirection, hitInfo.normal);
-		reflectionRay.origin = hitInfo.location + 1e-4f * hitInfo.normal;
+		Eigen::Vector3f weight;
+		scatter(hitInfo, reflectionRay, weight);
 
 		Eigen::Vector3f color = Eigen::Vector3f::Zero();
 
@@ -34,4 +34,29 @@ public:
 
 		return color;
 	}
+
+	virtual bool scatter(const HitInfo& hitInfo, Ray& scattered, Eigen::Vector3f& weight) const override
+	{
+		scattered = Ray(hitInfo.location + 1e-4f * hitInfo.normal, reflect(hitInfo.inDirection, hitInfo.normal));
+		weight = Eigen::Vector3f::Ones();
+		return true;
+	}
+
+	virtual bool hasBSDF() const override
+	{
+		return true;
+	}
+
+	/// <summary>
+	/// A mirror only reflects light from one direction, which the path tracer reaches by
+	/// sampling, so evalBSDF (from the base class) is always zero.
+	/// </summary>
+	virtual bool sampleBSDF(const HitInfo& hitInfo, Sampler& sampler, BSDFSample& sample) const override
+	{
+		sample.direction = reflect(hitInfo.inDirection, hitInfo.normal);
+		sample.weight = Eigen::Vector3f::Ones();
+		sample.pdf = 0.f;
+		sample.specular = true;
+		return true;
+	}
 };
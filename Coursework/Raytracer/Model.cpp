@@ -1,85 +1,73 @@
 #include <iostream>
-#include <string>
-#include <fstream>
-#include <sstream>
 #include <vector>
+#include <unordered_map>
+#include <utility>
 #include "Model.hpp"
+#include "ObjLoader.hpp"
 
-Model::Model(const char *filename) : verts_(), faces_(), vts_() {
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) throw std::runtime_error("Couldn't open input model file!");
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) {       // read 2 characters and check the line starts with "v"
-            iss >> trash;
-            Eigen::Vector3f v;
-            for (int i=0;i<3;i++) iss >> v[i];
-            verts_.push_back(v);
-        }
-        else if (!line.compare(0, 3, "vt ")) { // read 3 characters and check the line starts with "vt "
-            iss >> trash;
-            iss >> trash;
-            Eigen::Vector2f vt;
-            for (int i=0; i<2; i++) iss >> vt[i]; 
-            vts_.push_back(vt);
-        }
-        if (!line.compare(0, 3, "vn ")) {       // read 2 characters and check the line starts with "v"
-            iss >> trash;
-            iss >> trash;
-            Eigen::Vector3f vn;
-            for (int i=0;i<3;i++) iss >> vn[i];
-            vns_.push_back(vn);
-        }
-        else if (!line.compare(0, 2, "f ")) { // f v1/vt1/vn1 v2/vt2/vn2 v3/vt3/vn3 ... making assumption v1==vt1 etc.
-            std::vector<VertexIndices> f;
-            VertexIndices idx;
-            int itrash;
-            iss >> trash;
-            while (iss >> idx.vert >> trash >> idx.tex >> trash >> idx.norm) { // read in v_i to idx and discard /vt_i/vn_i
-                idx.vert--; // in wavefront obj all indices start at 1, not zero, we need them to start at zero
-                idx.tex--;
-                idx.norm--;
+namespace {
+    // The position, texture coordinate and normal indices of a face corner, as the key for welding.
+    struct VertexIndices
+    {
+        int vert, tex, norm;
 
-                f.push_back(idx);
-            }
-            faces_.push_back(f);
+        bool operator==(const VertexIndices& other) const {
+            return vert == other.vert && tex == other.tex && norm == other.norm;
         }
-    }
-    std::cerr << "# v# " << verts_.size() << " f# "  << faces_.size() << std::endl;
-}
-
-Model::~Model() {
-}
+    };
 
-int Model::nverts() const {
-    return (int)verts_.size();
+    struct VertexIndicesHash
+    {
+        size_t operator()(const VertexIndices& idx) const {
+            size_t h = std::hash<int>()(idx.vert);
+            h = h * 31 + std::hash<int>()(idx.tex);
+            return h * 31 + std::hash<int>()(idx.norm);
+        }
+    };
 }
 
-int Model::nfaces() const {
-    return (int)faces_.size();
-}
+Model::Model(const char *filename) : verts_(), faces_(), vts_(), hasNormals_(false) {
+    ObjData obj = ObjLoader::load(filename);
 
-bool Model::hasNormals() const {
-    return vns_.size() > 0;
-}
+    std::unordered_map<VertexIndices, int, VertexIndicesHash> welded;
+    welded.reserve(obj.corners.size());
+    faces_.reserve(obj.nfaces());
+    hasNormals_ = !obj.corners.empty();
 
-std::vector<VertexIndices> Model::face(int idx) const {
-    return faces_[idx];
-}
+    // Finds the welded vertex for a face corner, adding it if this is its first use.
+    // Corners without texture coordinates or normals get zeros.
+    auto weld = [&](const ObjCorner& corner) {
+        VertexIndices idx = { corner.vert, corner.tex, corner.norm };
+        auto found = welded.find(idx);
+        if (found != welded.end()) return found->second;
+        int index = (int)verts_.size();
+        verts_.push_back(Eigen::Map<const Eigen::Vector3f>(&obj.positions[3 * idx.vert]));
+        vts_.push_back(idx.tex < 0 ? Eigen::Vector2f::Zero() : Eigen::Vector2f(Eigen::Map<const Eigen::Vector2f>(&obj.texCoords[3 * idx.tex])));
+        vns_.push_back(idx.norm < 0 ? Eigen::Vector3f::Zero() : Eigen::Vector3f(Eigen::Map<const Eigen::Vector3f>(&obj.normals[3 * idx.norm])));
+        hasNormals_ = hasNormals_ && idx.norm >= 0;
+        welded.emplace(idx, index);
+        return index;
+    };
 
-Eigen::Vector3f Model::vert(int i) const {
-    return verts_[i];
+    // Split polygons into a fan of triangles around the first corner.
+    for (int f = 0; f < obj.nfaces(); ++f) {
+        if (obj.faceSize(f) < 3) continue;
+        int first = weld(obj.corner(f, 0));
+        int previous = weld(obj.corner(f, 1));
+        for (int i = 2; i < obj.faceSize(f); ++i) {
+            int next = weld(obj.corner(f, i));
+            faces_.push_back({ { first, previous, next } });
+            previous = next;
+        }
+    }
+    std::cerr << "# v# " << obj.npositions() << " f# "  << faces_.size() << std::endl;
 }
 
-Eigen::Vector2f Model::texCoord(int i) const {
-    return vts_[i];
+Model::Model(std::vector<Eigen::Vector3f> verts, std::vector<Eigen::Vector3f> normals,
+    std::vector<Eigen::Vector2f> texCoords, std::vector<TriangleIndices> faces, bool hasNormals)
+    : verts_(std::move(verts)), vns_(std::move(normals)), vts_(std::move(texCoords)), faces_(std::move(faces)),
+    hasNormals_(hasNormals) {
 }
 
-Eigen::Vector3f Model::normal(int i) const {
-    return vns_[i];
+Model::~Model() {
 }
-
@@ -3,29 +3,74 @@
 #include <vector>
 #include <Eigen/Dense>
 
-struct VertexIndices
+/// <summary>
+/// The three vertex indices of a triangle in a Model. Each index refers to a welded
+/// vertex, so the same index is used for the position, normal and texture coordinates.
+/// </summary>
+struct TriangleIndices
 {
-	int vert, tex, norm;
+	int vert[3];
+
+	int operator[](int corner) const
+	{
+		return vert[corner];
+	}
 };
 
 
 /// <summary>
 /// A Model stores mesh data and can load this data from an obj file.
+/// Obj files index positions, texture coordinates and normals separately. When the
+/// model is loaded, each distinct combination used by a face corner becomes one welded
+/// vertex, so a triangle is just three indices into the vertex arrays. All the
+/// triangles' indices are stored in a single contiguous array, and polygons with more
+/// than three corners are split into triangles.
+/// A Model can also be made straight from welded arrays, e.g. ones read back by MeshCache.
 /// </summary>
 class Model {
 private:
-	std::vector<Eigen::Vector3f> verts_, vns_; // Vertices and vertex normals
+	std::vector<Eigen::Vector3f> verts_, vns_; // Vertex positions and normals
 	std::vector<Eigen::Vector2f> vts_; // Texture coordinates
-	std::vector<std::vector<VertexIndices>> faces_;  // Face indices of the vertices
+	std::vector<TriangleIndices> faces_; // Vertex indices of each triangle
+	bool hasNormals_;
 public:
 	Model(const char *filename);
+	Model(std::vector<Eigen::Vector3f> verts, std::vector<Eigen::Vector3f> normals,
+		std::vector<Eigen::Vector2f> texCoords, std::vector<TriangleIndices> faces, bool hasNormals);
 	~Model();
-	int nverts() const;
-	int nfaces() const;
-	Eigen::Vector3f vert(int i) const;
-	Eigen::Vector2f texCoord(int i) const;
-	Eigen::Vector3f normal(int i) const;
-	std::vector<VertexIndices> face(int idx) const;
-	bool hasNormals() const;
-};
 
+	int nverts() const
+	{
+		return static_cast<int>(verts_.size());
+	}
+
+	int nfaces() const
+	{
+		return static_cast<int>(faces_.size());
+	}
+
+	const Eigen::Vector3f& vert(int i) const
+	{
+		return verts_[i];
+	}
+
+	const Eigen::Vector2f& texCoord(int i) const
+	{
+		return vts_[i];
+	}
+
+	const Eigen::Vector3f& normal(int i) const
+	{
+		return vns_[i];
+	}
+
+	const TriangleIndices& face(int idx) const
+	{
+		return faces_[idx];
+	}
+
+	bool hasNormals() const
+	{
+		return hasNormals_;
+	}
+};
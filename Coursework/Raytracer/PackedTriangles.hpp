@@ -0,0 +1,282 @@
+#pragma once
+#include "GeomUtil.hpp"
+#include "AABB.hpp"
+#include "SIMD.hpp"
+#include <vector>
+#include <limits>
+
+/// <summary>
+/// PackedTriangles stores triangles ready for intersection tests: the first vertex and
+/// the two edges from it, already transformed into the space rays are traced in.
+/// The data is stored as structure of arrays (all the v0 x values together etc.), so
+/// intersecting a ray doesn't need any matrix products, and consecutive triangles can
+/// be loaded into vector registers.
+/// Ranges of triangles (e.g. the leaves of a BVH) are intersected in blocks of 4 or 8
+/// (depending on the vector width available), testing a whole block with one pass of
+/// the Moller-Trumbore test and picking the closest hit with a horizontal min.
+/// Whoever owns the triangles should refill them whenever its transform changes.
+/// </summary>
+class PackedTriangles
+{
+private:
+	// The arrays always hold a block's worth of zeros past the last triangle, so a block
+	// starting at any triangle can be loaded without reading past the end. The zero
+	// triangles are degenerate, so they never pass the determinant test.
+	static const int padding = 8;
+
+	std::vector<float> v0_[3], edge1_[3], edge2_[3];
+	int count_ = 0;
+	AABB bounds_ = AABB::empty(); // Bounds of the vertices exactly as they were added.
+
+public:
+	int size() const
+	{
+		return count_;
+	}
+
+	void clear()
+	{
+		for (int a = 0; a < 3; ++a) {
+			v0_[a].clear();
+			edge1_[a].clear();
+			edge2_[a].clear();
+		}
+		count_ = 0;
+		bounds_ = AABB::empty();
+	}
+
+	void reserve(int n)
+	{
+		for (int a = 0; a < 3; ++a) {
+			v0_[a].reserve(n + padding);
+			edge1_[a].reserve(n + padding);
+			edge2_[a].reserve(n + padding);
+		}
+	}
+
+	/// <summary>
+	/// Adds a triangle, transforming its vertices by the given matrix.
+	/// </summary>
+	void add(const Eigen::Matrix4f& transform, const Eigen::Vector3f& v0, const Eigen::Vector3f& v1, const Eigen::Vector3f& v2)
+	{
+		add(transformPosition(transform, v0), transformPosition(transform, v1), transformPosition(transform, v2));
+	}
+
+	void add(const Eigen::Vector3f& v0, const Eigen::Vector3f& v1, const Eigen::Vector3f& v2)
+	{
+		Eigen::Vector3f v0v1 = v1 - v0;
+		Eigen::Vector3f v0v2 = v2 - v0;
+		bounds_.extend(v0);
+		bounds_.extend(v1);
+		bounds_.extend(v2);
+		for (int a = 0; a < 3; ++a) {
+			v0_[a].resize(count_ + 1 + padding, 0.f);
+			edge1_[a].resize(count_ + 1 + padding, 0.f);
+			edge2_[a].resize(count_ + 1 + padding, 0.f);
+			v0_[a][count_] = v0[a];
+			edge1_[a][count_] = v0v1[a];
+			edge2_[a][count_] = v0v2[a];
+		}
+		++count_;
+	}
+
+	Eigen::Vector3f vertex0(int tri) const
+	{
+		return Eigen::Vector3f(v0_[0][tri], v0_[1][tri], v0_[2][tri]);
+	}
+
+	Eigen::Vector3f edge1(int tri) const
+	{
+		return Eigen::Vector3f(edge1_[0][tri], edge1_[1][tri], edge1_[2][tri]);
+	}
+
+	Eigen::Vector3f edge2(int tri) const
+	{
+		return Eigen::Vector3f(edge2_[0][tri], edge2_[1][tri], edge2_[2][tri]);
+	}
+
+	/// <summary>
+	/// Unnormalised geometric normal of a triangle (edge1 x edge2).
+	/// </summary>
+	Eigen::Vector3f faceNormal(int tri) const
+	{
+		return edge1(tri).cross(edge2(tri));
+	}
+
+	/// <summary>
+	/// Intersects a ray with a single triangle. Returns the distance t and barycentric
+	/// coordinates (u, v) of the hit, without checking t against any range.
+	/// </summary>
+	bool intersect(const Ray& ray, int tri, bool culling, float& t, float& u, float& v) const
+	{
+		return intersectTriangleEdges(ray, vertex0(tri), edge1(tri), edge2(tri), culling, t, u, v);
+	}
+
+	/// <summary>
+	/// Finds the closest hit between minT and maxT over all the triangles. On a hit, maxT
+	/// is set to the hit distance and tri, u and v identify the triangle and hit point.
+	/// </summary>
+	bool intersectClosest(const Ray& ray, bool culling, float minT, float& maxT, int& tri, float& u, float& v) const
+	{
+		tri = -1;
+		return culling ? intersectClosest<true>(ray, 0, size(), minT, maxT, tri, u, v)
+			: intersectClosest<false>(ray, 0, size(), minT, maxT, tri, u, v);
+	}
+
+	/// <summary>
+	/// Checks whether the ray hits any of the triangles between minT and maxT, stopping
+	/// at the first hit found.
+	/// </summary>
+	bool intersectAny(const Ray& ray, bool culling, float minT, float maxT) const
+	{
+		return culling ? intersectAny<true>(ray, 0, size(), minT, maxT)
+			: intersectAny<false>(ray, 0, size(), minT, maxT);
+	}
+
+	/// <summary>
+	/// Finds the closest hit between minT and maxT on the count triangles starting at first.
+	/// On a hit, maxT is set to the hit distance and tri, u and v identify the triangle and
+	/// hit point; otherwise they're left alone, so one ray can be tested against several
+	/// ranges in turn. Culling selects the back face culling test at compile time.
+	/// </summary>
+	template <bool Culling>
+	bool intersectClosest(const Ray& ray, int first, int count, float minT, float& maxT, int& tri, float& u, float& v) const
+	{
+		bool found = false;
+#ifdef RAYTRACER_SIMD_FLOAT
+		typedef SimdFloat F;
+		const RayLanes<F> lanes(ray);
+		for (int block = first; block < first + count; block += F::width) {
+			typename F::Type blockT, blockU, blockV;
+			typename F::Type valid = intersectBlock<Culling, F>(lanes, block, first + count - block, minT, maxT,
+				blockT, blockU, blockV);
+			if (F::mask(valid) == 0) continue;
+
+			// Every lane holding the closest distance in the block, lowest index first.
+			typename F::Type closest = F::hmin(F::select(valid, blockT, F::set(std::numeric_limits<float>::infinity())));
+			int closestLanes = F::mask(F::logicalAnd(valid, F::cmpeq(blockT, closest)));
+			int lane = 0;
+			while (!(closestLanes & (1 << lane))) ++lane;
+
+			float ts[F::width], us[F::width], vs[F::width];
+			F::store(ts, blockT);
+			F::store(us, blockU);
+			F::store(vs, blockV);
+			maxT = ts[lane];
+			tri = block + lane;
+			u = us[lane];
+			v = vs[lane];
+			found = true;
+		}
+#else
+		for (int i = first; i < first + count; ++i) {
+			float triT, triU, triV;
+			if (!intersect(ray, i, Culling, triT, triU, triV) || triT < minT || triT > maxT) continue;
+			maxT = triT;
+			tri = i;
+			u = triU;
+			v = triV;
+			found = true;
+		}
+#endif
+		return found;
+	}
+
+	/// <summary>
+	/// Checks whether the ray hits any of the count triangles starting at first, between
+	/// minT and maxT.
+	/// </summary>
+	template <bool Culling>
+	bool intersectAny(const Ray& ray, int first, int count, float minT, float maxT) const
+	{
+#ifdef RAYTRACER_SIMD_FLOAT
+		typedef SimdFloat F;
+		const RayLanes<F> lanes(ray);
+		for (int block = first; block < first + count; block += F::width) {
+			typename F::Type t, u, v;
+			if (F::mask(intersectBlock<Culling, F>(lanes, block, first + count - block, minT, maxT, t, u, v)) != 0)
+				return true;
+		}
+#else
+		for (int i = first; i < first + count; ++i) {
+			float t, u, v;
+			if (intersect(ray, i, Culling, t, u, v) && t >= minT && t <= maxT) return true;
+		}
+#endif
+		return false;
+	}
+
+private:
+#ifdef RAYTRACER_SIMD_FLOAT
+	/// <summary>
+	/// A ray with each component copied into every lane of a vector.
+	/// </summary>
+	template <typename F>
+	struct RayLanes
+	{
+		typename F::Type origin[3], direction[3];
+
+		explicit RayLanes(const Ray& ray)
+		{
+			for (int a = 0; a < 3; ++a) {
+				origin[a] = F::set(ray.origin[a]);
+				direction[a] = F::set(ray.direction[a]);
+			}
+		}
+	};
+
+	/// <summary>
+	/// Moller-Trumbore test of one block of F::width triangles starting at first, of which
+	/// only the first remaining are used. Returns a mask of the lanes that hit between
+	/// minT and maxT, with the distances and barycentric coordinates in t, u and v.
+	/// The steps match intersectTriangleEdges, but every test is a mask rather than a branch.
+	/// </summary>
+	template <bool Culling, typename F>
+	typename F::Type intersectBlock(const RayLanes<F>& ray, int first, int remaining, float minT, float maxT,
+		typename F::Type& t, typename F::Type& u, typename F::Type& v) const
+	{
+		typedef typename F::Type V;
+		V e1[3], e2[3], tvec[3];
+		for (int a = 0; a < 3; ++a) {
+			e1[a] = F::load(&edge1_[a][first]);
+			e2[a] = F::load(&edge2_[a][first]);
+			tvec[a] = F::sub(ray.origin[a], F::load(&v0_[a][first]));
+		}
+
+		// pvec = direction x edge2
+		V px = F::sub(F::mul(ray.direction[1], e2[2]), F::mul(ray.direction[2], e2[1]));
+		V py = F::sub(F::mul(ray.direction[2], e2[0]), F::mul(ray.direction[0], e2[2]));
+		V pz = F::sub(F::mul(ray.direction[0], e2[1]), F::mul(ray.direction[1], e2[0]));
+		V det = F::add(F::add(F::mul(e1[0], px), F::mul(e1[1], py)), F::mul(e1[2], pz));
+		V valid = F::cmpge(Culling ? det : F::abs(det), F::set(1e-6f));
+		V invDet = F::div(F::set(1.f), det);
+
+		u = F::mul(F::add(F::add(F::mul(tvec[0], px), F::mul(tvec[1], py)), F::mul(tvec[2], pz)), invDet);
+		valid = F::logicalAnd(valid, F::logicalAnd(F::cmpge(u, F::set(0.f)), F::cmple(u, F::set(1.f))));
+
+		// qvec = tvec x edge1
+		V qx = F::sub(F::mul(tvec[1], e1[2]), F::mul(tvec[2], e1[1]));
+		V qy = F::sub(F::mul(tvec[2], e1[0]), F::mul(tvec[0], e1[2]));
+		V qz = F::sub(F::mul(tvec[0], e1[1]), F::mul(tvec[1], e1[0]));
+		v = F::mul(F::add(F::add(F::mul(ray.direction[0], qx), F::mul(ray.direction[1], qy)),
+			F::mul(ray.direction[2], qz)), invDet);
+		valid = F::logicalAnd(valid, F::logicalAnd(F::cmpge(v, F::set(0.f)), F::cmple(F::add(u, v), F::set(1.f))));
+
+		t = F::mul(F::add(F::add(F::mul(e2[0], qx), F::mul(e2[1], qy)), F::mul(e2[2], qz)), invDet);
+		valid = F::logicalAnd(valid, F::logicalAnd(F::cmpge(t, F::set(minT)), F::cmple(t, F::set(maxT))));
+
+		if (remaining < F::width) {
+			// Lanes past the end of the range hold the next triangles along, so mask them off.
+			static const float laneNumbers[8] = { 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f, 8.f };
+			valid = F::logicalAnd(valid, F::cmple(F::load(laneNumbers), F::set(static_cast<float>(remaining))));
+		}
+		return valid;
+	}
+#endif
+
+public:
+	const AABB& bounds() const
+	{
+		return bounds_;
+	}
+};
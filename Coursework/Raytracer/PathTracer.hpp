@@ -0,0 +1,155 @@
+#pragma once
+#include "Renderable.hpp"
+#include "Shader.hpp"
+#include "Light.hpp"
+#include "Sampler.hpp"
+#include "BitMasks.hpp"
+#include "GeomUtil.hpp"
+#include <Eigen/Dense>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+/// <summary>
+/// Settings for the PathTracer.
+/// </summary>
+struct PathTracerSettings
+{
+	int maxBounces = 16; // Paths end after this many bounces, whatever their throughput.
+	int rouletteStartBounce = 3; // Russian roulette starts after this many bounces.
+};
+
+/// <summary>
+/// The PathTracer follows each camera ray through a random path of bounces, sampling the
+/// shaders' BSDFs (see Shader::sampleBSDF) to pick each new direction, so it renders
+/// indirect light that the recursive getColor shaders can't.
+/// At every bounce the lights are sampled directly as well (next event estimation): point
+/// and directional lights through visibilityCheck, getVecToLight and getIntensity, and
+/// lights covering an area of directions (e.g. the EnvironmentLight) by sampling a
+/// direction towards them. Those can also be reached by the BSDF sampled rays, so the two
+/// estimates are combined with multiple importance sampling (the power heuristic). Point
+/// and directional lights can only be reached by sampling them, so they need no weights.
+/// Once a path has made a few bounces it is ended at random with Russian roulette, with a
+/// probability based on its throughput, and the paths that survive are weighted up to
+/// make up for the ones that didn't. Dim paths end early without biasing the image.
+/// Camera rays that miss the scene are black, as they are for the other integrators.
+/// </summary>
+class PathTracer
+{
+private:
+	const Renderable* scene_;
+	const std::vector<std::unique_ptr<Light>>& lights_;
+	Eigen::Vector3f ambientLight_;
+	PathTracerSettings settings_;
+
+public:
+	PathTracer(const Renderable* scene, const std::vector<std::unique_ptr<Light>>& lights,
+		const Eigen::Vector3f& ambientLight, const PathTracerSettings& settings)
+		:scene_(scene), lights_(lights), ambientLight_(ambientLight), settings_(settings)
+	{}
+
+	/// <summary>
+	/// Traces a path starting along ray, using random numbers from sampler, and returns an
+	/// estimate of the radiance arriving back along it.
+	/// </summary>
+	Eigen::Vector3f radiance(Ray ray, Sampler& sampler) const
+	{
+		Eigen::Vector3f color = Eigen::Vector3f::Zero();
+		Eigen::Vector3f throughput = Eigen::Vector3f::Ones();
+		float bsdfPdf = 0.f;
+		bool specular = false;
+
+		for (int bounce = 0; ; ++bounce) {
+			HitInfo hitInfo;
+			if (!scene_->intersect(ray, 1e-6f, 1e6f, hitInfo, VISIBLE_BITMASK)) {
+				if (bounce > 0) color += throughput.cwiseProduct(escapedRadiance(ray, bsdfPdf, specular));
+				break;
+			}
+
+			const Shader* shader = hitInfo.shader;
+			if (!shader->hasBSDF()) {
+				color += throughput.cwiseProduct(shader->getDirectColor(hitInfo, scene_, lights_, ambientLight_));
+				break;
+			}
+
+			// Shade the side of the surface the ray arrived on.
+			if (hitInfo.normal.dot(ray.direction) > 0.f) hitInfo.normal = -hitInfo.normal;
+			const Eigen::Vector3f origin = hitInfo.location + 1e-4f * hitInfo.normal;
+
+			color += throughput.cwiseProduct(sampleLights(hitInfo, origin, sampler));
+
+			if (bounce + 1 >= settings_.maxBounces) break;
+
+			BSDFSample sample;
+			if (!shader->sampleBSDF(hitInfo, sampler, sample)) break;
+			throughput = throughput.cwiseProduct(sample.weight);
+			bsdfPdf = sample.pdf;
+			specular = sample.specular;
+
+			if (bounce + 1 >= settings_.rouletteStartBounce) {
+				float survive = std::min(throughput.maxCoeff(), .95f);
+				if (sampler.next1D() >= survive) break;
+				throughput /= survive;
+			}
+
+			ray = Ray(origin, sample.direction);
+		}
+		return color;
+	}
+
+private:
+	/// <summary>
+	/// The power heuristic for combining a sample from a strategy with pdf a with one
+	/// from a strategy with pdf b.
+	/// </summary>
+	static float powerHeuristic(float a, float b)
+	{
+		return a * a / (a * a + b * b);
+	}
+
+	/// <summary>
+	/// Next event estimation: the light reflected back along the ray from every light,
+	/// with one sampled direction for each light that isn't a point or direction.
+	/// </summary>
+	Eigen::Vector3f sampleLights(const HitInfo& hitInfo, const Eigen::Vector3f& origin, Sampler& sampler) const
+	{
+		Eigen::Vector3f color = Eigen::Vector3f::Zero();
+		for (const auto& light : lights_) {
+			float pdf;
+			if (light->isDelta()) {
+				// Look at the BSDF first, so no shadow ray is traced for lights behind the surface.
+				Eigen::Vector3f f = hitInfo.shader->evalBSDF(hitInfo, light->getVecToLight(origin), pdf);
+				if (f.maxCoeff() <= 0.f || !light->visibilityCheck(origin, scene_)) continue;
+				// The getColor shaders light a white diffuse surface facing a light with its
+				// full intensity, where the BSDF divides by pi, so scale by pi to match them.
+				color += static_cast<float>(M_PI) * f.cwiseProduct(light->getIntensity(origin));
+			}
+			else {
+				Eigen::Vector3f direction;
+				float lightPdf, distance;
+				Eigen::Vector3f radiance = light->sampleDirection(origin, sampler.next2D(), direction, lightPdf, distance);
+				if (lightPdf <= 0.f) continue;
+				Eigen::Vector3f f = hitInfo.shader->evalBSDF(hitInfo, direction, pdf);
+				if (f.maxCoeff() <= 0.f || scene_->occluded(Ray(origin, direction), 1e-4f, distance, SHADOW_BITMASK)) continue;
+				color += f.cwiseProduct(radiance) * (powerHeuristic(lightPdf, pdf) / lightPdf);
+			}
+		}
+		return color;
+	}
+
+	/// <summary>
+	/// The light picked up by a BSDF sampled ray that leaves the scene, weighted against
+	/// next event estimation having sampled the same direction. Rays from specular lobes
+	/// couldn't have been sampled by the lights, so get all of it.
+	/// </summary>
+	Eigen::Vector3f escapedRadiance(const Ray& ray, float bsdfPdf, bool specular) const
+	{
+		Eigen::Vector3f color = Eigen::Vector3f::Zero();
+		for (const auto& light : lights_) {
+			if (light->isDelta()) continue;
+			float weight = specular ? 1.f : powerHeuristic(bsdfPdf, light->directionPdf(ray.origin, ray.direction));
+			color += weight * light->escapedRadiance(ray.direction);
+		}
+		return color;
+	}
+};
@@ -1,5 +1,6 @@
 #pragma once
 #include "Shader.hpp"
+#include "GeomUtil.hpp"
 
 /// <summary>
 /// Shader using the classic Phong reflectance model to add specular highlights.
@@ -41,5 +42,66 @@ public:
 
 		return color;
 	}
-};
 
+	virtual Eigen::Vector3f getAlbedo(const HitInfo& hitInfo) const override
+	{
+		return albedo_;
+	}
+
+	/// <summary>
+	/// For path tracing, the normalised (energy conserving) version of the Phong model is
+	/// used: a diffuse lobe albedo / pi, plus a specular lobe specular * (n + 2) / (2 pi)
+	/// * cos^n of the angle to the mirror direction, for shininess n.
+	/// </summary>
+	virtual bool hasBSDF() const override
+	{
+		return true;
+	}
+
+	virtual Eigen::Vector3f evalBSDF(const HitInfo& hitInfo, const Eigen::Vector3f& direction, float& pdf) const override
+	{
+		float cosTheta = direction.dot(hitInfo.normal);
+		if (cosTheta <= 0.f) {
+			pdf = 0.f;
+			return Eigen::Vector3f::Zero();
+		}
+		Eigen::Vector3f reflectVec = reflect(hitInfo.inDirection, hitInfo.normal);
+		float cosAlpha = std::max(direction.dot(reflectVec), 0.f);
+		float specularPdf = powerCosinePdf(cosAlpha, shininess_);
+		const float pSpecular = specularProbability();
+		pdf = (1.f - pSpecular) * powerCosinePdf(cosTheta, 1.f) + pSpecular * specularPdf;
+
+		// The specular lobe's pdf is its cos^n term times (n + 1) / (2 pi), so its BSDF is
+		// the pdf scaled by (n + 2) / (n + 1).
+		return cosTheta * (albedo_ / static_cast<float>(M_PI) +
+			specular_ * (specularPdf * (shininess_ + 2.f) / (shininess_ + 1.f)));
+	}
+
+	virtual bool sampleBSDF(const HitInfo& hitInfo, Sampler& sampler, BSDFSample& sample) const override
+	{
+		// Pick a lobe in proportion to how much light it reflects, then a direction in it.
+		float choice = sampler.next1D();
+		Eigen::Vector2f u = sampler.next2D();
+		if (choice < specularProbability())
+			sample.direction = samplePowerCosine(reflect(hitInfo.inDirection, hitInfo.normal), shininess_, u);
+		else
+			sample.direction = samplePowerCosine(hitInfo.normal, 1.f, u);
+
+		// The weight uses the pdf of both lobes together, as either could have picked the direction.
+		Eigen::Vector3f f = evalBSDF(hitInfo, sample.direction, sample.pdf);
+		if (sample.pdf <= 0.f) return false;
+		sample.weight = f / sample.pdf;
+		sample.specular = false;
+		return true;
+	}
+
+private:
+	/// <summary>
+	/// The probability of sampling the specular lobe rather than the diffuse one.
+	/// </summary>
+	float specularProbability() const
+	{
+		float diffuse = albedo_.sum(), specular = specular_.sum();
+		return diffuse + specular > 0.f ? specular / (diffuse + specular) : 0.f;
+	}
+};
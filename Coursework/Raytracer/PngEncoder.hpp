@@ -0,0 +1,474 @@
+#pragma once
+#include <lodepng.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+/// <summary>
+/// Settings for the PngEncoder.
+/// </summary>
+struct PngSettings
+{
+	int level = 6; // Compression level, from 0 (no compression, fastest) to 9 (smallest, slowest).
+	int bandRows = 64; // Rows of the image compressed together as one band.
+};
+
+/// <summary>
+/// The PngEncoder saves 8 bit RGBA images (like lodepng::encode) using every thread.
+/// The image is split into bands of rows, and each band is filtered and compressed on its
+/// own with lodepng's deflate, so the bands can be done in parallel. The compressed bands
+/// are then joined into the one zlib stream PNG needs. A deflate stream ends with a block
+/// marked final, and can end part way through a byte, so before a band is joined to the
+/// next one its last block is unmarked and an empty uncompressed block is added after it,
+/// which brings the stream back to a whole byte (like zlib's Z_SYNC_FLUSH). The Adler-32
+/// checksums of the bands are combined into one for the whole image.
+/// Matches can't reach back into the band before, which makes the file a little larger
+/// than compressing the image in one go. The bands don't depend on the number of threads,
+/// so neither does the file.
+/// Opaque images are saved as RGB, and others as RGBA.
+/// </summary>
+class PngEncoder
+{
+private:
+	int level_, bandRows_;
+	LodePNGCompressSettings deflateSettings_;
+
+	/// <summary>
+	/// One band of rows, compressed.
+	/// </summary>
+	struct Band
+	{
+		std::vector<unsigned char> deflated;
+		size_t filteredSize = 0; // Bytes before compression.
+		uint32_t adler = 1;
+		unsigned error = 0;
+	};
+
+	/// <summary>
+	/// Reads a deflate stream a bit at a time, least significant bit first. Reading past
+	/// the end gives zeros.
+	/// </summary>
+	struct BitReader
+	{
+		const unsigned char* data;
+		size_t size, bit;
+
+		unsigned read(int bits)
+		{
+			unsigned value = 0;
+			for (int i = 0; i < bits; ++i, ++bit) {
+				if ((bit >> 3) < size) value |= ((data[bit >> 3] >> (bit & 7)) & 1u) << i;
+			}
+			return value;
+		}
+	};
+
+	/// <summary>
+	/// A canonical Huffman code from a deflate block, decoded a bit at a time (as in
+	/// Mark Adler's puff), which needs no tables beyond the count of codes of each length.
+	/// </summary>
+	struct HuffmanCode
+	{
+		short count[16];
+		short symbol[288];
+
+		void build(const unsigned char* lengths, int n)
+		{
+			std::fill(count, count + 16, static_cast<short>(0));
+			for (int i = 0; i < n; ++i) ++count[lengths[i]];
+			count[0] = 0;
+			short offset[16] = { 0 };
+			for (int length = 1; length < 15; ++length) offset[length + 1] = offset[length] + count[length];
+			for (int i = 0; i < n; ++i) {
+				if (lengths[i]) symbol[offset[lengths[i]]++] = static_cast<short>(i);
+			}
+		}
+
+		/// <summary>
+		/// The next symbol, or -1 if the bits aren't a code.
+		/// </summary>
+		int decode(BitReader& reader) const
+		{
+			int code = 0, first = 0, index = 0;
+			for (int length = 1; length < 16; ++length) {
+				code |= static_cast<int>(reader.read(1));
+				if (code - count[length] < first) return symbol[index + code - first];
+				index += count[length];
+				first = (first + count[length]) << 1;
+				code <<= 1;
+			}
+			return -1;
+		}
+	};
+
+public:
+	PngEncoder(const PngSettings& settings)
+		:level_(settings.level), bandRows_(settings.bandRows)
+	{
+		if (level_ < 0 || level_ > 9) throw std::runtime_error("PNG compression level must be from 0 to 9.");
+		if (bandRows_ < 1) throw std::runtime_error("PNG band rows must be at least 1.");
+
+		// Levels trade compression for speed through the LZ77 search: the window it looks
+		// back through, how long a match it settles for and whether it tries one more match
+		// before taking one. Level 6 is lodepng's default.
+		static const unsigned windowSizes[10] = { 0, 256, 512, 1024, 1024, 2048, 2048, 8192, 16384, 32768 };
+		static const unsigned niceMatches[10] = { 0, 8, 16, 32, 64, 64, 128, 128, 258, 258 };
+		lodepng_compress_settings_init(&deflateSettings_);
+		if (level_ == 0) {
+			deflateSettings_.btype = 0;
+		}
+		else {
+			deflateSettings_.windowsize = windowSizes[level_];
+			deflateSettings_.nicematch = niceMatches[level_];
+			deflateSettings_.lazymatching = level_ >= 4;
+		}
+	}
+
+	/// <summary>
+	/// Encodes image (width x height RGBA pixels, top row first) as a PNG file in png.
+	/// Returns a lodepng error code, or 0 if it went ok.
+	/// </summary>
+	unsigned encode(std::vector<unsigned char>& png, const std::vector<unsigned char>& image, int width, int height) const
+	{
+		bool opaque = true;
+		for (size_t i = 3; i < image.size() && opaque; i += 4) opaque = image[i] == 255;
+		const int channels = opaque ? 3 : 4;
+
+		const int bandCount = (height + bandRows_ - 1) / bandRows_;
+		std::vector<Band> bands(bandCount);
+		#pragma omp parallel for schedule(dynamic)
+		for (int b = 0; b < bandCount; ++b) {
+			compressBand(bands[b], image, width, b * bandRows_, std::min((b + 1) * bandRows_, height), channels, b == bandCount - 1);
+		}
+
+		// The zlib stream: a header for deflate with a 32K window, the bands, then the checksum.
+		std::vector<unsigned char> zlib = { 0x78, 0x01 };
+		uint32_t adler = 1;
+		for (const Band& band : bands) {
+			if (band.error) return band.error;
+			zlib.insert(zlib.end(), band.deflated.begin(), band.deflated.end());
+			adler = combineAdler32(adler, band.adler, band.filteredSize);
+		}
+		appendUint32(zlib, adler);
+
+		static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		png.assign(signature, signature + 8);
+		std::vector<unsigned char> header;
+		appendUint32(header, width);
+		appendUint32(header, height);
+		// 8 bits per channel, RGB or RGBA, then the only compression and filter methods, and no interlacing.
+		const unsigned char format[5] = { 8, static_cast<unsigned char>(opaque ? 2 : 6), 0, 0, 0 };
+		header.insert(header.end(), format, format + 5);
+		appendChunk(png, "IHDR", header);
+		appendChunk(png, "IDAT", zlib);
+		appendChunk(png, "IEND", std::vector<unsigned char>());
+		return 0;
+	}
+
+	/// <summary>
+	/// Encodes image as for encode and saves it as filename.
+	/// Returns a lodepng error code, or 0 if it went ok.
+	/// </summary>
+	unsigned save(const std::string& filename, const std::vector<unsigned char>& image, int width, int height) const
+	{
+		std::vector<unsigned char> png;
+		unsigned error = encode(png, image, width, height);
+		return error ? error : lodepng::save_file(png, filename);
+	}
+
+private:
+	/// <summary>
+	/// Filters and compresses rows [y0, y1) of image into band. Unless it's the last band,
+	/// the deflate stream is left open and ends on a whole byte, ready for the next band.
+	/// </summary>
+	void compressBand(Band& band, const std::vector<unsigned char>& image, int width, int y0, int y1, int channels, bool last) const
+	{
+		// Each row is a filter type byte then the filtered pixels. Filters predict bytes
+		// from the row above, so the band starts from the last row of the band before.
+		const size_t rowSize = static_cast<size_t>(width) * channels;
+		std::vector<unsigned char> filtered((rowSize + 1) * (y1 - y0));
+		// The rows have a pixel of zeros before them for filterRow, and the top row has a row of zeros above it.
+		std::vector<unsigned char> row(rowSize + 4, 0), previous(rowSize + 4, 0), candidate(rowSize);
+		if (y0 > 0) copyRow(&previous[4], image, width, y0 - 1, channels);
+		for (int y = y0; y < y1; ++y) {
+			copyRow(&row[4], image, width, y, channels);
+			unsigned char* out = &filtered[(rowSize + 1) * (y - y0)];
+			filterRow(out, &row[4], &previous[4], rowSize, channels, candidate.data());
+			row.swap(previous);
+		}
+
+		band.filteredSize = filtered.size();
+		band.adler = adler32(filtered.data(), filtered.size());
+
+		unsigned char* deflated = nullptr;
+		size_t deflatedSize = 0;
+		band.error = lodepng_deflate(&deflated, &deflatedSize, filtered.data(), filtered.size(), &deflateSettings_);
+		if (!band.error) band.deflated.assign(deflated, deflated + deflatedSize);
+		// lodepng allocates with malloc.
+		std::free(deflated);
+		if (band.error) return;
+
+		size_t lastBlock, end;
+		if (!findLastBlock(band.deflated.data(), band.deflated.size(), lastBlock, end)) {
+			// lodepng's "custom zlib or inflate decompression failed", as its stream couldn't be read back.
+			band.error = 111;
+			return;
+		}
+		if (last) {
+			band.deflated.resize((end + 7) / 8);
+			return;
+		}
+		band.deflated[lastBlock >> 3] &= ~(1u << (lastBlock & 7));
+		// The empty uncompressed block: 3 zero header bits (not final, uncompressed), zeros
+		// to the next byte, then a length of 0 and its complement.
+		band.deflated.resize((end + 3 + 7) / 8);
+		if (end & 7) band.deflated[end >> 3] &= (1u << (end & 7)) - 1;
+		for (size_t i = (end >> 3) + 1; i < band.deflated.size(); ++i) band.deflated[i] = 0;
+		const unsigned char emptyBlock[4] = { 0x00, 0x00, 0xFF, 0xFF };
+		band.deflated.insert(band.deflated.end(), emptyBlock, emptyBlock + 4);
+	}
+
+	/// <summary>
+	/// Copies row y of an RGBA image with the given number of channels.
+	/// </summary>
+	static void copyRow(unsigned char* out, const std::vector<unsigned char>& image, int width, int y, int channels)
+	{
+		const unsigned char* in = &image[static_cast<size_t>(y) * width * 4];
+		if (channels == 4) {
+			std::memcpy(out, in, static_cast<size_t>(width) * 4);
+			return;
+		}
+		for (int x = 0; x < width; ++x) {
+			out[x * 3 + 0] = in[x * 4 + 0];
+			out[x * 3 + 1] = in[x * 4 + 1];
+			out[x * 3 + 2] = in[x * 4 + 2];
+		}
+	}
+
+	/// <summary>
+	/// Writes the filter type then the filtered bytes of a row to out, choosing the filter
+	/// that gives the smallest sum of the bytes taken as signed values (as lodepng does by
+	/// default). Uncompressed images aren't filtered, and the fastest levels always use the
+	/// Paeth filter.
+	/// row and previous (the row above, or zeros for the top row) must have bpp bytes of
+	/// zeros before them, which stand in for the pixel left of the first one.
+	/// </summary>
+	void filterRow(unsigned char* out, const unsigned char* row, const unsigned char* previous, size_t size, int bpp, unsigned char* candidate) const
+	{
+		out[0] = 0;
+		std::memcpy(out + 1, row, size);
+		if (level_ == 0) return;
+
+		if (level_ <= 2) {
+			out[0] = 4;
+			filter(out + 1, row, previous, size, bpp, paeth);
+			return;
+		}
+
+		size_t bestSum = filterSum(out + 1, size);
+		for (unsigned char type = 1; type < 5; ++type) {
+			size_t sum;
+			switch (type) {
+			case 1: sum = filter(candidate, row, previous, size, bpp, [](int a, int, int) { return a; }); break;
+			case 2: sum = filter(candidate, row, previous, size, bpp, [](int, int b, int) { return b; }); break;
+			case 3: sum = filter(candidate, row, previous, size, bpp, [](int a, int b, int) { return (a + b) >> 1; }); break;
+			default: sum = filter(candidate, row, previous, size, bpp, paeth); break;
+			}
+			if (sum < bestSum) {
+				bestSum = sum;
+				out[0] = type;
+				std::memcpy(out + 1, candidate, size);
+			}
+		}
+	}
+
+	/// <summary>
+	/// Filters a row by subtracting predict(left, up, up left) from each byte, and returns
+	/// filterSum of the result.
+	/// </summary>
+	template <typename Predict>
+	static size_t filter(unsigned char* out, const unsigned char* row, const unsigned char* previous, size_t size, int bpp, Predict predict)
+	{
+		for (size_t i = 0; i < size; ++i) {
+			out[i] = static_cast<unsigned char>(row[i] - predict(row[i - bpp], previous[i], previous[i - bpp]));
+		}
+		return filterSum(out, size);
+	}
+
+	static size_t filterSum(const unsigned char* filtered, size_t size)
+	{
+		size_t sum = 0;
+		for (size_t i = 0; i < size; ++i) sum += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+		return sum;
+	}
+
+	static int paeth(int a, int b, int c)
+	{
+		const int p = a + b - c;
+		const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+		if (pa <= pb && pa <= pc) return a;
+		return pb <= pc ? b : c;
+	}
+
+	/// <summary>
+	/// Finds the bit where the last block of a deflate stream starts and the bit after its
+	/// end, by decoding the stream without writing out the data. Returns false if the
+	/// stream can't be read.
+	/// </summary>
+	static bool findLastBlock(const unsigned char* data, size_t size, size_t& lastBlock, size_t& end)
+	{
+		static const unsigned char lengthExtraBits[29] = {
+			0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const unsigned char distanceExtraBits[30] = {
+			0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+		BitReader reader = { data, size, 0 };
+		bool final = false;
+		while (!final) {
+			lastBlock = reader.bit;
+			final = reader.read(1) != 0;
+			const unsigned type = reader.read(2);
+			if (type == 0) {
+				reader.bit = (reader.bit + 7) / 8 * 8;
+				const unsigned length = reader.read(16);
+				reader.read(16);
+				reader.bit += static_cast<size_t>(length) * 8;
+			}
+			else if (type == 1 || type == 2) {
+				HuffmanCode lengthCode, distanceCode;
+				if (type == 1) fixedCodes(lengthCode, distanceCode);
+				else if (!readDynamicCodes(reader, lengthCode, distanceCode)) return false;
+				for (;;) {
+					int symbol = lengthCode.decode(reader);
+					if (symbol < 0 || symbol > 285) return false;
+					if (symbol < 256) continue;
+					if (symbol == 256) break;
+					reader.read(lengthExtraBits[symbol - 257]);
+					const int distance = distanceCode.decode(reader);
+					if (distance < 0 || distance >= 30) return false;
+					reader.read(distanceExtraBits[distance]);
+				}
+			}
+			else {
+				return false;
+			}
+			if (reader.bit > size * 8) return false;
+		}
+		end = reader.bit;
+		return true;
+	}
+
+	static void fixedCodes(HuffmanCode& lengthCode, HuffmanCode& distanceCode)
+	{
+		unsigned char lengths[288];
+		std::fill(lengths, lengths + 144, static_cast<unsigned char>(8));
+		std::fill(lengths + 144, lengths + 256, static_cast<unsigned char>(9));
+		std::fill(lengths + 256, lengths + 280, static_cast<unsigned char>(7));
+		std::fill(lengths + 280, lengths + 288, static_cast<unsigned char>(8));
+		lengthCode.build(lengths, 288);
+		std::fill(lengths, lengths + 30, static_cast<unsigned char>(5));
+		distanceCode.build(lengths, 30);
+	}
+
+	/// <summary>
+	/// Reads the Huffman codes at the start of a dynamic block.
+	/// </summary>
+	static bool readDynamicCodes(BitReader& reader, HuffmanCode& lengthCode, HuffmanCode& distanceCode)
+	{
+		static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+		const int lengthCount = reader.read(5) + 257, distanceCount = reader.read(5) + 1, codeLengthCount = reader.read(4) + 4;
+		if (lengthCount > 286 || distanceCount > 30) return false;
+
+		unsigned char lengths[286 + 30] = { 0 };
+		for (int i = 0; i < codeLengthCount; ++i) lengths[order[i]] = static_cast<unsigned char>(reader.read(3));
+		HuffmanCode codeLengthCode;
+		codeLengthCode.build(lengths, 19);
+
+		// The code lengths, with runs of them packed by symbols 16 to 18.
+		std::fill(lengths, lengths + 19, static_cast<unsigned char>(0));
+		for (int i = 0; i < lengthCount + distanceCount; ) {
+			const int symbol = codeLengthCode.decode(reader);
+			if (symbol < 0) return false;
+			if (symbol < 16) {
+				lengths[i++] = static_cast<unsigned char>(symbol);
+				continue;
+			}
+			unsigned char value = 0;
+			int repeat;
+			if (symbol == 16) {
+				if (i == 0) return false;
+				value = lengths[i - 1];
+				repeat = 3 + reader.read(2);
+			}
+			else if (symbol == 17) {
+				repeat = 3 + reader.read(3);
+			}
+			else {
+				repeat = 11 + reader.read(7);
+			}
+			if (i + repeat > lengthCount + distanceCount) return false;
+			std::fill(lengths + i, lengths + i + repeat, value);
+			i += repeat;
+		}
+		lengthCode.build(lengths, lengthCount);
+		distanceCode.build(lengths + lengthCount, distanceCount);
+		return true;
+	}
+
+	static uint32_t adler32(const unsigned char* data, size_t size)
+	{
+		uint32_t a = 1, b = 0;
+		while (size) {
+			// The most bytes that can be summed before b could overflow.
+			size_t n = std::min<size_t>(size, 5552);
+			size -= n;
+			while (n--) {
+				a += *data++;
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+		}
+		return a | (b << 16);
+	}
+
+	/// <summary>
+	/// The Adler-32 checksum of two buffers one after the other, from the checksums of each
+	/// and the size of the second (as zlib's adler32_combine).
+	/// </summary>
+	static uint32_t combineAdler32(uint32_t adler1, uint32_t adler2, size_t size2)
+	{
+		const uint32_t base = 65521;
+		const uint32_t remainder = static_cast<uint32_t>(size2 % base);
+		uint32_t sum1 = adler1 & 0xffff;
+		uint32_t sum2 = static_cast<uint32_t>((static_cast<uint64_t>(remainder) * sum1) % base);
+		sum1 += (adler2 & 0xffff) + base - 1;
+		sum2 += (adler1 >> 16) + (adler2 >> 16) + base - remainder;
+		if (sum1 >= base) sum1 -= base;
+		if (sum1 >= base) sum1 -= base;
+		if (sum2 >= 2 * base) sum2 -= 2 * base;
+		if (sum2 >= base) sum2 -= base;
+		return sum1 | (sum2 << 16);
+	}
+
+	static void appendUint32(std::vector<unsigned char>& out, uint32_t value)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<unsigned char>(value >> shift));
+	}
+
+	/// <summary>
+	/// Appends a PNG chunk: its length, type, data and a CRC of the type and data.
+	/// </summary>
+	static void appendChunk(std::vector<unsigned char>& png, const char* type, const std::vector<unsigned char>& data)
+	{
+		appendUint32(png, static_cast<uint32_t>(data.size()));
+		const size_t start = png.size();
+		png.insert(png.end(), type, type + 4);
+		png.insert(png.end(), data.begin(), data.end());
+		appendUint32(png, lodepng_crc32(&png[start], png.size() - start));
+	}
+};
@@ -13,12 +13,9 @@ public:
 
 	virtual bool visibilityCheck(const Eigen::Vector3f& location, const Renderable* renderable) const override
 	{
-		Ray shadowRay;
-		shadowRay.origin = location;
-		shadowRay.direction = (location_ - location).normalized();
+		Ray shadowRay(location, (location_ - location).normalized());
 		float maxT = (location_ - location).norm();
-		HitInfo info;
-		return !renderable->intersect(shadowRay, 1e-4f, maxT, info, SHADOW_BITMASK);
+		return !renderable->occluded(shadowRay, 1e-4f, maxT, SHADOW_BITMASK);
 	}
 
 	virtual Eigen::Vector3f getIntensity(const Eigen::Vector3f& location) const override
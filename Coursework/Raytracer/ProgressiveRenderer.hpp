@@ -0,0 +1,97 @@
+#pragma once
+#include "Camera.hpp"
+#include "Sampler.hpp"
+#include "TileScheduler.hpp"
+#include <Eigen/Dense>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+/// <summary>
+/// The ProgressiveRenderer renders an image as a series of passes, each adding one
+/// jittered sample to every pixel, and keeps the running sum of the samples in a float
+/// buffer. The image can be read back at any time, and gets less noisy (and better
+/// anti-aliased) the longer it runs.
+/// Rendering stops after a time budget or a number of samples per pixel, whichever comes
+/// first. The first pass always finishes, so every pixel has at least one sample; after
+/// that, tiles that would start after the time budget runs out are skipped, so pixels may
+/// end up with one sample more or less than their neighbours.
+/// </summary>
+class ProgressiveRenderer
+{
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	int width_, height_;
+	std::vector<Eigen::Vector3f> sum_;
+	std::vector<int> samples_;
+
+public:
+	ProgressiveRenderer(int width, int height)
+		:width_(width), height_(height), sum_(width * height, Eigen::Vector3f::Zero()), samples_(width * height, 0)
+	{}
+
+	/// <summary>
+	/// Renders passes until timeBudget seconds have passed or every pixel has maxSamples
+	/// samples (either can be 0 for no limit, but not both). radiance(ray, sampler) gives
+	/// the colour seen along a camera ray, and can take more random numbers for the sample
+	/// (e.g. for path tracing) from sampler. If previewInterval is more than 0, preview() is
+	/// called after the first pass that ends at least that many seconds after the last
+	/// preview. Returns the number of passes started.
+	/// </summary>
+	template <typename Radiance, typename Preview>
+	int render(const Camera& cam, const TileScheduler& scheduler, Radiance radiance,
+		double timeBudget, int maxSamples, double previewInterval, Preview preview)
+	{
+		if (timeBudget <= 0. && maxSamples <= 0)
+			throw std::runtime_error("A progressive render needs a time budget or a sample count.");
+
+		const Clock::time_point startTime = Clock::now();
+		const Clock::time_point deadline = startTime +
+			std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeBudget));
+		Clock::time_point lastPreview = startTime;
+
+		int pass = 0;
+		for (; maxSamples <= 0 || pass < maxSamples; ++pass) {
+			if (pass > 0 && timeBudget > 0. && Clock::now() >= deadline) break;
+
+			scheduler.run([&](const Tile& tile) {
+				if (pass > 0 && timeBudget > 0. && Clock::now() >= deadline) return;
+				for (int y = tile.y0; y < tile.y1; ++y) {
+					for (int x = tile.x0; x < tile.x1; ++x) {
+						const int pixel = x + y * width_;
+						Sampler sampler(pixel, pass);
+						const Ray ray = cam.getRay(x, y, sampler.next2D());
+						sum_[pixel] += radiance(ray, sampler);
+						++samples_[pixel];
+					}
+				}
+			}, false);
+
+			const Clock::time_point now = Clock::now();
+			std::clog << "\rPasses: " << pass + 1 << ", "
+				<< std::chrono::duration<double>(now - startTime).count() << " seconds " << std::flush;
+			if (previewInterval > 0. && std::chrono::duration<double>(now - lastPreview).count() >= previewInterval) {
+				preview();
+				lastPreview = now;
+			}
+		}
+		std::clog << std::endl;
+		return pass;
+	}
+
+	/// <summary>
+	/// The average of the samples for a pixel so far.
+	/// </summary>
+	Eigen::Vector3f color(int x, int y) const
+	{
+		const int pixel = x + y * width_;
+		return samples_[pixel] > 0 ? Eigen::Vector3f(sum_[pixel] / static_cast<float>(samples_[pixel])) : Eigen::Vector3f::Zero();
+	}
+
+	int samples(int x, int y) const
+	{
+		return samples_[x + y * width_];
+	}
+};
@@ -3,10 +3,21 @@
 
 /// <summary>
 /// Struct encoding a Ray, with an origin and a direction.
+/// The reciprocal of the direction is kept alongside it for the slab tests against
+/// bounding boxes, so use the constructor (rather than setting direction directly)
+/// to keep the two in step.
 /// </summary>
 struct Ray
 {
 	Eigen::Vector3f origin, direction;
+	Eigen::Vector3f invDirection; // 1 / direction, per component.
+
+	Ray()
+	{}
+
+	Ray(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction)
+		:origin(origin), direction(direction), invDirection(direction.cwiseInverse())
+	{}
 };
 
 std::ostream& operator <<(std::ostream& str, const Ray& ray)
@@ -0,0 +1,64 @@
+#pragma once
+#include "Ray.hpp"
+
+/// <summary>
+/// A RayPacket is a small group of rays (up to maxSize) traced together, e.g. the camera
+/// rays for a 4x4 tile of neighbouring pixels. The rays are stored as structure of arrays
+/// so each step of a traversal can be done for every ray in the packet with one loop,
+/// which the compiler can turn into SIMD instructions.
+/// Lanes which aren't in use (e.g. pixels past the edge of the image) are inactive.
+/// </summary>
+struct RayPacket
+{
+	static const int maxSize = 16;
+
+	int size = 0; // Number of lanes in use; lanes from size up to maxSize are ignored.
+	float origin[3][maxSize] = {}, direction[3][maxSize] = {}, invDirection[3][maxSize] = {};
+	bool active[maxSize] = {};
+
+	void setRay(int lane, const Ray& ray)
+	{
+		for (int a = 0; a < 3; ++a) {
+			origin[a][lane] = ray.origin[a];
+			direction[a][lane] = ray.direction[a];
+			invDirection[a][lane] = ray.invDirection[a];
+		}
+		active[lane] = true;
+	}
+
+	Ray ray(int lane) const
+	{
+		return Ray(Eigen::Vector3f(origin[0][lane], origin[1][lane], origin[2][lane]),
+			Eigen::Vector3f(direction[0][lane], direction[1][lane], direction[2][lane]));
+	}
+
+	/// <summary>
+	/// Index of the first active lane, or -1 if none are active.
+	/// </summary>
+	int firstActive() const
+	{
+		for (int lane = 0; lane < size; ++lane) {
+			if (active[lane]) return lane;
+		}
+		return -1;
+	}
+
+	/// <summary>
+	/// A packet is coherent if all its active rays point into the same octant, so they
+	/// agree on a front to back order through a BVH. Packets that aren't coherent tend to
+	/// visit many more nodes than their rays would on their own, so are better traced one
+	/// ray at a time.
+	/// </summary>
+	bool coherent() const
+	{
+		int first = firstActive();
+		if (first < 0) return true;
+		for (int lane = first + 1; lane < size; ++lane) {
+			if (!active[lane]) continue;
+			for (int a = 0; a < 3; ++a) {
+				if ((direction[a][lane] < 0.f) != (direction[a][first] < 0.f)) return false;
+			}
+		}
+		return true;
+	}
+};
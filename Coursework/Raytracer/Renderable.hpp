@@ -5,6 +5,7 @@
 #include "Shader.hpp"
 #include "BitMasks.hpp"
 #include "AABB.hpp"
+#include "RayPacket.hpp"
 
 class Shader;
 
@@ -33,6 +34,61 @@ public:
 	/// </summary>
 	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const = 0;
 
+	/// <summary>
+	/// Finds the closest hit between minT and maxT like intersect, but only records which
+	/// primitive was hit rather than working out its shading attributes. On a hit, maxT is
+	/// set to the hit distance, so anything traced afterwards only reports closer hits.
+	/// On a miss, hit is left alone, so one PrimitiveHit can collect the closest hit over
+	/// many renderables. Renderables that override this should also override fillHitInfo.
+	/// By default the hit is found with intersect, and found again by fillHitInfo.
+	/// </summary>
+	virtual bool intersectPrimitive(const Ray& ray, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const
+	{
+		HitInfo info;
+		if (!intersect(ray, minT, maxT, info, mask)) return false;
+		maxT = info.hitT;
+		hit.t = info.hitT;
+		hit.renderable = this;
+		hit.prim = 0;
+		hit.u = hit.v = 0.f;
+		return true;
+	}
+
+	/// <summary>
+	/// Fills out the HitInfo for a hit found by intersectPrimitive on this renderable. The
+	/// ray must be the one given to intersectPrimitive.
+	/// </summary>
+	virtual void fillHitInfo(const Ray& ray, const PrimitiveHit& hit, HitInfo& info) const
+	{
+		// Nothing was recorded, so intersect again in a narrow range around the hit.
+		intersect(ray, hit.t * (1.f - 1e-5f), hit.t * (1.f + 1e-5f), info, ALL_BITMASK);
+	}
+
+	/// <summary>
+	/// Checks whether anything blocks the ray between minT and maxT, e.g. for shadow rays.
+	/// Unlike intersect this can stop at the first hit it finds, and doesn't compute any
+	/// hit attributes. Subclasses should override this with a faster version; by default
+	/// it just calls intersect.
+	/// </summary>
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const
+	{
+		HitInfo info;
+		return intersect(ray, minT, maxT, info, mask);
+	}
+
+	/// <summary>
+	/// Intersects every active ray in a packet, filling out info[lane] and setting
+	/// hit[lane] for each lane. Acceleration structures can override this to trace the
+	/// whole packet at once; by default each ray is intersected on its own.
+	/// </summary>
+	virtual void intersectPacket(const RayPacket& packet, float minT, float maxT, HitInfo info[], bool hit[],
+		IntersectMask mask) const
+	{
+		for (int lane = 0; lane < packet.size; ++lane) {
+			hit[lane] = packet.active[lane] && intersect(packet.ray(lane), minT, maxT, info[lane], mask);
+		}
+	}
+
 	/// <summary>
 	/// This function finds an AABB that should fully enclose the renderable. AABBs should always
 	/// be in world space.
@@ -53,5 +109,18 @@ public:
 	{
 		return shader_;
 	}
+
+protected:
+	/// <summary>
+	/// Implements intersect for renderables that override intersectPrimitive: finds the
+	/// closest hit, then fills out the HitInfo just for that one.
+	/// </summary>
+	bool intersectDeferred(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const
+	{
+		PrimitiveHit hit;
+		if (!intersectPrimitive(ray, minT, maxT, hit, mask)) return false;
+		hit.renderable->fillHitInfo(ray, hit, info);
+		return true;
+	}
 };
 
@@ -0,0 +1,97 @@
+#pragma once
+
+// Detects which vector instruction sets the compiler is targeting, so the SIMD code paths
+// can fall back to plain scalar code on anything else.
+// RAYTRACER_SSE is defined when SSE2 is available (always true for x64 builds) and
+// RAYTRACER_AVX when AVX is available (e.g. when building with RAYTRACER_NATIVE_ARCH on).
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAYTRACER_SSE
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define RAYTRACER_AVX
+#include <immintrin.h>
+#endif
+
+// SimdFloat4 and SimdFloat8 wrap the handful of vector operations needed by kernels that
+// are written once and compiled for either width (see PackedTriangles). Comparisons
+// return all-ones lanes where true, as the intrinsics do, and mask() packs the top bit
+// of each lane into an int.
+
+#ifdef RAYTRACER_SSE
+struct SimdFloat4
+{
+	typedef __m128 Type;
+	static const int width = 4;
+
+	static Type load(const float* p) { return _mm_loadu_ps(p); }
+	static void store(float* p, Type a) { _mm_storeu_ps(p, a); }
+	static Type set(float x) { return _mm_set1_ps(x); }
+	static Type add(Type a, Type b) { return _mm_add_ps(a, b); }
+	static Type sub(Type a, Type b) { return _mm_sub_ps(a, b); }
+	static Type mul(Type a, Type b) { return _mm_mul_ps(a, b); }
+	static Type div(Type a, Type b) { return _mm_div_ps(a, b); }
+	static Type abs(Type a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+	static Type max(Type a, Type b) { return _mm_max_ps(a, b); }
+	static Type cmpge(Type a, Type b) { return _mm_cmpge_ps(a, b); }
+	static Type cmple(Type a, Type b) { return _mm_cmple_ps(a, b); }
+	static Type cmpeq(Type a, Type b) { return _mm_cmpeq_ps(a, b); }
+	static Type logicalAnd(Type a, Type b) { return _mm_and_ps(a, b); }
+	static Type select(Type mask, Type a, Type b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+	static int mask(Type a) { return _mm_movemask_ps(a); }
+
+	/// <summary>
+	/// The smallest lane, copied into every lane.
+	/// </summary>
+	static Type hmin(Type a)
+	{
+		a = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+	}
+};
+#endif
+
+#ifdef RAYTRACER_AVX
+struct SimdFloat8
+{
+	typedef __m256 Type;
+	static const int width = 8;
+
+	static Type load(const float* p) { return _mm256_loadu_ps(p); }
+	static void store(float* p, Type a) { _mm256_storeu_ps(p, a); }
+	static Type set(float x) { return _mm256_set1_ps(x); }
+	static Type add(Type a, Type b) { return _mm256_add_ps(a, b); }
+	static Type sub(Type a, Type b) { return _mm256_sub_ps(a, b); }
+	static Type mul(Type a, Type b) { return _mm256_mul_ps(a, b); }
+	static Type div(Type a, Type b) { return _mm256_div_ps(a, b); }
+	static Type abs(Type a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+	static Type max(Type a, Type b) { return _mm256_max_ps(a, b); }
+	static Type cmpge(Type a, Type b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	static Type cmple(Type a, Type b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	static Type cmpeq(Type a, Type b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+	static Type logicalAnd(Type a, Type b) { return _mm256_and_ps(a, b); }
+	static Type select(Type mask, Type a, Type b) { return _mm256_blendv_ps(b, a, mask); }
+	static int mask(Type a) { return _mm256_movemask_ps(a); }
+
+	/// <summary>
+	/// The smallest lane, copied into every lane.
+	/// </summary>
+	static Type hmin(Type a)
+	{
+		a = _mm256_min_ps(a, _mm256_permute2f128_ps(a, a, 1));
+		a = _mm256_min_ps(a, _mm256_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm256_min_ps(a, _mm256_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+	}
+};
+#endif
+
+// The widest vector type available, for kernels that don't mind which width they use.
+#if defined(RAYTRACER_AVX)
+typedef SimdFloat8 SimdFloat;
+#define RAYTRACER_SIMD_FLOAT
+#elif defined(RAYTRACER_SSE)
+typedef SimdFloat4 SimdFloat;
+#define RAYTRACER_SIMD_FLOAT
+#endif
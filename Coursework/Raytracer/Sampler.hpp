@@ -0,0 +1,50 @@
+#pragma once
+#include <Eigen/Dense>
+#include <cstdint>
+
+/// <summary>
+/// A small, fast random number generator (PCG32) for picking sample positions.
+/// Each pixel and sample index gets its own independent stream, so a sample's random
+/// numbers don't depend on which thread renders it or in what order, and renders are
+/// repeatable.
+/// </summary>
+class Sampler
+{
+private:
+	uint64_t state_, increment_;
+
+public:
+	Sampler(uint64_t seed, uint64_t stream)
+		:state_(0), increment_((stream << 1) | 1)
+	{
+		next();
+		state_ += seed;
+		next();
+	}
+
+	uint32_t next()
+	{
+		uint64_t old = state_;
+		state_ = old * 6364136223846793005ull + increment_;
+		uint32_t xorShifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+		uint32_t rot = static_cast<uint32_t>(old >> 59);
+		return (xorShifted >> rot) | (xorShifted << ((~rot + 1) & 31));
+	}
+
+	/// <summary>
+	/// A uniform random number in [0, 1).
+	/// </summary>
+	float next1D()
+	{
+		return static_cast<float>(next() >> 8) * (1.f / 16777216.f);
+	}
+
+	/// <summary>
+	/// A uniform random point in [0, 1) x [0, 1).
+	/// </summary>
+	Eigen::Vector2f next2D()
+	{
+		float x = next1D();
+		return Eigen::Vector2f(x, next1D());
+	}
+};
@@ -1,14 +1,21 @@
 #pragma once
 #include "Renderable.hpp"
 #include "GeomUtil.hpp"
+#include "BVHNode.hpp"
 #include <vector>
 #include <limits>
+#include <memory>
 
 /// <summary>
 /// A Scene is a container for other Renderable objects.
 /// Scenes can be nested if desired, and changing the ModelToWorld will
 /// transform the sub-scenes.
 /// Add objects to the scene by pushing them into the renderables vector.
+/// Once the renderables are in place, call buildBVH() before rendering. Scenes with more
+/// than bvhThreshold renderables then trace rays through a BVH over them, so rays don't
+/// have to be tested against every object. The BVH isn't updated by itself: after adding,
+/// removing, moving or replacing renderables, call buildBVH() again (or invalidateBVH()
+/// to go back to testing every renderable). Neither may be called while rendering.
 /// </summary>
 class Scene : public Renderable
 {
@@ -20,32 +27,82 @@ public:
 
 	std::vector<std::shared_ptr<Renderable>> renderables;
 
+	int bvhThreshold = 8; // Scenes with more renderables than this use a BVH.
+	BVHBuildOptions bvhOptions; // Parameters for building the scene BVH.
+
 	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const
 	{
 		if (!checkMask(mask)) return false;
 
 		// Transform ray from world space to scene space.
-		Ray tRay;
-		tRay.origin = transformPosition(worldToModel(), ray.origin);
-		tRay.direction = transformDirection(worldToModel(), ray.direction);
+		Ray tRay = rayToModel(ray);
+
+		// Identify closest valid hit, then work out its shading attributes.
+		PrimitiveHit hit;
+		if (!intersectChildren(tRay, minT, maxT, hit, mask)) return false;
+		hit.renderable->fillHitInfo(tRay, hit, info);
+
+		// Transform hit location and normal back into world space.
+		if (!hasIdentityTransform()) {
+			info.location = transformPosition(modelToWorld(), info.location);
+			info.normal = (normalMatrix() * info.normal).normalized();
+			info.inDirection = ray.direction;
+		}
+
+		return true;
+	}
+
+	virtual bool intersectPrimitive(const Ray& ray, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const override
+	{
+		// Hits in a transformed scene need transforming back to world space once they're
+		// filled out, which the renderables that were hit can't do.
+		if (!hasIdentityTransform()) return Renderable::intersectPrimitive(ray, minT, maxT, hit, mask);
+		return checkMask(mask) && intersectChildren(ray, minT, maxT, hit, mask);
+	}
 
-		// Identify closest valid hit.
-		float t = std::numeric_limits<float>::max();
+	virtual void intersectPacket(const RayPacket& packet, float minT, float maxT, HitInfo info[], bool hit[],
+		IntersectMask mask) const override
+	{
+		// Packets are traced in world space, so transformed scenes trace each ray separately.
+		if (!hasIdentityTransform()) {
+			Renderable::intersectPacket(packet, minT, maxT, info, hit, mask);
+			return;
+		}
+
+		for (int lane = 0; lane < packet.size; ++lane) hit[lane] = false;
+		if (!checkMask(mask)) return;
+
+		if (bvh_) {
+			bvh_->intersectPacket(packet, minT, maxT, info, hit, mask);
+			return;
+		}
+
+		// Identify closest valid hit for each ray.
+		HitInfo currInfo[RayPacket::maxSize];
+		bool currHit[RayPacket::maxSize];
 		for (const auto& object : renderables) {
-			HitInfo currInfo;
-			if (object->intersect(tRay, minT, maxT, currInfo, mask)) {
-				if (currInfo.hitT < t) {
-					info = currInfo;
-					t = currInfo.hitT;
+			object->intersectPacket(packet, minT, maxT, currInfo, currHit, mask);
+			for (int lane = 0; lane < packet.size; ++lane) {
+				if (currHit[lane] && (!hit[lane] || currInfo[lane].hitT < info[lane].hitT)) {
+					info[lane] = currInfo[lane];
+					hit[lane] = true;
 				}
 			}
 		}
+	}
 
-		// Transform hit location and normal back into world space.
-		info.location = transformPosition(modelToWorld(), info.location);
-		info.normal = transformDirection(modelToWorld(), info.normal);
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
 
-		return t < std::numeric_limits<float>::max();
+		Ray tRay = rayToModel(ray);
+
+		if (bvh_) return bvh_->occluded(tRay, minT, maxT, mask);
+
+		for (const auto& object : renderables) {
+			if (object->occluded(tRay, minT, maxT, mask)) return true;
+		}
+		return false;
 	}
 
 	AABB getAABB() const override
@@ -58,5 +115,44 @@ public:
 		return "Scene";
 	}
 
+	/// <summary>
+	/// Builds the BVH over the renderables if there are more than bvhThreshold of them, or
+	/// discards it otherwise, and does the same for any Scenes among the renderables.
+	/// </summary>
+	void buildBVH()
+	{
+		for (const auto& object : renderables) {
+			if (Scene* child = dynamic_cast<Scene*>(object.get())) child->buildBVH();
+		}
+		if (static_cast<int>(renderables.size()) > bvhThreshold) bvh_ = std::make_unique<BVHNode>(renderables, bvhOptions);
+		else bvh_.reset();
+	}
+
+	/// <summary>
+	/// Discards the scene BVH, so rays are tested against every renderable until
+	/// buildBVH() is called again.
+	/// </summary>
+	void invalidateBVH()
+	{
+		bvh_.reset();
+	}
+
+private:
+	std::unique_ptr<BVHNode> bvh_;
+
+	/// <summary>
+	/// Finds the closest hit on any of the renderables, for a ray in scene space.
+	/// </summary>
+	bool intersectChildren(const Ray& tRay, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const
+	{
+		if (bvh_) return bvh_->intersectPrimitive(tRay, minT, maxT, hit, mask);
+
+		bool hitSomething = false;
+		for (const auto& object : renderables) {
+			hitSomething |= object->intersectPrimitive(tRay, minT, maxT, hit, mask);
+		}
+		return hitSomething;
+	}
+
 };
 
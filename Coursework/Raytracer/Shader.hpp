@@ -1,8 +1,20 @@
 #pragma once
 #include "Renderable.hpp"
 #include "Light.hpp"
+#include "Sampler.hpp"
 #include <vector>
 
+/// <summary>
+/// A direction picked by sampling a shader's BSDF, for path tracing.
+/// </summary>
+struct BSDFSample
+{
+	Eigen::Vector3f direction; // Direction the path continues in, away from the surface.
+	Eigen::Vector3f weight; // BSDF times cosine over the pdf: what the path throughput is multiplied by.
+	float pdf; // Solid angle pdf of picking the direction. Not used for specular samples.
+	bool specular; // Whether it came from a perfectly specular (mirror) lobe, which lights can't be sampled against.
+};
+
 /// <summary>
 /// ADT for a Shader class that can be run on intersection with an associated
 /// Renderable instance.
@@ -19,5 +31,66 @@ public:
 		const Eigen::Vector3f& ambientLight,
 		int currBounceCount,
 		const int maxBounces) const = 0;
+
+	/// <summary>
+	/// The colour of a hit without following any further rays, i.e. getColor with no
+	/// bounces left. Used by WavefrontIntegrator, which follows scattered rays itself.
+	/// </summary>
+	Eigen::Vector3f getDirectColor(const HitInfo& hitInfo,
+		const Renderable* scene,
+		const std::vector<std::unique_ptr<Light>>& lights,
+		const Eigen::Vector3f& ambientLight) const
+	{
+		return getColor(hitInfo, scene, lights, ambientLight, 0, 0);
+	}
+
+	/// <summary>
+	/// Shaders that continue along a new ray (e.g. mirrors) return true and set the ray to
+	/// follow, and the weight its colour should be multiplied by. The colour from getColor
+	/// should be getDirectColor plus weight times the colour seen along the scattered ray.
+	/// </summary>
+	virtual bool scatter(const HitInfo& hitInfo, Ray& scattered, Eigen::Vector3f& weight) const
+	{
+		return false;
+	}
+
+	/// <summary>
+	/// The surface colour at a hit, without any lighting. Used as a guide by the Denoiser,
+	/// which filters the lighting separately from texture detail. By default white.
+	/// </summary>
+	virtual Eigen::Vector3f getAlbedo(const HitInfo& hitInfo) const
+	{
+		return Eigen::Vector3f::Ones();
+	}
+
+	/// <summary>
+	/// Whether the shader has a BSDF the PathTracer can evaluate and sample. Shaders that
+	/// don't (e.g. TexCoordTestShader) are shaded with getDirectColor and end the path.
+	/// </summary>
+	virtual bool hasBSDF() const
+	{
+		return false;
+	}
+
+	/// <summary>
+	/// The BSDF times the cosine of the angle to the normal, for light arriving along the
+	/// unit vector direction (pointing away from the surface) and leaving back along
+	/// hitInfo.inDirection. Also sets pdf to the solid angle pdf of sampleBSDF picking that
+	/// direction, for multiple importance sampling. Specular lobes aren't included.
+	/// </summary>
+	virtual Eigen::Vector3f evalBSDF(const HitInfo& hitInfo, const Eigen::Vector3f& direction, float& pdf) const
+	{
+		pdf = 0.f;
+		return Eigen::Vector3f::Zero();
+	}
+
+	/// <summary>
+	/// Picks a direction for the path to continue in, using random numbers from sampler.
+	/// Returns false if the path should end here (e.g. the direction is below the surface).
+	/// </summary>
+	virtual bool sampleBSDF(const HitInfo& hitInfo, Sampler& sampler, BSDFSample& sample) const
+	{
+		return false;
+	}
 };
 
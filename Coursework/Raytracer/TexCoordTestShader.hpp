@@ -17,5 +17,9 @@ public:
 		Eigen::Vector3f color = Eigen::Vector3f(hitInfo.texCoords.x(), hitInfo.texCoords.y(), 0.f);
 		return color;
 	}
-};
 
+	virtual Eigen::Vector3f getAlbedo(const HitInfo& hitInfo) const override
+	{
+		return Eigen::Vector3f(hitInfo.texCoords.x(), hitInfo.texCoords.y(), 0.f);
+	}
+};
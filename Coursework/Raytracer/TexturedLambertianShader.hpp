@@ -1,5 +1,6 @@
 #pragma once
 #include "Shader.hpp"
+#include "GeomUtil.hpp"
 
 /// <summary>
 /// Lambertian reflectance shader that samples albedo values from a texture.
@@ -24,19 +25,7 @@ public:
 		int currBounceCount,
 		const int maxBounces) const
 	{
-		Eigen::Vector3f albedo;
-
-		Eigen::Vector2f tex = hitInfo.texCoords;
-		int pixX = static_cast<int>(tex.x() * texWidth_);
-		int pixY = static_cast<int>((1.f - tex.y()) * texHeight_);
-		pixX = std::max(pixX, 0);
-		pixY = std::max(pixY, 0);
-		pixX = std::min(pixX, texWidth_);
-		pixY = std::min(pixY, texHeight_);
-
-		albedo.x() = static_cast<float>((*albedoTexture_)[(pixX + texWidth_ * pixY) * 4 + 0]) / 255.f;
-		albedo.y() = static_cast<float>((*albedoTexture_)[(pixX + texWidth_*pixY)*4 + 1]) / 255.f;
-		albedo.z() = static_cast<float>((*albedoTexture_)[(pixX + texWidth_*pixY)*4 + 2]) / 255.f;
+		Eigen::Vector3f albedo = getAlbedo(hitInfo);
 
 		Eigen::Vector3f color = coefftWiseMul(albedo, ambientLight);
 
@@ -52,5 +41,47 @@ public:
 
 		return color;
 	}
-};
 
+	virtual bool hasBSDF() const override
+	{
+		return true;
+	}
+
+	virtual Eigen::Vector3f evalBSDF(const HitInfo& hitInfo, const Eigen::Vector3f& direction, float& pdf) const override
+	{
+		float cosTheta = std::max(direction.dot(hitInfo.normal), 0.f);
+		pdf = powerCosinePdf(cosTheta, 1.f);
+		return getAlbedo(hitInfo) * (cosTheta / static_cast<float>(M_PI));
+	}
+
+	virtual bool sampleBSDF(const HitInfo& hitInfo, Sampler& sampler, BSDFSample& sample) const override
+	{
+		// Cosine-weighted directions cancel the cosine and 1 / pi in the BSDF, leaving the albedo.
+		sample.direction = samplePowerCosine(hitInfo.normal, 1.f, sampler.next2D());
+		sample.pdf = powerCosinePdf(sample.direction.dot(hitInfo.normal), 1.f);
+		sample.weight = getAlbedo(hitInfo);
+		sample.specular = false;
+		return sample.pdf > 0.f;
+	}
+
+	/// <summary>
+	/// Looks up the albedo for a hit in the texture.
+	/// </summary>
+	virtual Eigen::Vector3f getAlbedo(const HitInfo& hitInfo) const override
+	{
+		Eigen::Vector3f albedo;
+
+		Eigen::Vector2f tex = hitInfo.texCoords;
+		int pixX = static_cast<int>(tex.x() * texWidth_);
+		int pixY = static_cast<int>((1.f - tex.y()) * texHeight_);
+		pixX = std::max(pixX, 0);
+		pixY = std::max(pixY, 0);
+		pixX = std::min(pixX, texWidth_);
+		pixY = std::min(pixY, texHeight_);
+
+		albedo.x() = static_cast<float>((*albedoTexture_)[(pixX + texWidth_ * pixY) * 4 + 0]) / 255.f;
+		albedo.y() = static_cast<float>((*albedoTexture_)[(pixX + texWidth_*pixY)*4 + 1]) / 255.f;
+		albedo.z() = static_cast<float>((*albedoTexture_)[(pixX + texWidth_*pixY)*4 + 2]) / 255.f;
+		return albedo;
+	}
+};
@@ -0,0 +1,186 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <cstdint>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/// <summary>
+/// A rectangle of pixels [x0, x1) x [y0, y1) rendered as one unit of work.
+/// </summary>
+struct Tile
+{
+	int x0, y0, x1, y1;
+};
+
+/// <summary>
+/// The TileScheduler splits an image into square tiles and hands them out to threads.
+/// Tiles are ordered along a Hilbert curve, so consecutive tiles are neighbours in the
+/// image and touch similar parts of the scene. Each thread starts with an equal run of
+/// consecutive tiles. Threads take tiles from the front of their own run, and a thread
+/// that runs out steals the back half of another thread's run, so the work stays
+/// balanced and every thread still works through a compact region of the image.
+/// Each run is a single atomic (begin, end) pair updated with compare and swap, so
+/// taking and stealing tiles never blocks.
+/// </summary>
+class TileScheduler
+{
+private:
+	/// <summary>
+	/// One thread's run of tiles, packed as begin in the high 32 bits and end in the low
+	/// 32 bits. Padded to a cache line so threads don't contend over neighbouring runs.
+	/// </summary>
+	struct TileRun
+	{
+		std::atomic<uint64_t> range;
+		char pad[64 - sizeof(std::atomic<uint64_t>)];
+	};
+
+	std::vector<Tile> tiles_;
+
+public:
+	TileScheduler(int width, int height, int tileSize)
+	{
+		if (tileSize < 1) throw std::runtime_error("Tile size must be at least 1.");
+		const int tilesX = (width + tileSize - 1) / tileSize, tilesY = (height + tileSize - 1) / tileSize;
+
+		// The Hilbert curve covers a power of two sized square, so tiles outside the image are skipped.
+		uint32_t n = 1;
+		while (n < static_cast<uint32_t>(std::max(tilesX, tilesY))) n *= 2;
+
+		std::vector<std::pair<uint64_t, Tile>> ordered;
+		ordered.reserve(tilesX * tilesY);
+		for (int ty = 0; ty < tilesY; ++ty) {
+			for (int tx = 0; tx < tilesX; ++tx) {
+				Tile tile = { tx * tileSize, ty * tileSize,
+					std::min((tx + 1) * tileSize, width), std::min((ty + 1) * tileSize, height) };
+				ordered.push_back(std::make_pair(hilbertIndex(n, tx, ty), tile));
+			}
+		}
+		std::sort(ordered.begin(), ordered.end(), [](const std::pair<uint64_t, Tile>& a, const std::pair<uint64_t, Tile>& b) {
+			return a.first < b.first;
+		});
+
+		tiles_.reserve(ordered.size());
+		for (const auto& entry : ordered) tiles_.push_back(entry.second);
+	}
+
+	/// <summary>
+	/// The tiles in Hilbert curve order.
+	/// </summary>
+	const std::vector<Tile>& tiles() const
+	{
+		return tiles_;
+	}
+
+	/// <summary>
+	/// Calls renderTile(tile) once for every tile, in parallel over all the OpenMP threads.
+	/// If reportProgress is set, the number of tiles left is written to std::clog as tiles
+	/// complete.
+	/// </summary>
+	template <typename RenderTile>
+	void run(RenderTile renderTile, bool reportProgress = true) const
+	{
+		const uint32_t nTiles = static_cast<uint32_t>(tiles_.size());
+		int nThreads = 1;
+#ifdef _OPENMP
+		nThreads = omp_get_max_threads();
+#endif
+		std::vector<TileRun> runs(nThreads);
+		for (int t = 0; t < nThreads; ++t) {
+			runs[t].range.store(pack(static_cast<uint32_t>(uint64_t(nTiles) * t / nThreads),
+				static_cast<uint32_t>(uint64_t(nTiles) * (t + 1) / nThreads)));
+		}
+
+		std::atomic<uint32_t> completed(0);
+		#pragma omp parallel num_threads(nThreads)
+		{
+			int thread = 0;
+#ifdef _OPENMP
+			thread = omp_get_thread_num();
+#endif
+			uint32_t tile;
+			while (nextTile(runs, thread, tile)) {
+				renderTile(tiles_[tile]);
+
+				// Report about every 1% of tiles. Exactly one thread completes each tile
+				// count, so only one of them reports each step.
+				uint32_t done = ++completed;
+				if (reportProgress && uint64_t(done) * 100 / nTiles != uint64_t(done - 1) * 100 / nTiles) {
+					std::clog << "\rTiles remaining: " << (nTiles - done) << ' ' << std::flush;
+				}
+			}
+		}
+	}
+
+	/// <summary>
+	/// The distance of (x, y) along a Hilbert curve filling an n by n square, where n is
+	/// a power of two.
+	/// </summary>
+	static uint64_t hilbertIndex(uint32_t n, uint32_t x, uint32_t y)
+	{
+		uint64_t d = 0;
+		for (uint32_t s = n / 2; s > 0; s /= 2) {
+			uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+			d += uint64_t(s) * s * ((3 * rx) ^ ry);
+			// Rotate the quadrant so the curve inside it has the standard orientation.
+			if (ry == 0) {
+				if (rx == 1) {
+					x = n - 1 - x;
+					y = n - 1 - y;
+				}
+				std::swap(x, y);
+			}
+		}
+		return d;
+	}
+
+private:
+	static uint64_t pack(uint32_t begin, uint32_t end)
+	{
+		return (uint64_t(begin) << 32) | end;
+	}
+
+	/// <summary>
+	/// Takes the next tile for a thread: the front of its own run, or else the front of
+	/// half a run stolen from another thread. Returns false once every run is empty.
+	/// </summary>
+	static bool nextTile(std::vector<TileRun>& runs, int thread, uint32_t& tile)
+	{
+		// Take from the front of our own run. Thieves may shrink it from the back at the
+		// same time, so this is a compare and swap too.
+		std::atomic<uint64_t>& own = runs[thread].range;
+		uint64_t range = own.load();
+		while (static_cast<uint32_t>(range >> 32) < static_cast<uint32_t>(range)) {
+			if (own.compare_exchange_weak(range, range + (uint64_t(1) << 32))) {
+				tile = static_cast<uint32_t>(range >> 32);
+				return true;
+			}
+		}
+
+		// Our run is empty, so steal the back half of someone else's, starting with the
+		// next thread along so thieves spread out over the victims.
+		const int nThreads = static_cast<int>(runs.size());
+		for (int i = 1; i < nThreads; ++i) {
+			std::atomic<uint64_t>& victim = runs[(thread + i) % nThreads].range;
+			uint64_t victimRange = victim.load();
+			while (true) {
+				uint32_t begin = static_cast<uint32_t>(victimRange >> 32), end = static_cast<uint32_t>(victimRange);
+				if (begin >= end) break;
+				uint32_t split = end - (end - begin + 1) / 2;
+				if (victim.compare_exchange_weak(victimRange, pack(begin, split))) {
+					// Only this thread writes to its own run while it's empty, so a store will do.
+					tile = split;
+					own.store(pack(split + 1, end));
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+};
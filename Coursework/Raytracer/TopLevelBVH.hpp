@@ -0,0 +1,101 @@
+#pragma once
+#include "Renderable.hpp"
+#include "BVHBuilder.hpp"
+#include "LinearBVH.hpp"
+#include "MeshInstance.hpp"
+#include <vector>
+
+/// <summary>
+/// A TopLevelBVH (TLAS) is a BVH over the world space bounds of a set of MeshInstances.
+/// Each leaf hands the ray on to its instances, which trace it through their shared,
+/// object space BLAS. Only the closest hit's shading attributes are computed, once
+/// traversal has finished.
+/// The instances are fixed when the TLAS is built, so it has to be rebuilt (which is
+/// cheap, as it only covers the instances) if any of them move.
+/// </summary>
+class TopLevelBVH : public Renderable
+{
+private:
+	std::vector<std::shared_ptr<MeshInstance>> instances_; // Instances in leaf order.
+	std::vector<LinearBVHNode> nodes_;
+
+public:
+	TopLevelBVH(const std::vector<std::shared_ptr<MeshInstance>>& instances, const BVHBuildOptions& options,
+		IntersectMask mask = DEFAULT_BITMASK)
+		:Renderable(nullptr, mask)
+	{
+		std::vector<BVHPrimitive> prims(instances.size());
+		for (size_t i = 0; i < instances.size(); ++i) {
+			prims[i].bounds = instances[i]->getAABB();
+			prims[i].centroid = .5f * (prims[i].bounds.min + prims[i].bounds.max);
+			prims[i].index = static_cast<int>(i);
+		}
+
+		// flatten throws if the tree is too deep for the stack of LinearBVH::traverse, used below.
+		BVHBuildTree tree = BVHBuilder(options).build(prims);
+		nodes_ = LinearBVH::flatten(tree);
+		for (int index : tree.primIndices) {
+			instances_.push_back(instances[index]);
+		}
+	}
+
+	int ninstances() const
+	{
+		return static_cast<int>(instances_.size());
+	}
+
+	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	{
+		return intersectDeferred(ray, minT, maxT, info, mask);
+	}
+
+	/// <summary>
+	/// Finds the closest hit over all the instances. The hit records the instance, so its
+	/// shading attributes are filled out by the instance itself.
+	/// </summary>
+	virtual bool intersectPrimitive(const Ray& ray, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		bool found = false;
+		LinearBVH::traverse(nodes_, ray, minT, maxT, [&](int first, int count, float& closestT) {
+			for (int prim = first; prim < first + count; ++prim) {
+				// Instances only report hits closer than closestT, and shrink it.
+				found |= instances_[prim]->intersectPrimitive(ray, minT, closestT, hit, mask);
+			}
+			return false;
+		});
+		return found;
+	}
+
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		bool hit = false;
+		LinearBVH::traverse(nodes_, ray, minT, maxT, [&](int first, int count, float& closestT) {
+			for (int prim = first; prim < first + count && !hit; ++prim) {
+				hit = instances_[prim]->occluded(ray, minT, closestT, mask);
+			}
+			return hit;
+		});
+		return hit;
+	}
+
+	virtual AABB getAABB() const override
+	{
+		return LinearBVH::rootBounds(nodes_);
+	}
+
+	virtual std::string print() const override
+	{
+		std::stringstream ss;
+		ss << "TopLevelBVH with " << nodes_.size() << " nodes and " << instances_.size() << " instances";
+		return ss.str();
+	}
+
+	virtual void modelToWorld(const Eigen::Matrix4f& m) override
+	{
+		throw(std::runtime_error("Can't transform a TopLevelBVH."));
+	}
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+
+/// <summary>
+/// Running totals of the work done tracing rays on the current thread: the BVH nodes
+/// visited and the primitives tested (triangles, instances in a TopLevelBVH, or leaf
+/// renderables in a BVHNode tree). Take a copy before tracing something and subtract it
+/// afterwards to find what that cost.
+/// </summary>
+struct TraversalStats
+{
+	uint64_t nodes = 0, primitives = 0;
+
+	/// <summary>
+	/// The totals for the calling thread.
+	/// </summary>
+	static TraversalStats& local()
+	{
+		static thread_local TraversalStats stats;
+		return stats;
+	}
+
+	TraversalStats operator-(const TraversalStats& other) const
+	{
+		TraversalStats difference;
+		difference.nodes = nodes - other.nodes;
+		difference.primitives = primitives - other.primitives;
+		return difference;
+	}
+};
+
+/// <summary>
+/// Counts the nodes and primitives for one traversal in plain local variables, which
+/// are cheap enough to bump in the inner loop, and adds them to the thread's totals when
+/// it goes out of scope.
+/// </summary>
+struct TraversalCounter
+{
+	int nodes = 0, primitives = 0;
+
+	~TraversalCounter()
+	{
+		TraversalStats& stats = TraversalStats::local();
+		stats.nodes += nodes;
+		stats.primitives += primitives;
+	}
+};
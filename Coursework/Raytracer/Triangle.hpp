@@ -10,86 +10,90 @@ class Triangle : public Renderable
 {
 private:
 	Eigen::Vector3f v0_, v1_, v2_;
+	// World space first vertex and edges, updated whenever modelToWorld changes.
+	Eigen::Vector3f v0World_, v0v1World_, v0v2World_;
+	AABB aabb_;
 	bool culling_;
 public:
 	Triangle(const Shader* shader, 
 		const Eigen::Vector3f& v0, const Eigen::Vector3f& v1, const Eigen::Vector3f& v2, 
 		bool culling=false, IntersectMask mask=DEFAULT_BITMASK)
 		:Renderable(shader, mask), v0_(v0), v1_(v1), v2_(v2), culling_(culling)
-	{}
+	{
+		computeWorldTriangle();
+	}
 
 
 	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
 	{
-		if (!checkMask(mask)) return false;
-		// Intersection code from
-		// https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection.html
-		Eigen::Vector3f v0World = transformPosition(modelToWorld(), v0_);
-		Eigen::Vector3f v1World = transformPosition(modelToWorld(), v1_);
-		Eigen::Vector3f v2World = transformPosition(modelToWorld(), v2_);
-
-		Eigen::Vector3f v0v1 = v1World - v0World;
-		Eigen::Vector3f v0v2 = v2World - v0World;
-		Eigen::Vector3f pvec = ray.direction.cross(v0v2);
-		float det = v0v1.dot(pvec);
-
-		if (culling_) {
-			// if the determinant is negative, the triangle is 'back facing'
-			// if the determinant is close to 0, the ray misses the triangle
-			if (det < 1e-6) return false;
-		}
-		else {
-			// ray and triangle are parallel if det is close to 0
-			if (fabs(det) < 1e-6) return false;
-		}
-
-		float invDet = 1 / det;
-
-		Eigen::Vector3f tvec = ray.origin - v0World;
-		float u = tvec.dot(pvec) * invDet;
-		if (u < 0 || u > 1) return false;
-
-		Eigen::Vector3f qvec = tvec.cross(v0v1);
-		float v = ray.direction.dot(qvec) * invDet;
-		if (v < 0 || u + v > 1) return false;
+		return intersectDeferred(ray, minT, maxT, info, mask);
+	}
 
-		float t = v0v2.dot(qvec) * invDet;
+	virtual bool intersectPrimitive(const Ray& ray, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+		float t, u, v;
+		if (!intersectTriangleEdges(ray, v0World_, v0v1World_, v0v2World_, culling_, t, u, v)) return false;
 
 		if (t < minT || t > maxT) return false;
 
-		info.hitT = t;
+		maxT = t;
+		hit.t = t;
+		hit.renderable = this;
+		hit.prim = 0;
+		hit.u = u;
+		hit.v = v;
+		return true;
+	}
+
+	virtual void fillHitInfo(const Ray& ray, const PrimitiveHit& hit, HitInfo& info) const override
+	{
+		info.hitT = hit.t;
 		info.inDirection = ray.direction;
-		info.location = ray.origin + t * ray.direction;
-		info.normal = v0v1.cross(v0v2).normalized();
+		info.location = ray.origin + hit.t * ray.direction;
+		info.normal = v0v1World_.cross(v0v2World_).normalized();
 		info.shader = shader();
-		info.texCoords = Eigen::Vector2f(u, v);
+		info.texCoords = Eigen::Vector2f(hit.u, hit.v);
+	}
 
-		return true;
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+		float t, u, v;
+		return intersectTriangleEdges(ray, v0World_, v0v1World_, v0v2World_, culling_, t, u, v) && t >= minT && t <= maxT;
 	}
 
 	virtual AABB getAABB() const override
 	{
-		Eigen::Vector3f v0World = transformPosition(modelToWorld(), v0_);
-		Eigen::Vector3f v1World = transformPosition(modelToWorld(), v1_);
-		Eigen::Vector3f v2World = transformPosition(modelToWorld(), v2_);
-
-		AABB aabb;
-		aabb.min = v0World;
-		aabb.max = v0World;
-
-		for (int axis = 0; axis < 3; ++axis) {
-			if (v1World[axis] < aabb.min[axis]) aabb.min[axis] = v1World[axis];
-			if (v1World[axis] > aabb.max[axis]) aabb.max[axis] = v1World[axis];
-			if (v2World[axis] < aabb.min[axis]) aabb.min[axis] = v2World[axis];
-			if (v2World[axis] > aabb.max[axis]) aabb.max[axis] = v2World[axis];
-		}
+		return aabb_;
+	}
 
-		return aabb;
+	virtual void modelToWorld(const Eigen::Matrix4f& m) override
+	{
+		Entity::modelToWorld(m);
+		computeWorldTriangle();
 	}
 
 	virtual std::string print() const override
 	{
 		return "Triangle";
 	}
+
+private:
+	void computeWorldTriangle()
+	{
+		Eigen::Vector3f v0World = transformPosition(Entity::modelToWorld(), v0_);
+		Eigen::Vector3f v1World = transformPosition(Entity::modelToWorld(), v1_);
+		Eigen::Vector3f v2World = transformPosition(Entity::modelToWorld(), v2_);
+
+		v0World_ = v0World;
+		v0v1World_ = v1World - v0World;
+		v0v2World_ = v2World - v0World;
+
+		aabb_ = AABB::empty();
+		aabb_.extend(v0World);
+		aabb_.extend(v1World);
+		aabb_.extend(v2World);
+	}
 };
 
@@ -0,0 +1,162 @@
+#pragma once
+#include "Renderable.hpp"
+#include "Shader.hpp"
+#include "Light.hpp"
+#include "Camera.hpp"
+#include "GeomUtil.hpp"
+#include "BVHBuilder.hpp"
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+
+/// <summary>
+/// The WavefrontIntegrator renders breadth first rather than depth first. Instead of each
+/// pixel recursing through Shader::getColor, a batch of pixels moves through separate
+/// stages together:
+///  1. Generate a camera ray for every pixel in the batch.
+///  2. Trace the whole batch of rays.
+///  3. Sort the hits by shader, and shade them (getDirectColor, including shadow rays).
+///  4. Collect the rays the shaders scatter (e.g. mirror reflections) into the next batch,
+///     sorted by origin and direction so neighbouring rays take similar paths through
+///     the scene, and go back to 2 until no rays are left or maxBounces is reached.
+/// Every stage is a parallel loop over a whole batch, and the result is the same as
+/// calling getColor recursively.
+/// </summary>
+class WavefrontIntegrator
+{
+private:
+	struct WavefrontRay
+	{
+		Ray ray;
+		Eigen::Vector3f weight; // Multiplies the colour found along the ray.
+		int pixel;
+		uint32_t key; // Sort key: direction octant then Morton code of the origin.
+	};
+
+	const Renderable* scene_;
+	const std::vector<std::unique_ptr<Light>>& lights_;
+	Eigen::Vector3f ambientLight_;
+	int maxBounces_;
+	int batchSize_;
+	bool sortRays_;
+
+public:
+	WavefrontIntegrator(const Renderable* scene, const std::vector<std::unique_ptr<Light>>& lights,
+		const Eigen::Vector3f& ambientLight, int maxBounces, int batchSize = 1 << 16, bool sortRays = true)
+		:scene_(scene), lights_(lights), ambientLight_(ambientLight), maxBounces_(maxBounces),
+		batchSize_(std::max(batchSize, 1)), sortRays_(sortRays)
+	{}
+
+	/// <summary>
+	/// Renders the image seen by the camera. color[x + y * width] is set to the
+	/// (unclamped) colour for the camera ray cam.getRay(x, y), or black on a miss.
+	/// </summary>
+	void render(const Camera& cam, int width, int height, std::vector<Eigen::Vector3f>& color) const
+	{
+		const int nPixels = width * height;
+		color.assign(nPixels, Eigen::Vector3f::Zero());
+
+		for (int first = 0; first < nPixels; first += batchSize_) {
+			const int count = std::min(batchSize_, nPixels - first);
+
+			// Camera rays for neighbouring pixels are already coherent, so aren't sorted.
+			std::vector<WavefrontRay> rays(count);
+			#pragma omp parallel for
+			for (int i = 0; i < count; ++i) {
+				int pixel = first + i;
+				rays[i].ray = cam.getRay(pixel % width, pixel / width);
+				rays[i].weight = Eigen::Vector3f::Ones();
+				rays[i].pixel = pixel;
+				rays[i].key = 0;
+			}
+
+			for (int bounce = 0; !rays.empty(); ++bounce) {
+				// Camera rays and scattered rays use the same ranges as main and MirrorShader.
+				rays = traceAndShade(rays, bounce, bounce == 0 ? 1e6f : 1e4f, color);
+				if (sortRays_) sortRays(rays);
+			}
+		}
+	}
+
+private:
+	/// <summary>
+	/// Traces a batch of rays, adds the shaded colour of each hit to its pixel and
+	/// returns the batch of scattered rays.
+	/// </summary>
+	std::vector<WavefrontRay> traceAndShade(const std::vector<WavefrontRay>& rays, int bounce, float maxT,
+		std::vector<Eigen::Vector3f>& color) const
+	{
+		const int n = static_cast<int>(rays.size());
+
+		// Trace.
+		std::vector<HitInfo> hits(n);
+		std::vector<char> hit(n);
+		#pragma omp parallel for
+		for (int i = 0; i < n; ++i) {
+			hit[i] = scene_->intersect(rays[i].ray, 1e-6f, maxT, hits[i], VISIBLE_BITMASK);
+		}
+
+		// Sort the hits by shader, so each shader's code and data stay in cache.
+		std::vector<int> order;
+		order.reserve(n);
+		for (int i = 0; i < n; ++i) {
+			if (hit[i]) order.push_back(i);
+		}
+		std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+			return std::less<const Shader*>()(hits[a].shader, hits[b].shader);
+		});
+
+		// Shade. Each pixel has at most one ray in a batch, so pixels can be updated
+		// without any locking.
+		const int nHits = static_cast<int>(order.size());
+		std::vector<WavefrontRay> scattered(nHits);
+		std::vector<char> didScatter(nHits);
+		#pragma omp parallel for
+		for (int k = 0; k < nHits; ++k) {
+			const WavefrontRay& ray = rays[order[k]];
+			const HitInfo& hitInfo = hits[order[k]];
+			color[ray.pixel] += coefftWiseMul(ray.weight,
+				hitInfo.shader->getDirectColor(hitInfo, scene_, lights_, ambientLight_));
+
+			Eigen::Vector3f weight;
+			didScatter[k] = bounce < maxBounces_ && hitInfo.shader->scatter(hitInfo, scattered[k].ray, weight);
+			if (didScatter[k]) {
+				scattered[k].weight = coefftWiseMul(ray.weight, weight);
+				scattered[k].pixel = ray.pixel;
+			}
+		}
+
+		std::vector<WavefrontRay> next;
+		for (int k = 0; k < nHits; ++k) {
+			if (didScatter[k]) next.push_back(scattered[k]);
+		}
+		return next;
+	}
+
+	/// <summary>
+	/// Sorts rays by the octant of their direction, then by the Morton code of their
+	/// origin within the bounds of all the origins, so rays that are close together and
+	/// point the same way are traced one after another.
+	/// </summary>
+	static void sortRays(std::vector<WavefrontRay>& rays)
+	{
+		if (rays.size() < 2) return;
+
+		AABB bounds = AABB::empty();
+		for (const WavefrontRay& ray : rays) bounds.extend(ray.ray.origin);
+
+		const int n = static_cast<int>(rays.size());
+		#pragma omp parallel for
+		for (int i = 0; i < n; ++i) {
+			const Eigen::Vector3f& dir = rays[i].ray.direction;
+			uint32_t octant = (dir.x() < 0.f ? 1u : 0u) | (dir.y() < 0.f ? 2u : 0u) | (dir.z() < 0.f ? 4u : 0u);
+			rays[i].key = (octant << 29) | (BVHBuilder::mortonCode(rays[i].ray.origin, bounds) >> 1);
+		}
+
+		std::stable_sort(rays.begin(), rays.end(), [](const WavefrontRay& a, const WavefrontRay& b) {
+			return a.key < b.key;
+		});
+	}
+};
@@ -0,0 +1,355 @@
+#pragma once
+#include "Renderable.hpp"
+#include "GeomUtil.hpp"
+#include "Model.hpp"
+#include "BVHNode.hpp"
+#include "BVHBuilder.hpp"
+#include "MeshTriangles.hpp"
+#include "SIMD.hpp"
+#include "TraversalStats.hpp"
+#include <vector>
+#include <cstdint>
+
+/// <summary>
+/// A node of a WideBVH with up to N children. Child bounds are stored as structure of
+/// arrays (all the min x values together etc.) so all N boxes can be tested at once.
+/// For interior children, child holds the index of the child node. For leaf children,
+/// it holds the index of the first triangle and primCount is the number of triangles.
+/// </summary>
+template <int N>
+struct WideBVHNode
+{
+	float bounds[6][N]; // min x, y, z then max x, y, z.
+	int32_t child[N];
+	uint16_t primCount[N]; // 0 for interior children.
+	int32_t numChildren;
+};
+
+/// <summary>
+/// Tests a ray against all the child boxes of a WideBVHNode. Returns a bit mask with a
+/// bit set for each child that was hit, and the entry distance to every child in tNear.
+/// This is the scalar version, used when no vector instructions are available.
+/// </summary>
+template <int N>
+int intersectWideNode(const WideBVHNode<N>& node, const float origin[3], const float invDir[3],
+	float minT, float maxT, float tNear[N])
+{
+	int mask = 0;
+	for (int i = 0; i < node.numChildren; ++i) {
+		float tMin = minT, tMax = maxT;
+		for (int a = 0; a < 3; ++a) {
+			float t0 = (node.bounds[a][i] - origin[a]) * invDir[a];
+			float t1 = (node.bounds[a + 3][i] - origin[a]) * invDir[a];
+			tMin = std::max(tMin, std::min(t0, t1));
+			tMax = std::min(tMax, std::max(t0, t1));
+		}
+		tNear[i] = tMin;
+		if (tMin <= tMax) mask |= 1 << i;
+	}
+	return mask;
+}
+
+#ifdef RAYTRACER_SSE
+/// <summary>
+/// SSE slab test for four boxes at a time. Min and max are used to order the slab
+/// distances, so there's no branch on the ray direction.
+/// </summary>
+inline int intersectWideNode4(const float* bounds, int stride, const float origin[3], const float invDir[3],
+	float minT, float maxT, float tNear[4])
+{
+	__m128 tMin = _mm_set1_ps(minT), tMax = _mm_set1_ps(maxT);
+	for (int a = 0; a < 3; ++a) {
+		__m128 org = _mm_set1_ps(origin[a]), inv = _mm_set1_ps(invDir[a]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds + a * stride), org), inv);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds + (a + 3) * stride), org), inv);
+		tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+		tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+	}
+	_mm_storeu_ps(tNear, tMin);
+	return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+}
+
+template <>
+inline int intersectWideNode<4>(const WideBVHNode<4>& node, const float origin[3], const float invDir[3],
+	float minT, float maxT, float tNear[4])
+{
+	int mask = intersectWideNode4(&node.bounds[0][0], 4, origin, invDir, minT, maxT, tNear);
+	return mask & ((1 << node.numChildren) - 1);
+}
+
+template <>
+inline int intersectWideNode<8>(const WideBVHNode<8>& node, const float origin[3], const float invDir[3],
+	float minT, float maxT, float tNear[8])
+{
+#ifdef RAYTRACER_AVX
+	__m256 tMin = _mm256_set1_ps(minT), tMax = _mm256_set1_ps(maxT);
+	for (int a = 0; a < 3; ++a) {
+		__m256 org = _mm256_set1_ps(origin[a]), inv = _mm256_set1_ps(invDir[a]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[a]), org), inv);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[a + 3]), org), inv);
+		tMin = _mm256_max_ps(tMin, _mm256_min_ps(t0, t1));
+		tMax = _mm256_min_ps(tMax, _mm256_max_ps(t0, t1));
+	}
+	_mm256_storeu_ps(tNear, tMin);
+	int mask = _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ));
+#else
+	// Without AVX, test the two halves of the node with SSE.
+	int mask = intersectWideNode4(&node.bounds[0][0], 8, origin, invDir, minT, maxT, tNear) |
+		(intersectWideNode4(&node.bounds[0][4], 8, origin, invDir, minT, maxT, tNear + 4) << 4);
+#endif
+	return mask & ((1 << node.numChildren) - 1);
+}
+#endif
+
+/// <summary>
+/// A WideBVH is made by collapsing the binary tree from BVHBuilder into a tree where each
+/// node has up to N children (N = 4 or 8 makes sense), roughly dividing the depth of the
+/// tree by log2(N). Each node tests all its child boxes at once with SIMD instructions,
+/// then visits the children that were hit in order of distance along the ray.
+/// Like LinearBVH, it's built in world space so modelToWorld must be given to the constructor.
+/// </summary>
+template <int N>
+class WideBVH : public Renderable
+{
+private:
+	std::vector<WideBVHNode<N>> nodes_;
+	MeshTriangles triangles_; // Triangles in leaf order.
+	bool culling_;
+
+	struct StackEntry
+	{
+		int32_t child;
+		uint16_t primCount;
+		float tNear;
+	};
+
+public:
+	WideBVH(const Model& model, const Shader* shader, const BVHBuildOptions& options,
+		const Eigen::Matrix4f& modelToWorld, bool culling = true, IntersectMask mask = DEFAULT_BITMASK)
+		:WideBVH(model, shader, BVHBuilder(options).build(BVHNode::modelPrimitives(model, modelToWorld)),
+			modelToWorld, culling, mask)
+	{}
+
+	/// <summary>
+	/// Makes a WideBVH from a binary tree that has already been built over the model's faces
+	/// with the same modelToWorld transform (e.g. one loaded by MeshCache).
+	/// </summary>
+	WideBVH(const Model& model, const Shader* shader, const BVHBuildTree& tree,
+		const Eigen::Matrix4f& modelToWorld, bool culling = true, IntersectMask mask = DEFAULT_BITMASK)
+		:Renderable(shader, mask), culling_(culling)
+	{
+		static_assert(N >= 2 && N <= 8, "WideBVH supports between 2 and 8 children per node.");
+		// Collapsing never makes the tree deeper, so the traversal stack (N entries per level)
+		// has room as long as the binary tree is within BVHBuilder::maxTraversalDepth.
+		BVHBuilder::checkDepth(tree, "WideBVH");
+		if (!tree.nodes.empty()) collapse(tree, 0);
+		triangles_ = MeshTriangles(&model, tree.primIndices, modelToWorld);
+	}
+
+	int nnodes() const
+	{
+		return static_cast<int>(nodes_.size());
+	}
+
+	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	{
+		return intersectDeferred(ray, minT, maxT, info, mask);
+	}
+
+	virtual bool intersectPrimitive(const Ray& ray, float minT, float& maxT, PrimitiveHit& hit, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		int hitTri = -1;
+		float hitU = 0.f, hitV = 0.f;
+		if (culling_) intersectLeaves<true>(ray, minT, maxT, hitTri, hitU, hitV);
+		else intersectLeaves<false>(ray, minT, maxT, hitTri, hitU, hitV);
+
+		if (hitTri < 0) return false;
+
+		hit.t = maxT;
+		hit.renderable = this;
+		hit.prim = hitTri;
+		hit.u = hitU;
+		hit.v = hitV;
+		return true;
+	}
+
+	virtual void fillHitInfo(const Ray& ray, const PrimitiveHit& hit, HitInfo& info) const override
+	{
+		triangles_.fillHitInfo(ray, hit.t, hit.prim, hit.u, hit.v, shader(), info);
+	}
+
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		return culling_ ? occludedLeaves<true>(ray, minT, maxT) : occludedLeaves<false>(ray, minT, maxT);
+	}
+
+	virtual AABB getAABB() const override
+	{
+		AABB aabb = AABB::empty();
+		if (nodes_.empty()) return aabb;
+		for (int i = 0; i < nodes_[0].numChildren; ++i) {
+			aabb.extend(Eigen::Vector3f(nodes_[0].bounds[0][i], nodes_[0].bounds[1][i], nodes_[0].bounds[2][i]));
+			aabb.extend(Eigen::Vector3f(nodes_[0].bounds[3][i], nodes_[0].bounds[4][i], nodes_[0].bounds[5][i]));
+		}
+		return aabb;
+	}
+
+	virtual std::string print() const override
+	{
+		std::stringstream ss;
+		ss << "BVH" << N << " with " << nodes_.size() << " nodes and " << triangles_.size() << " triangles";
+		return ss.str();
+	}
+
+	virtual void modelToWorld(const Eigen::Matrix4f& m) override
+	{
+		throw(std::runtime_error("Can't transform a WideBVH."));
+	}
+
+private:
+	/// <summary>
+	/// Finds the closest hit, with back face culling chosen at compile time so the leaf
+	/// kernel has no culling branch.
+	/// </summary>
+	template <bool Culling>
+	void intersectLeaves(const Ray& ray, float minT, float& maxT, int& tri, float& u, float& v) const
+	{
+		const PackedTriangles& packed = triangles_.packed();
+		traverse(ray, minT, maxT, [&](int first, int count, float& closestT) {
+			packed.template intersectClosest<Culling>(ray, first, count, minT, closestT, tri, u, v);
+			return false;
+		});
+	}
+
+	template <bool Culling>
+	bool occludedLeaves(const Ray& ray, float minT, float maxT) const
+	{
+		const PackedTriangles& packed = triangles_.packed();
+		bool hit = false;
+		traverse(ray, minT, maxT, [&](int first, int count, float& closestT) {
+			hit = packed.template intersectAny<Culling>(ray, first, count, minT, closestT);
+			return hit;
+		});
+		return hit;
+	}
+
+	/// <summary>
+	/// Walks the tree, calling intersectLeaf(first, count, maxT) with the range of triangles
+	/// in each leaf the ray reaches, nearest children first. intersectLeaf should reduce maxT
+	/// when it finds a closer hit, and can return true to stop traversal straight away.
+	/// </summary>
+	template <typename IntersectLeaf>
+	void traverse(const Ray& ray, float minT, float& maxT, IntersectLeaf intersectLeaf) const
+	{
+		if (nodes_.empty()) return;
+
+		const float origin[3] = { ray.origin.x(), ray.origin.y(), ray.origin.z() };
+		const float invDir[3] = { ray.invDirection.x(), ray.invDirection.y(), ray.invDirection.z() };
+
+		TraversalCounter counter;
+		StackEntry stack[64 * N];
+		int stackSize = 0;
+		stack[stackSize++] = { 0, 0, minT };
+
+		while (stackSize > 0) {
+			const StackEntry entry = stack[--stackSize];
+			// Anything further away than the closest hit so far can be skipped.
+			if (entry.tNear > maxT) continue;
+
+			if (entry.primCount > 0) {
+				counter.primitives += entry.primCount;
+				if (intersectLeaf(entry.child, static_cast<int>(entry.primCount), maxT)) return;
+				continue;
+			}
+
+			const WideBVHNode<N>& node = nodes_[entry.child];
+			++counter.nodes;
+			float tNear[N];
+			int hitMask = intersectWideNode<N>(node, origin, invDir, minT, maxT, tNear);
+
+			// Push the children that were hit, furthest first, so the nearest is visited next.
+			int first = stackSize;
+			for (int i = 0; i < N; ++i) {
+				if (!(hitMask & (1 << i))) continue;
+				StackEntry child = { node.child[i], node.primCount[i], tNear[i] };
+				int j = stackSize++;
+				while (j > first && stack[j - 1].tNear < child.tNear) {
+					stack[j] = stack[j - 1];
+					--j;
+				}
+				stack[j] = child;
+			}
+		}
+	}
+
+	/// <summary>
+	/// Makes a wide node from the binary node buildIdx. Starting from its two children,
+	/// the interior child with the largest surface area is repeatedly replaced by its own
+	/// children until there are N children or only leaves are left.
+	/// </summary>
+	int collapse(const BVHBuildTree& tree, int buildIdx)
+	{
+		const BVHBuildNode& buildNode = tree.nodes[buildIdx];
+
+		int kids[N];
+		int numKids = 0;
+		if (buildNode.isLeaf()) {
+			kids[numKids++] = buildIdx;
+		}
+		else {
+			kids[numKids++] = buildNode.children[0];
+			kids[numKids++] = buildNode.children[1];
+		}
+
+		while (numKids < N) {
+			int largest = -1;
+			float largestArea = -1.f;
+			for (int k = 0; k < numKids; ++k) {
+				const BVHBuildNode& kid = tree.nodes[kids[k]];
+				if (!kid.isLeaf() && kid.bounds.surfaceArea() > largestArea) {
+					largestArea = kid.bounds.surfaceArea();
+					largest = k;
+				}
+			}
+			if (largest < 0) break;
+			const BVHBuildNode& kid = tree.nodes[kids[largest]];
+			kids[largest] = kid.children[0];
+			kids[numKids++] = kid.children[1];
+		}
+
+		int nodeIdx = static_cast<int>(nodes_.size());
+		nodes_.emplace_back();
+		WideBVHNode<N> node;
+		node.numChildren = numKids;
+		for (int i = 0; i < N; ++i) {
+			// Unused slots get an inside out box, and are masked off anyway.
+			AABB bounds = i < numKids ? tree.nodes[kids[i]].bounds : AABB::empty();
+			for (int a = 0; a < 3; ++a) {
+				node.bounds[a][i] = bounds.min[a];
+				node.bounds[a + 3][i] = bounds.max[a];
+			}
+			node.child[i] = 0;
+			node.primCount[i] = 0;
+		}
+
+		for (int i = 0; i < numKids; ++i) {
+			const BVHBuildNode& kid = tree.nodes[kids[i]];
+			if (kid.isLeaf()) {
+				if (kid.primCount > UINT16_MAX)
+					throw std::runtime_error("Too many triangles in a WideBVH leaf.");
+				node.child[i] = kid.firstPrim;
+				node.primCount[i] = static_cast<uint16_t>(kid.primCount);
+			}
+			else {
+				node.child[i] = collapse(tree, kids[i]);
+			}
+		}
+
+		nodes_[nodeIdx] = node;
+		return nodeIdx;
+	}
+};
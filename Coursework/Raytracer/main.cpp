@@ -3,20 +3,33 @@
 #include <json/json.hpp>
 #include <iostream>
 #include <vector>
-#include <random>
 #include <chrono>
+#include <algorithm>
 #include "BVHNode.hpp"
+#include "LinearBVH.hpp"
+#include "WideBVH.hpp"
+#include "TopLevelBVH.hpp"
+#include "WavefrontIntegrator.hpp"
+#include "TileScheduler.hpp"
+#include "ProgressiveRenderer.hpp"
+#include "AdaptiveRenderer.hpp"
+#include "PathTracer.hpp"
+#include "Denoiser.hpp"
+#include "Framebuffer.hpp"
+#include "PngEncoder.hpp"
 #include "Triangle.hpp"
 #include "Scene.hpp"
 #include "Camera.hpp"
 #include "PointLight.hpp"
 #include "DirectionalLight.hpp"
+#include "EnvironmentLight.hpp"
 #include "LambertianShader.hpp"
 #include "TexturedLambertianShader.hpp"
 #include "PhongShader.hpp"
 #include "MirrorShader.hpp"
 #include "TexCoordTestShader.hpp"
 #include "Model.hpp"
+#include "MeshCache.hpp"
 #include <fstream>
 
 /// <summary>
@@ -38,6 +51,20 @@ Eigen::Vector3f loadVec3FromConfig(const nlohmann::json& config)
 	return Eigen::Vector3f(config[0], config[1], config[2]);
 }
 
+/// <summary>
+/// Load the BVH build parameters from the config file.
+/// </summary>
+BVHBuildOptions loadBVHOptionsFromConfig(const nlohmann::json& config)
+{
+	BVHBuildOptions options;
+	options.splitMethod = parseBVHSplitMethod(config["bvhBuilder"]);
+	options.maxDepth = config["bvhMaxDepth"];
+	options.maxLeafSize = config["bvhMaxLeafSize"];
+	options.sahBins = config["bvhSahBins"];
+	options.parallelBuild = config["bvhParallelBuild"];
+	return options;
+}
+
 int main(int argc, char* argv[]) {
 
 	// *** Load the config file ***
@@ -77,12 +104,57 @@ int main(int argc, char* argv[]) {
 	TexCoordTestShader texCoordTestShader;
 
 	// *** Set up scene ***
+	// Scenes with more than sceneBVHThreshold objects are traced through a BVH.
 	Scene scene;
+	scene.bvhThreshold = config["sceneBVHThreshold"];
 
 	// Optional code: here's how to add the spot mesh to the scene, using a BVH
 	// Try enabling this and comparing it to the non-BVH version below!
-	Model spotModel("../models/spot.obj");
-	scene.renderables.push_back(std::make_shared<BVHNode>(spotModel, &spotShader, 4, rotateY(M_PI / 4.0f)));
+	// The BVH builder (midpoint, SAH or LBVH) and its parameters are set in the config file.
+	// The parsed model and its BVH are kept in a binary cache file next to the obj, so later
+	// runs can skip loading and building them (see MeshCache).
+	auto loadStartTime = std::chrono::steady_clock::now();
+	MeshCache spotCache("../models/spot.obj", config["meshCache"]);
+	const Model& spotModel = spotCache.model();
+	auto loadTime = std::chrono::steady_clock::now() - loadStartTime;
+	std::cout << "Model load duration " << std::chrono::duration_cast<std::chrono::microseconds>(loadTime).count() * 1e-6f
+		<< " seconds" << (spotCache.modelFromCache() ? " (from cache)." : ".") << std::endl;
+	// The "linear" layout compiles the BVH into a flat node array, which is faster to trace.
+	// "bvh4" and "bvh8" collapse it into 4 or 8-wide nodes tested with SIMD instructions.
+	BVHBuildOptions bvhOptions = loadBVHOptionsFromConfig(config);
+	scene.bvhOptions = bvhOptions;
+	// With more than one spot instance, a single object space BVH is shared by all the
+	// copies, which are placed in rows behind the first one and traced through a TopLevelBVH.
+	const int spotInstances = config["spotInstances"];
+	auto buildStartTime = std::chrono::steady_clock::now();
+	if (spotInstances > 1) {
+		auto spotBLAS = MeshInstance::makeBLAS(spotModel, spotCache.bvh(bvhOptions, Eigen::Matrix4f::Identity()));
+		std::vector<std::shared_ptr<MeshInstance>> instances;
+		const int rowLength = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(spotInstances))));
+		for (int i = 0; i < spotInstances; ++i) {
+			Eigen::Vector3f offset(1.5f * (i % rowLength - (rowLength - 1) / 2.f), 0.f, 2.f * (i / rowLength));
+			instances.push_back(std::make_shared<MeshInstance>(spotBLAS, &spotShader,
+				makeTranslationMatrix(offset) * rotateY(M_PI / 4.0f + .3f * i)));
+		}
+		scene.renderables.push_back(std::make_shared<TopLevelBVH>(instances, bvhOptions));
+	}
+	else {
+		const Eigen::Matrix4f spotToWorld = rotateY(M_PI / 4.0f);
+		const BVHBuildTree& spotBVH = spotCache.bvh(bvhOptions, spotToWorld);
+		if (config["bvhLayout"] == "linear")
+			scene.renderables.push_back(std::make_shared<LinearBVH>(spotModel, &spotShader, spotBVH, spotToWorld));
+		else if (config["bvhLayout"] == "bvh4")
+			scene.renderables.push_back(std::make_shared<WideBVH<4>>(spotModel, &spotShader, spotBVH, spotToWorld));
+		else if (config["bvhLayout"] == "bvh8")
+			scene.renderables.push_back(std::make_shared<WideBVH<8>>(spotModel, &spotShader, spotBVH, spotToWorld));
+		else
+			scene.renderables.push_back(std::make_shared<BVHNode>(spotModel, &spotShader, spotBVH, bvhOptions, spotToWorld));
+	}
+	// The scene BVH (if the scene needs one) is built once all the renderables are added.
+	scene.buildBVH();
+	auto buildTime = std::chrono::steady_clock::now() - buildStartTime;
+	std::cout << "BVH build duration " << std::chrono::duration_cast<std::chrono::microseconds>(buildTime).count() * 1e-6f
+		<< " seconds" << (spotCache.bvhFromCache() ? " (from cache)." : ".") << std::endl;
 
 	// Here's how to add the mesh without using the BVH.
 	// Try comparing performance to the BVH version above.
@@ -99,16 +171,14 @@ int main(int argc, char* argv[]) {
 
 	// *** Render the scene ***
 
-	// Shuffling the scanline order gets better CPU usage between threads
-	// when some lines take longer to render than others.
-	std::vector<unsigned int> scanlines(pixHeight);
-	for (int i = 0; i < pixHeight; ++i) scanlines[i] = i;
+	// The image is rendered in square tiles, handed out to the threads by a work stealing
+	// scheduler so they stay busy when some parts of the image take longer than others.
+	TileScheduler tileScheduler(pixWidth, pixHeight, config["tileSize"]);
 
-	if (config["shuffleScanlines"]) {
-		std::random_device rd;
-		std::mt19937 g(rd());
-		std::shuffle(scanlines.begin(), scanlines.end(), g);
-	}
+	// Images are saved as PNGs compressed in bands of rows on every thread.
+	PngSettings pngSettings;
+	pngSettings.level = config["pngCompressionLevel"];
+	PngEncoder pngEncoder(pngSettings);
 
 	auto startTime = std::chrono::steady_clock::now();
 
@@ -118,40 +188,232 @@ int main(int argc, char* argv[]) {
 	float x = hitInfo.hitT;
 
 
-	#pragma omp parallel for
-	for (int y = 0; y < pixHeight; ++y) {
-		for (int x = 0; x < pixWidth; ++x) {
-			Ray ray = cam.getRay(x, scanlines[y]);
-			HitInfo hitInfo;
-			if (scene.intersect(ray, 1e-6f, 1e6f, hitInfo, VISIBLE_BITMASK)) {
-				Eigen::Vector3f color = hitInfo.shader->getColor(
-					hitInfo, &scene,
-					lightSources, ambientLight,
-					0, config["maxBounces"]);
+	const int maxBounces = config["maxBounces"];
 
-				color.x() = std::min(color.x(), 1.f);
-				color.y() = std::min(color.y(), 1.f);
-				color.z() = std::min(color.z(), 1.f);
+	// As well as the output image, the render can save AOVs (e.g. depth or normals) listed
+	// in the config file as float images, kept in a Framebuffer while rendering. Denoising
+	// is guided by some AOVs of its own, so it enables those too.
+	std::vector<AOV> outputAOVs;
+	for (const auto& name : config["aovs"]) outputAOVs.push_back(parseAOV(name.get<std::string>()));
+	const bool denoise = config["denoise"] && config["integrator"] != "recursive";
+	std::vector<AOV> aovs(outputAOVs);
+	if (denoise) {
+		std::vector<AOV> guideAOVs = Denoiser::guideAOVs();
+		aovs.insert(aovs.end(), guideAOVs.begin(), guideAOVs.end());
+	}
+	Framebuffer framebuffer(pixWidth, pixHeight, aovs);
+
+	// Clamps a colour and writes it to the output image.
+	auto writeColor = [&](int x, int y, Eigen::Vector3f color) {
+		framebuffer.setBeauty(x, y, color);
+		color.x() = std::min(color.x(), 1.f);
+		color.y() = std::min(color.y(), 1.f);
+		color.z() = std::min(color.z(), 1.f);
+
+		int line = (pixHeight - y) - 1;
+		outImage[(x + line * pixWidth) * nChannels + 0] = color.x() * 255;
+		outImage[(x + line * pixWidth) * nChannels + 1] = color.y() * 255;
+		outImage[(x + line * pixWidth) * nChannels + 2] = color.z() * 255;
+		outImage[(x + line * pixWidth) * nChannels + 3] = 255;
+	};
 
+	// Shades a pixel given the result of intersecting its camera ray with the scene,
+	// and writes it to the output image and AOVs.
+	auto writePixel = [&](int x, int y, bool hit, const HitInfo& hitInfo) {
+		framebuffer.recordHit(x, y, hit, hitInfo);
+		if (hit) {
+			writeColor(x, y, hitInfo.shader->getColor(
+				hitInfo, &scene,
+				lightSources, ambientLight,
+				0, maxBounces));
+		}
+		else {
+			writeColor(x, y, Eigen::Vector3f::Zero());
+		}
+	};
 
-				int line = (pixHeight - scanlines[y]) - 1;
-				outImage[(x + line * pixWidth) * nChannels + 0] = color.x() * 255;
-				outImage[(x + line * pixWidth) * nChannels + 1] = color.y() * 255;
-				outImage[(x + line * pixWidth) * nChannels + 2] = color.z() * 255;
-				outImage[(x + line * pixWidth) * nChannels + 3] = 255;
+	// The integrators below take many samples per pixel, so their AOVs (other than the
+	// beauty) come from tracing one more ray through the centre of each pixel first. The
+	// traversal cost is the cost of that ray.
+	if (config["integrator"] != "recursive" && std::any_of(aovs.begin(), aovs.end(), [](AOV aov) { return aov != AOV::Beauty; })) {
+		tileScheduler.run([&](const Tile& tile) {
+			for (int y = tile.y0; y < tile.y1; ++y) {
+				for (int x = tile.x0; x < tile.x1; ++x) {
+					const TraversalStats before = TraversalStats::local();
+					HitInfo hitInfo;
+					bool hit = scene.intersect(cam.getRay(x, y, Eigen::Vector2f(.5f, .5f)), 1e-6f, 1e6f, hitInfo, VISIBLE_BITMASK);
+					framebuffer.recordHit(x, y, hit, hitInfo);
+					framebuffer.recordCost(x, y, TraversalStats::local() - before);
+				}
 			}
-			else {
-				int line = (pixHeight - scanlines[y]) - 1;
-				outImage[(x + line * pixWidth) * nChannels + 0] = 0;
-				outImage[(x + line * pixWidth) * nChannels + 1] = 0;
-				outImage[(x + line * pixWidth) * nChannels + 2] = 0;
-				outImage[(x + line * pixWidth) * nChannels + 3] = 255;
+		}, false);
+	}
+
+	// Images from the integrators below can be denoised before they're written, which
+	// lets them get away with far fewer samples.
+	std::unique_ptr<Denoiser> denoiser;
+	if (denoise) {
+		DenoiserSettings denoiserSettings;
+		denoiserSettings.iterations = config["denoiserIterations"];
+		denoiserSettings.colorSigma = config["denoiserColorSigma"];
+		denoiserSettings.normalSigma = config["denoiserNormalSigma"];
+		denoiserSettings.depthSigma = config["denoiserDepthSigma"];
+		denoiser = std::make_unique<Denoiser>(pixWidth, pixHeight, denoiserSettings);
+	}
+
+	// Denoises a floating point image (if enabled) and writes it to the output image.
+	auto writeColors = [&](std::vector<Eigen::Vector3f>& colors, bool reportTime) {
+		if (denoiser) {
+			auto denoiseStartTime = std::chrono::steady_clock::now();
+			denoiser->denoise(colors, framebuffer, tileScheduler);
+			auto denoiseTime = std::chrono::steady_clock::now() - denoiseStartTime;
+			if (reportTime) {
+				std::cout << "Denoise duration " << std::chrono::duration_cast<std::chrono::milliseconds>(denoiseTime).count() * 1e-3f
+					<< " seconds." << std::endl;
 			}
 		}
-		if (omp_get_thread_num() == omp_get_num_threads()-1) {
-			std::clog << "\rScanlines remaining: " << (pixHeight - y) << ' ' << std::flush;
+		for (int y = 0; y < pixHeight; ++y) {
+			for (int x = 0; x < pixWidth; ++x) {
+				writeColor(x, y, colors[x + y * pixWidth]);
+			}
 		}
+	};
+
+	// Camera rays can be traced in packets covering small tiles of pixels (2x2, 4x2 or 4x4
+	// for packet sizes 4, 8 and 16). Set rayPacketSize to 1 to trace one ray at a time.
+	// Only the recursive integrator uses packets, but the size is checked for all of them.
+	const int packetSize = config["rayPacketSize"];
+	if (packetSize != 1 && packetSize != 4 && packetSize != 8 && packetSize != 16)
+		throw std::runtime_error("rayPacketSize must be 1, 4, 8 or 16.");
 
+	// The wavefront integrator traces the image in large batches of rays, one bounce at a
+	// time, instead of recursing through the shaders for each pixel.
+	if (config["integrator"] == "wavefront") {
+		WavefrontIntegrator integrator(&scene, lightSources, ambientLight, maxBounces, config["wavefrontBatchSize"]);
+		std::vector<Eigen::Vector3f> colors;
+		integrator.render(cam, pixWidth, pixHeight, colors);
+		writeColors(colors, true);
+	}
+	// The progressive renderer averages jittered samples over many passes, until it runs
+	// out of time or reaches the sample count. It can save a preview image as it goes.
+	// The path tracer renders progressively too, with each sample a whole path traced by
+	// the PathTracer. It also lights the scene with a sky as bright as the ambient light.
+	else if (config["integrator"] == "progressive" || config["integrator"] == "pathtracer") {
+		const bool pathTracing = config["integrator"] == "pathtracer";
+		if (pathTracing) lightSources.push_back(std::make_unique<EnvironmentLight>(ambientLight));
+		PathTracerSettings pathTracerSettings;
+		pathTracerSettings.maxBounces = config["pathTracerMaxBounces"];
+		pathTracerSettings.rouletteStartBounce = config["pathTracerRouletteStartBounce"];
+		PathTracer pathTracer(&scene, lightSources, ambientLight, pathTracerSettings);
+
+		ProgressiveRenderer renderer(pixWidth, pixHeight);
+		auto resolve = [&](bool final) {
+			std::vector<Eigen::Vector3f> colors(pixWidth * pixHeight);
+			for (int y = 0; y < pixHeight; ++y) {
+				for (int x = 0; x < pixWidth; ++x) {
+					colors[x + y * pixWidth] = renderer.color(x, y);
+				}
+			}
+			writeColors(colors, final);
+		};
+		const std::string previewFilename = config["progressivePreviewFilename"];
+		int passes = renderer.render(cam, tileScheduler,
+			[&](const Ray& ray, Sampler& sampler) {
+				if (pathTracing) return pathTracer.radiance(ray, sampler);
+				HitInfo hitInfo;
+				if (!scene.intersect(ray, 1e-6f, 1e6f, hitInfo, VISIBLE_BITMASK)) return Eigen::Vector3f(Eigen::Vector3f::Zero());
+				return hitInfo.shader->getColor(hitInfo, &scene, lightSources, ambientLight, 0, maxBounces);
+			},
+			config["progressiveTimeBudget"], config["progressiveMaxSamples"], config["progressivePreviewInterval"],
+			[&]() {
+				resolve(false);
+				unsigned errorCode = pngEncoder.save(previewFilename, outImage, pixWidth, pixHeight);
+				if (errorCode) std::cout << "lodepng error encoding preview: " << lodepng_error_text(errorCode) << std::endl;
+			});
+		resolve(true);
+		std::cout << "Rendered " << passes << " progressive passes." << std::endl;
+	}
+	// The adaptive renderer anti-aliases by adding samples only on edges and noisy pixels.
+	else if (config["integrator"] == "adaptive") {
+		AdaptiveSettings settings;
+		settings.baseSamples = config["adaptiveBaseSamples"];
+		settings.maxSamples = config["adaptiveMaxSamples"];
+		settings.refineSamples = config["adaptiveRefineSamples"];
+		settings.varianceThreshold = config["adaptiveVarianceThreshold"];
+		settings.contrastThreshold = config["adaptiveContrastThreshold"];
+		AdaptiveRenderer renderer(pixWidth, pixHeight, settings);
+		long long samples = renderer.render(cam, tileScheduler, [&](const Ray& ray, bool& hit, HitInfo& hitInfo) {
+			hit = scene.intersect(ray, 1e-6f, 1e6f, hitInfo, VISIBLE_BITMASK);
+			if (!hit) return Eigen::Vector3f(Eigen::Vector3f::Zero());
+			return hitInfo.shader->getColor(hitInfo, &scene, lightSources, ambientLight, 0, maxBounces);
+		});
+		std::vector<Eigen::Vector3f> colors(pixWidth * pixHeight);
+		for (int y = 0; y < pixHeight; ++y) {
+			for (int x = 0; x < pixWidth; ++x) {
+				colors[x + y * pixWidth] = renderer.color(x, y);
+			}
+		}
+		writeColors(colors, true);
+		std::cout << "Adaptive sampling took " << samples << " samples, "
+			<< static_cast<float>(samples) / (pixWidth * pixHeight) << " per pixel." << std::endl;
+	}
+	// The recursive integrator shades each camera ray through the shaders' getColor.
+	else if (config["integrator"] == "recursive") {
+		if (packetSize > 1) {
+			const int packetWidth = packetSize == 4 ? 2 : 4;
+			const int packetHeight = packetSize / packetWidth;
+
+			// Packets past the edge of a tile have those lanes switched off, so no pixel is
+			// traced by two tiles whatever the tile size.
+			tileScheduler.run([&](const Tile& tile) {
+				for (int y0 = tile.y0; y0 < tile.y1; y0 += packetHeight) {
+					for (int x0 = tile.x0; x0 < tile.x1; x0 += packetWidth) {
+						RayPacket packet;
+						packet.size = packetSize;
+						for (int lane = 0; lane < packetSize; ++lane) {
+							int x = x0 + lane % packetWidth, y = y0 + lane / packetWidth;
+							if (x < tile.x1 && y < tile.y1) packet.setRay(lane, cam.getRay(x, y));
+						}
+
+						HitInfo hitInfo[RayPacket::maxSize];
+						bool hit[RayPacket::maxSize];
+						const TraversalStats packetStart = TraversalStats::local();
+						scene.intersectPacket(packet, 1e-6f, 1e6f, hitInfo, hit, VISIBLE_BITMASK);
+						const TraversalStats packetCost = TraversalStats::local() - packetStart;
+						const int activeLanes = static_cast<int>(std::count(packet.active, packet.active + packetSize, true));
+
+						// Each pixel's cost is an equal share of tracing the packet, plus its shading.
+						for (int lane = 0; lane < packetSize; ++lane) {
+							if (!packet.active[lane]) continue;
+							const int x = x0 + lane % packetWidth, y = y0 + lane / packetWidth;
+							const TraversalStats before = TraversalStats::local();
+							writePixel(x, y, hit[lane], hitInfo[lane]);
+							TraversalStats cost = TraversalStats::local() - before;
+							cost.nodes += packetCost.nodes / activeLanes;
+							cost.primitives += packetCost.primitives / activeLanes;
+							framebuffer.recordCost(x, y, cost);
+						}
+					}
+				}
+			});
+		}
+		else {
+			tileScheduler.run([&](const Tile& tile) {
+				for (int y = tile.y0; y < tile.y1; ++y) {
+					for (int x = tile.x0; x < tile.x1; ++x) {
+						const TraversalStats before = TraversalStats::local();
+						Ray ray = cam.getRay(x, y);
+						HitInfo hitInfo;
+						bool hit = scene.intersect(ray, 1e-6f, 1e6f, hitInfo, VISIBLE_BITMASK);
+						writePixel(x, y, hit, hitInfo);
+						framebuffer.recordCost(x, y, TraversalStats::local() - before);
+					}
+				}
+			});
+		}
+	}
+	else {
+		throw std::runtime_error("Unknown integrator: " + config["integrator"].get<std::string>());
 	}
 
 	auto renderTime = std::chrono::steady_clock::now() - startTime;
@@ -159,12 +421,22 @@ int main(int argc, char* argv[]) {
 	std::cout << "Render duration " << std::chrono::duration_cast<std::chrono::milliseconds>(renderTime).count() * 1e-3f << " seconds." << std::endl;
 
 	// *** Save the output image ***
+	auto encodeStartTime = std::chrono::steady_clock::now();
+	std::vector<unsigned char> png;
 	int errorCode;
-	errorCode = lodepng::encode(config["outputFilename"], outImage, pixWidth, pixHeight);
+	errorCode = pngEncoder.encode(png, outImage, pixWidth, pixHeight);
 	if (errorCode) { // check the error code, in case an error occurred.
 		std::cout << "lodepng error encoding image: " << lodepng_error_text(errorCode) << std::endl;
 		return errorCode;
 	}
+	auto encodeTime = std::chrono::steady_clock::now() - encodeStartTime;
+	std::cout << "Encode duration " << std::chrono::duration_cast<std::chrono::milliseconds>(encodeTime).count() * 1e-3f << " seconds." << std::endl;
+	errorCode = lodepng::save_file(png, config["outputFilename"]);
+	if (errorCode) {
+		std::cout << "lodepng error saving image: " << lodepng_error_text(errorCode) << std::endl;
+		return errorCode;
+	}
+	framebuffer.write(config["outputFilename"], outputAOVs);
 
 	return 0;
 }
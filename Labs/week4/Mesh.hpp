@@ -1,6 +1,7 @@
 #include <Eigen/Dense>
 #include <vector>
-#include <fstream>
+#include <string>
+#include "ObjLoader.hpp"
 
 struct Mesh {
 	std::vector<Eigen::Vector3f> verts;
@@ -12,32 +13,15 @@ Mesh loadMeshFile(const std::string& filename)
 {
 	Mesh mesh;
 
-	std::ifstream file(filename);
+	ObjData obj = ObjLoader::load(filename);
 
-	std::string line;
-	while (!file.eof())
-	{
-		std::getline(file, line);
-		std::stringstream lineSS(line.c_str());
-		char lineStart;
-		lineSS >> lineStart;
-		char ignoreChar;
-		if (lineStart == 'v') {
-			Eigen::Vector3f v;
-			for (int i = 0; i < 3; ++i) lineSS >> v[i];
-			mesh.verts.push_back(v);
-		}
+	for (int i = 0; i < obj.npositions(); ++i) mesh.verts.push_back(Eigen::Map<const Eigen::Vector3f>(&obj.positions[3 * i]));
 
-		if (lineStart == 'f') {
-			std::vector<unsigned int> face;
-			unsigned int idx, idxTex, idxNorm;
-			while (lineSS >> idx >> ignoreChar >> idxTex >> ignoreChar >> idxNorm) {
-				face.push_back(idx - 1);
-			}
-			if (face.size() > 0) mesh.faces.push_back(face);
-		}
+	for (int f = 0; f < obj.nfaces(); ++f) {
+		std::vector<unsigned int> face;
+		for (int i = 0; i < obj.faceSize(f); ++i) face.push_back(obj.corner(f, i).vert);
+		if (face.size() > 0) mesh.faces.push_back(face);
 	}
 
 	return mesh;
 }
-
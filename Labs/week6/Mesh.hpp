@@ -1,7 +1,10 @@
 #pragma once
 #include <Eigen/Dense>
 #include <vector>
-#include <fstream>
+#include <array>
+#include <string>
+#include <stdexcept>
+#include "ObjLoader.hpp"
 
 struct Mesh {
 	std::vector<Eigen::Vector3f> verts;
@@ -17,57 +20,29 @@ Mesh loadMeshFile(const std::string& filename)
 {
 	Mesh mesh;
 
-	std::ifstream file(filename);
+	ObjData obj = ObjLoader::load(filename);
 
-	if (file.fail()) throw std::runtime_error("Unable to find mesh file: " + filename);
+	for (int i = 0; i < obj.npositions(); ++i) mesh.verts.push_back(Eigen::Map<const Eigen::Vector3f>(&obj.positions[3 * i]));
+	for (int i = 0; i < obj.nnormals(); ++i) mesh.norms.push_back(Eigen::Map<const Eigen::Vector3f>(&obj.normals[3 * i]));
+	for (int i = 0; i < obj.ntexCoords(); ++i) mesh.texs.push_back(Eigen::Map<const Eigen::Vector2f>(&obj.texCoords[3 * i]));
 
-	std::string line;
-	while (!file.eof())
-	{
-		std::getline(file, line);
-		std::stringstream lineSS(line.c_str());
-		char lineStart;
-		lineSS >> lineStart;
-		char ignoreChar;
-		if (lineStart == 'v') {
-			if (line[1] == ' ') {
-				Eigen::Vector3f v;
-				for (int i = 0; i < 3; ++i) lineSS >> v[i];
-				mesh.verts.push_back(v);
-			}
-			else if (line[1] == 'n') {
-				lineSS >> ignoreChar;
-				Eigen::Vector3f n;
-				for (int i = 0; i < 3; ++i) lineSS >> n[i];
-				mesh.norms.push_back(n);
-			}
-			else if (line[1] == 't') {
-				lineSS >> ignoreChar;
-				Eigen::Vector2f t;
-				for (int i = 0; i < 2; ++i) lineSS >> t[i];
-				mesh.texs.push_back(t);
-			}
-
-		}
-
-		if (lineStart == 'f') {
+	// Polygons are split into a fan of triangles around their first corner.
+	for (int f = 0; f < obj.nfaces(); ++f) {
+		for (int i = 2; i < obj.faceSize(f); ++i) {
+			const ObjCorner corners[3] = { obj.corner(f, 0), obj.corner(f, i - 1), obj.corner(f, i) };
 			std::array<unsigned int, 3> vFace, nFace, tFace;
-			unsigned int idx, idxTex, idxNorm;
-			int i = 0;
-			while (lineSS >> idx >> ignoreChar >> idxTex >> ignoreChar >> idxNorm) {
-				vFace[i] = idx - 1;
-				nFace[i] = idxNorm - 1;
-				tFace[i] = idxTex - 1;
-				++i;
-			}
-			if (i > 0) {
-				mesh.vFaces.push_back(vFace);
-				mesh.nFaces.push_back(nFace);
-				mesh.tFaces.push_back(tFace);
+			for (int c = 0; c < 3; ++c) {
+				if (corners[c].tex < 0 || corners[c].norm < 0)
+					throw std::runtime_error("Mesh file faces need texture coordinates and normals: " + filename);
+				vFace[c] = corners[c].vert;
+				nFace[c] = corners[c].norm;
+				tFace[c] = corners[c].tex;
 			}
+			mesh.vFaces.push_back(vFace);
+			mesh.nFaces.push_back(nFace);
+			mesh.tFaces.push_back(tFace);
 		}
 	}
 
 	return mesh;
 }
-